@@ -1,5 +1,6 @@
 /// \brief A simple profiler that generates json that can be loaded into chrome://tracing
-///       It is implemented lock free and allocation free (during profiling) with no platform specific code. 
+///       It is implemented lock free and allocation free (during profiling), only the first use registrations listed under 
+///       Thread safety take a mutex. The core is portable C++, some optional features are POSIX or Linux only (as noted).
 /// 
 /// See:  http://www.gamasutra.com/view/news/176420/Indepth_Using_Chrometracing_to_view_your_inline_profiling_data.php
 ///       https://aras-p.info/blog/2017/01/23/Chrome-Tracing-as-Profiler-Frontend/
@@ -24,20 +25,203 @@
 ///      PROFILE_TAG_VALUE("TagName", 123); // Add an instant tag with a value
 ///    PROFILE_END(string) or PROFILE_ENDFILEJSON("filename") // Writes tags to a string or a file
 /// 
+///    For continuous profiling, a snapshot can be taken without stopping the capture. Recording swaps to a second 
+///    record buffer and the retired buffer is written to a file on a background thread.
+///    eg. PROFILE_SNAPSHOT("filename");                // Writes the records since the last snapshot to a timestamped file
+///        PROFILE_ROTATION_BEGIN("filename", 10000);   // Snapshot to a new timestamped file every 10 seconds
+///        PROFILE_ROTATION_END();                      // Stop the periodic snapshots (also stopped by PROFILE_END)
+/// 
+///    To watch a long running capture live, the records can be streamed to a local receiver (needs TAREN_PROFILER_STREAMING).
+///    eg. ProfileStreamReceiver /tmp/myapp.sock          // Start Tools/ProfileStreamReceiver.cpp first, it listens on the socket
+///        PROFILE_STREAM_BEGIN("/tmp/myapp.sock", 100);  // Swap and send the completed records every 100 milliseconds
+///        PROFILE_STREAM_END();                          // Stop streaming (also stopped by PROFILE_END)
+/// 
+///    A service can be profiled on demand without a restart by a controller thread (needs TAREN_PROFILER_CONTROL).
+///    eg. PROFILE_CONTROL_BEGIN("/var/tmp/myapp", 30000, "/var/tmp/myapp.profile"); // At startup, captures are up to 30 seconds
+///        kill -USR1 <pid>                              // Starts a capture (or create the control file), kill -USR2 <pid> ends it early
+///        echo "5000 /var/tmp/slow" > /var/tmp/myapp.profile // Starts a 5 second capture written to /var/tmp/slow_<date>.json
+/// 
+///    To keep a capture if the process crashes, record into a memory mapped file (needs TAREN_PROFILER_MAPPED_FILE).
+///    eg. PROFILE_BEGIN_MAPPEDFILE("capture.tpf");     // Use in place of PROFILE_BEGIN()
+///        ProfileMappedConvert capture.tpf out.json    // After a crash, convert the file with Tools/ProfileMappedConvert.cpp
+/// 
+///    To profile worker processes into the same trace, the parent records into a shared memory arena that the workers 
+///    attach to (needs TAREN_PROFILER_SHARED_MEMORY). Forked children attach automatically.
+///    eg. PROFILE_BEGIN_SHAREDMEMORY("/myapp_profile"); // In the parent, in place of PROFILE_BEGIN()
+///        PROFILE_ATTACH_SHAREDMEMORY("/myapp_profile"); // In a spawned worker (the name can be passed on the command line)
+///        PROFILE_ENDFILEJSON("filename");               // In the parent, writes the records of all the processes
+/// 
 ///    Default tags must be a string literal or it will fail to compile. If you need a dynamic string, 
 ///    there is a limited scratch buffer that is used with the COPY / FORMAT / PRINTF variants of the tag types.
 ///    eg. PROFILE_TAG_PRINTF_BEGIN("Value %d", 1234);
 ///        PROFILE_TAG_FORMAT_BEGIN("Value {}", 1234);
 ///        PROFILE_TAG_COPY_BEGIN(dynamicString.c_str());
 /// 
+///    Values of a SEQUENTIAL_ENUM (see EnumMacros.h) can be used as tags. Each enum type registers a descriptor per value the 
+///    first time it is used, so the record stores a 32 bit tag id and the name is the enum string (no copy or formatting).
+///    eg. PROFILE_SCOPE_ENUM(MyPhase::Parse);
+///        PROFILE_SCOPE_ENUM(phase);                  // Can be a variable
+/// 
+///    Scopes can have key / value args (integer, floating point or literal string values), written to the event's "args".
+///    eg. PROFILE_SCOPE_ARGS("Upload", "bytes", byteCount, "shard", shardIndex, "mode", "async");
+/// 
+///    A scope can have a latency budget. When it ends over budget, the end event is marked with "over_budget" (counted in the 
+///    aggregates) and the callback set with SetBudgetCallback() is called on the thread that ended the scope.
+///    eg. taren_profiler::SetBudgetCallback(OnOverBudget);          // void OnOverBudget(const char* name, uint64_t durationNS, uint64_t budgetNS)
+///        PROFILE_SCOPE_BUDGET("HandleRequest", std::chrono::milliseconds(2));
+/// 
+///    Process stats and registered values can be sampled as counter tracks by a gauge thread (needs TAREN_PROFILER_GAUGES).
+///    eg. int32_t GetQueueDepth(void* userData);                       // Called on the gauge thread each period
+///        uint32_t gaugeID = taren_profiler::RegisterGauge("QueueDepth", GetQueueDepth, &queue);
+///        taren_profiler::UnregisterGauge(gaugeID);                    // Before the user data is destroyed
+/// 
+///    Each literal tag call site registers a static descriptor (name, file, line, category) the first time it is run, 
+///    so records only store a 32 bit tag id. A category can be supplied for the trace viewer's "cat" field.
+///    eg. PROFILE_SCOPE_CATEGORY("TagName", "Category");
+///        PROFILE_TAG_CATEGORY_BEGIN("TagName", "Category");
+/// 
+///    Work that suspends on one thread and resumes on another (eg. a C++20 coroutine) can be tagged as a task. Each task is 
+///    written as an async slice on a "Tasks" track, with a "Suspended" child slice for each suspension, and the json has a 
+///    "tasks" array with the count, total and suspended time of each task name.
+///    eg. PROFILE_TASK_BEGIN("LoadAsset", taskID);   // taskID is unique while the task runs (eg. the coroutine frame address)
+///        PROFILE_TASK_SUSPEND(taskID);              // At co_await
+///        PROFILE_TASK_RESUME(taskID);               // When resumed (on any thread)
+///        PROFILE_TASK_END(taskID);
+/// 
+///    A server can record only a sampled fraction of requests with a per-thread trace context (needs TAREN_PROFILER_TRACE_CONTEXT).
+///    eg. taren_profiler::SetRequestSampleRate(100);  // Record one in 100 requests (decided by a hash of the request id)
+///        PROFILE_REQUEST(requestID);                 // At request entry, for the scope of the request
+///        PROFILE_TRACE_CONTEXT_GET(context);         // Hand the request to another thread (tasks carry it automatically)
+///        PROFILE_TRACE_CONTEXT(context);             // In the other thread, for the scope of its work on the request
+/// 
 ///  Thread safety: 
-///    The tag calls are thread safe, but the PROFILE_BEGIN() / PROFILE_END() are not. If you need to call these concurrently, protect with a mutex.
+///    The tag calls are thread safe. Begin(), End(), Snapshot() and QueryStats() are serialized by a control mutex, so they can be 
+///    called from any thread (a Begin() or End() that finds profiling already started / ended returns false). End() first stops 
+///    the rotation and stream threads, concurrent calls wait for the thread to be joined. A rotation or stream begun while End() 
+///    is running is not stopped by it, call EndRotation() / EndStream().
+///    PROFILE_SNAPSHOT() can be called from any thread while profiling is running.
+///    The first use of an enum tag type, a ProfiledMutex name or a gauge takes a registration mutex, and the ProfilerIO.h open 
+///    wrappers store the file path under a mutex.
+///    Gauge callbacks are called on the gauge thread without the registration mutex, UnregisterGauge() waits for a call in progress.
+///    With TAREN_PROFILER_SLOWEST, a scope end never waits for a lock, a scope that ends while another thread (or End()) is using 
+///    the tag's kept scopes is not kept.
 /// 
 ///  Resource limits:
 ///    The profiler has some hard coded limits that can be overridden by specifying some project #defines:
-///    TAREN_PROFILER_TAG_MAX_COUNT        - How many tags to support in a capture
+///    TAREN_PROFILER_TAG_MAX_COUNT        - How many tags to support in a capture (or between snapshots)
 ///    TAREN_PROFILER_TAG_NAME_BUFFER_SIZE - Size of the buffer that caches dynamic tag names
+///    TAREN_PROFILER_TAG_DESCRIPTOR_COUNT - How many literal tag call sites can be registered
+///    TAREN_PROFILER_TAG_ARG_COUNT        - How many PROFILE_SCOPE_ARGS() key / value args can be recorded in a capture (or between snapshots)
+///    TAREN_PROFILER_ADDRESS_TAG_COUNT    - How many unique function addresses / uncopied ProfileTag() strings can be recorded (power of 2)
+///    TAREN_PROFILER_QUERY_THREAD_COUNT   - How many threads QueryStats() can track
+///    TAREN_PROFILER_QUERY_STACK_DEPTH    - How many nested tags per thread QueryStats() can track
+///    TAREN_PROFILER_METRICS_TAG_COUNT    - How many tags are written by WriteMetrics()
+///    TAREN_PROFILER_LOCK_COUNT           - How many uniquely named ProfiledMutex locks can be tracked
+///    TAREN_PROFILER_IO_FD_COUNT          - How many file descriptors (0 to count - 1) the ProfilerIO.h wrappers track stats for
+///    TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE - Size of the tag name table in a mapped file capture
+///    TAREN_PROFILER_SHARED_PROCESS_COUNT - How many processes (including the parent) can record into a shared memory arena
+///    TAREN_PROFILER_SAMPLE_COUNT         - How many stack samples can be recorded in a capture
+///    TAREN_PROFILER_SAMPLE_DEPTH         - How many frames are recorded in each stack sample
+///    TAREN_PROFILER_GAUGE_COUNT          - How many gauges can be registered with RegisterGauge()
+///    TAREN_PROFILER_GAUGE_PERIOD_MS      - How often the gauge thread samples, in milliseconds
+///    TAREN_PROFILER_HISTOGRAM_TAG_COUNT  - How many literal tags each thread keeps a TAREN_PROFILER_HISTOGRAMS histogram for
+///    TAREN_PROFILER_HISTOGRAM_THREAD_COUNT - The histogram pool has TAREN_PROFILER_HISTOGRAM_TAG_COUNT histograms for this many threads
+///    TAREN_PROFILER_SLOWEST_COUNT        - How many of the slowest scopes of each tag are kept with TAREN_PROFILER_SLOWEST
+///    TAREN_PROFILER_SLOWEST_TAG_COUNT    - How many literal tags TAREN_PROFILER_SLOWEST keeps scopes for
+///    TAREN_PROFILER_SLOWEST_RECORD_COUNT - How many of the latest records each thread keeps, the most a kept scope can contain
+///    TAREN_PROFILER_TASK_CONTEXT_COUNT   - How many running tasks begun in a request can carry its trace context (power of 2)
 ///    TAREN_PROFILER_FORMAT_COUNT         - Max size of a dynamic tag
+///
+///  Optional features:
+///    These are enabled by specifying project #defines:
+///    TAREN_PROFILER_PERF_COUNTERS - (Linux only) Reads per-thread perf_event counters (cycles, instructions, cache misses, branch misses) 
+///                                   at each tag begin/end. If hardware counters are unavailable, software counters are used 
+///                                   (task clock, page faults, context switches, cpu migrations). Deltas are written as end event args.
+///    TAREN_PROFILER_RECORD_CPU    - Records the cpu core of each tag. A "CpuMigration" instant event is written when a thread changes 
+///                                   core between records, and the aggregates contain how many migrations happened during each tag.
+///    TAREN_PROFILER_THREAD_CPU_TIME - (POSIX only) Reads the thread cpu time (CLOCK_THREAD_CPUTIME_ID) at each tag begin/end. The on-cpu 
+///                                   time, off-cpu time (descheduled or blocked) and cpu / wall ratio are written as end event args 
+///                                   ("cpu_us", "off_cpu_us", "cpu_ratio") and as aggregate columns, to separate cpu work from waiting.
+///    TAREN_PROFILER_INSTRUMENT_FUNCTIONS - (GCC/Clang only) Define in the implementation .cpp to add the __cyg_profile_func_enter/exit 
+///                                   hooks, then compile the code to profile with -finstrument-functions (and link with -rdynamic so 
+///                                   function names can be found). Each instrumented function becomes a tag, named with dladdr when written.
+///                                   PROFILE_INSTRUMENT_EXCLUDE("std::") skips functions with a demangled name prefix, and only 
+///                                   TAREN_PROFILER_INSTRUMENT_MAX_DEPTH nested calls are recorded to bound the overhead.
+///    ProfilerMutex.h              - Include for the taren_profiler::ProfiledMutex / ProfiledSharedMutex wrappers. Waiting for a contended 
+///                                   lock is recorded as a scope named after the lock (category "lock"), and a "locks" array is written 
+///                                   with the acquire count, contended count, wait and hold times of each named lock.
+///    ProfilerIO.h                 - (POSIX only) Include for the taren_profiler::io::read / write / pread / pwrite / fsync / ... wrappers. 
+///                                   Each call is recorded as a scope (category "io") with the fd, requested and transferred bytes as 
+///                                   args, and an "io" array is written with the calls, bytes, time and throughput of each fd.
+///    TAREN_PROFILER_MAPPED_FILE   - (POSIX only) Adds BeginMappedFile("file.tpf"), which starts profiling with the record buffers, tag 
+///                                   descriptors and tag names in a file backed shared mapping, so the capture survives a crash. 
+///                                   Convert a file with Tools/ProfileMappedConvert.cpp (incomplete records are skipped).
+///    TAREN_PROFILER_SHARED_MEMORY - (POSIX only, implies TAREN_PROFILER_MAPPED_FILE) Adds BeginSharedMemory("/name"), which records into 
+///                                   a shm_open() arena with the mapped file layout, and AttachSharedMemory("/name") for worker processes 
+///                                   (forked children attach in a pthread_atfork() handler). Workers claim record slots in the shared 
+///                                   buffer with the same atomics as threads, and register their tags in a per-process table, so the 
+///                                   parent's End() writes every process in one trace (threads of a worker are named with its pid). 
+///                                   End() in a worker only stops its recording. Snapshots, QueryStats(), histograms, locks and samples 
+///                                   only cover the parent process. All processes must be built with the same profiler defines.
+///    TAREN_PROFILER_HISTOGRAMS    - Each thread keeps a fixed size log-linear latency histogram (about 2 significant digits) per literal 
+///                                   tag, independent of the record buffer. End() merges them across threads and writes a "histograms" 
+///                                   array with the p50/p90/p99/p99.9/max time of each tag, so tail latency is available for scopes 
+///                                   that run far more often than TAREN_PROFILER_TAG_MAX_COUNT. Copied tags are not included. 
+///                                   The histograms (about 9KB each) are claimed lock free from a fixed static pool, and returned 
+///                                   to it when their thread exits. 
+///                                   A thread's histogram of a tag is allocated under a mutex at its first use (see Thread safety).
+///    TAREN_PROFILER_SLOWEST       - Keeps the TAREN_PROFILER_SLOWEST_COUNT slowest scopes of each literal tag with their nested records, 
+///                                   copied from a small per-thread ring of the latest records when the scope ends (only when the 
+///                                   scope is slower than the kept ones, see Thread safety). End() writes only the kept scopes as trace events, plus a 
+///                                   "slowest" array of their times, so long runs give small files. The aggregates still cover every 
+///                                   record. Scopes with more nested records than the ring are kept without them ("truncated").
+///                                   Snapshots, tasks, gauges and other processes are written as usual. The kept scopes are static 
+///                                   memory (about 37MB of slots with the defaults), only the slots of the tags used are touched.
+///    TAREN_PROFILER_SAMPLING      - (POSIX, GCC/Clang) Samples the call stack with backtrace() on a SIGPROF timer (ITIMER_PROF, so only 
+///                                   threads using cpu are sampled) at TAREN_PROFILER_SAMPLE_RATE per second of cpu time. End() symbolizes 
+///                                   the samples with dladdr (link with -rdynamic) and writes each as an instant event named after the leaf 
+///                                   function, with its stack in "stackFrames", and a "sample_functions" array with the self / total 
+///                                   sample count of each function. Snapshots do not include samples. The SIGPROF handler is replaced.
+///    TAREN_PROFILER_STREAMING     - (POSIX only) Adds BeginStream("/path.sock"), which connects to a Unix domain socket and starts a 
+///                                   thread that swaps the record buffers each period (like a snapshot) and sends the retired buffer 
+///                                   as binary record batches, with incremental updates of the tag name table. Memory stays bounded by 
+///                                   the two record buffers, and the receiver sees scopes within a period of them completing. 
+///                                   Tools/ProfileStreamReceiver.cpp prints a live per-tag summary and can write the json. Args and 
+///                                   task tags are not streamed, and snapshots are not available while streaming. Each batch has the 
+///                                   number of records dropped as the buffer was full in its period, which the receiver reports.
+///    TAREN_PROFILER_CONTROL       - (POSIX only) Adds BeginControl(), which installs SIGUSR1 / SIGUSR2 handlers that only set an atomic 
+///                                   flag, and starts a thread that polls the flag and an optional control file every 100 milliseconds. 
+///                                   A request calls Begin(), and the capture is written with EndFileJson() after the duration limit or 
+///                                   a stop request. Requests are ignored while the application is already profiling.
+///    TAREN_PROFILER_GAUGES        - Starts a thread with PROFILE_BEGIN() that samples every TAREN_PROFILER_GAUGE_PERIOD_MS and records 
+///                                   counter ("C") events (category "gauge"). On POSIX it records the process cpu % of one core, the 
+///                                   minor / major page faults and voluntary / involuntary context switches since the last sample 
+///                                   (getrusage), and on Linux the resident set size in KB (/proc/self/statm). Callbacks registered 
+///                                   with RegisterGauge() are called on the gauge thread, their int32 values are recorded as tracks.
+///    TAREN_PROFILER_TRACE_CONTEXT - Adds a thread local trace context (request id, sampled flag) set by PROFILE_REQUEST(), with head 
+///                                   sampling decided once per request by SetRequestSampleRate(). The tags of an unsampled request are 
+///                                   not recorded, and the begin events of a sampled request get a "request_id" arg. A task begun in 
+///                                   a request while profiling restores its context on the thread that resumes it, until it suspends 
+///                                   or ends (the contexts are kept in a fixed lock free table, cleared by Begin()). 
+///                                   The lock and I/O stats still count every request. Request ids are not streamed.
+///
+///  Multiple processes:
+///    The json starts with an "otherData" object with the process id and the capture start time on the system wide monotonic 
+///    clock, so the captures of several processes can be merged into one timeline with Tools/ProfileMerge.cpp.
+///
+///  Aggregates:
+///    Along with the trace events, the json contains an "aggregates" array with the per-tag count, total, self and max times 
+///    (and counter totals if enabled) of the scopes in the capture.
+///
+///  Live statistics:
+///    While profiling, taren_profiler::QueryStats() returns the per-tag count, total, max and percentile times of the scopes 
+///    completed so far (optionally only the last N milliseconds), without stopping the capture. 
+///    eg. taren_profiler::TagStats stats[256];
+///        uint32_t count = taren_profiler::QueryStats(stats, 256, 10000); // Stats of the last 10 seconds, most expensive first
+///
+///    The same stats can be written in the OpenMetrics (Prometheus) text format, as a per-tag call counter and duration histogram.
+///    eg. PROFILE_METRICS(string);          // Writes metrics to a string
+///        PROFILE_METRICSFILE("filename");  // Writes metrics to a file (replaced atomically for file collectors)
 #pragma once
 
 // TODO: Test thread safety in End() code
@@ -52,55 +236,128 @@
 #define PROFILE_PRINTF_INTERNAL(...) char buf[TAREN_PROFILER_FORMAT_COUNT]; std::snprintf(buf, TAREN_PROFILER_FORMAT_COUNT, __VA_ARGS__)
 
 #define PROFILE_BEGIN(...) taren_profiler::Begin(__VA_ARGS__)
+#define PROFILE_BEGIN_MAPPEDFILE(...) taren_profiler::BeginMappedFile(__VA_ARGS__)
+#define PROFILE_BEGIN_SHAREDMEMORY(...) taren_profiler::BeginSharedMemory(__VA_ARGS__)
+#define PROFILE_ATTACH_SHAREDMEMORY(...) taren_profiler::AttachSharedMemory(__VA_ARGS__)
 #define PROFILE_END(...) taren_profiler::End(__VA_ARGS__)
 #define PROFILE_ENDFILEJSON(...) taren_profiler::EndFileJson(__VA_ARGS__)
+#define PROFILE_SNAPSHOT(...) taren_profiler::Snapshot(__VA_ARGS__)
+#define PROFILE_ROTATION_BEGIN(...) taren_profiler::BeginRotation(__VA_ARGS__)
+#define PROFILE_ROTATION_END() taren_profiler::EndRotation()
+#define PROFILE_STREAM_BEGIN(...) taren_profiler::BeginStream(__VA_ARGS__)
+#define PROFILE_STREAM_END() taren_profiler::EndStream()
+#define PROFILE_CONTROL_BEGIN(...) taren_profiler::BeginControl(__VA_ARGS__)
+#define PROFILE_CONTROL_END() taren_profiler::EndControl()
+#define PROFILE_METRICS(...) taren_profiler::WriteMetrics(__VA_ARGS__)
+#define PROFILE_METRICSFILE(...) taren_profiler::WriteMetricsFile(__VA_ARGS__)
+#define PROFILE_INSTRUMENT_EXCLUDE(str) static_assert(str[0] != 0, "Only literal strings"); taren_profiler::InstrumentExclude(str)
+
+#define PROFILE_TAG_ID_INTERNAL(str, category) []() { static const uint32_t s_tagID = taren_profiler::RegisterTag(str, __FILE__, __LINE__, category); return s_tagID; }()
 
-#define PROFILE_TAG_BEGIN(str) static_assert(str[0] != 0, "Only literal strings - Use PROFILE_TAGCOPY_BEGIN"); taren_profiler::ProfileTag(taren_profiler::TagType::Begin, str)
+#define PROFILE_TAG_BEGIN(str) static_assert(str[0] != 0, "Only literal strings - Use PROFILE_TAGCOPY_BEGIN"); taren_profiler::ProfileTagID(taren_profiler::TagType::Begin, PROFILE_TAG_ID_INTERNAL(str, ""))
+#define PROFILE_TAG_CATEGORY_BEGIN(str, category) static_assert(str[0] != 0, "Only literal strings - Use PROFILE_TAGCOPY_BEGIN"); taren_profiler::ProfileTagID(taren_profiler::TagType::Begin, PROFILE_TAG_ID_INTERNAL(str, category))
 #define PROFILE_TAG_COPY_BEGIN(str) taren_profiler::ProfileTag(taren_profiler::TagType::Begin, str, true)
 #define PROFILE_TAG_FORMAT_BEGIN(...) if(taren_profiler::IsProfiling()) { PROFILE_FORMAT_INTERNAL(__VA_ARGS__); PROFILE_TAG_COPY_BEGIN(buf); }
 #define PROFILE_TAG_PRINTF_BEGIN(...) if(taren_profiler::IsProfiling()) { PROFILE_PRINTF_INTERNAL(__VA_ARGS__); PROFILE_TAG_COPY_BEGIN(buf); }
-#define PROFILE_TAG_END() taren_profiler::ProfileTag(taren_profiler::TagType::End, nullptr)
+#define PROFILE_TAG_END() taren_profiler::ProfileTagID(taren_profiler::TagType::End, 0)
 
 #define PROFILE_SCOPE_INTERNAL2(X,Y) X ## Y
 #define PROFILE_SCOPE_INTERNAL(a,b) PROFILE_SCOPE_INTERNAL2(a,b)
 #define PROFILE_SCOPE(str) PROFILE_TAG_BEGIN(str); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
+#define PROFILE_SCOPE_CATEGORY(str, category) PROFILE_TAG_CATEGORY_BEGIN(str, category); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
 #define PROFILE_SCOPE_COPY(str) PROFILE_TAG_COPY_BEGIN(str); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
 #define PROFILE_SCOPE_FORMAT(...) PROFILE_TAG_FORMAT_BEGIN(__VA_ARGS__); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
 #define PROFILE_SCOPE_PRINTF(...) PROFILE_TAG_PRINTF_BEGIN(__VA_ARGS__); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
 
-#define PROFILE_TAG_VALUE(str, value) static_assert(str[0] != 0, "Only literal strings - Use PROFILE_TAG_VALUE_COPY"); taren_profiler::ProfileTag(taren_profiler::TagType::Value, str, false, value)
+#define PROFILE_TAG_ENUM_ID_INTERNAL(value, category) [](auto i_value) { using EnumValues = SequentialEnum<decltype(i_value)>; static const taren_profiler::EnumTags s_tags = taren_profiler::RegisterEnumTags(EnumValues::s_strValues, (uint32_t)EnumValues::COUNT, __FILE__, __LINE__, category); return taren_profiler::GetEnumTagID(s_tags, (uint32_t)i_value); }(value)
+
+#define PROFILE_TAG_ENUM_BEGIN(value) taren_profiler::ProfileTagID(taren_profiler::TagType::Begin, PROFILE_TAG_ENUM_ID_INTERNAL(value, ""))
+#define PROFILE_SCOPE_ENUM(value) PROFILE_TAG_ENUM_BEGIN(value); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
+
+#define PROFILE_TAG_ARGS_BEGIN(str, ...) static_assert(str[0] != 0, "Only literal strings"); taren_profiler::ProfileTagArgs(PROFILE_TAG_ID_INTERNAL(str, ""), __VA_ARGS__)
+#define PROFILE_SCOPE_ARGS(str, ...) PROFILE_TAG_ARGS_BEGIN(str, __VA_ARGS__); taren_profiler::ProfileScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)
+
+#define PROFILE_SCOPE_BUDGET(str, budget) static_assert(str[0] != 0, "Only literal strings"); taren_profiler::ProfileBudgetScope PROFILE_SCOPE_INTERNAL(taren_profile_scope,__LINE__)(PROFILE_TAG_ID_INTERNAL(str, ""), taren_profiler::GetBudgetNS(budget))
+
+#define PROFILE_TAG_VALUE(str, value) static_assert(str[0] != 0, "Only literal strings - Use PROFILE_TAG_VALUE_COPY"); taren_profiler::ProfileTagID(taren_profiler::TagType::Value, PROFILE_TAG_ID_INTERNAL(str, ""), value)
 #define PROFILE_TAG_VALUE_COPY(str, value) taren_profiler::ProfileTag(taren_profiler::TagType::Value, str, true, value)
 #define PROFILE_TAG_VALUE_FORMAT(value, ...) if(taren_profiler::IsProfiling()) { PROFILE_FORMAT_INTERNAL(__VA_ARGS__); PROFILE_TAG_VALUE_COPY(buf, value); }
 #define PROFILE_TAG_VALUE_PRINTF(value, ...) if(taren_profiler::IsProfiling()) { PROFILE_PRINTF_INTERNAL(__VA_ARGS__); PROFILE_TAG_VALUE_COPY(buf, value); }
 
+#define PROFILE_TASK_BEGIN(str, taskID) static_assert(str[0] != 0, "Only literal strings"); taren_profiler::ProfileTask(taren_profiler::TagType::TaskBegin, PROFILE_TAG_ID_INTERNAL(str, ""), taskID)
+#define PROFILE_TASK_CATEGORY_BEGIN(str, category, taskID) static_assert(str[0] != 0, "Only literal strings"); taren_profiler::ProfileTask(taren_profiler::TagType::TaskBegin, PROFILE_TAG_ID_INTERNAL(str, category), taskID)
+#define PROFILE_TASK_SUSPEND(taskID) taren_profiler::ProfileTask(taren_profiler::TagType::TaskSuspend, 0, taskID)
+#define PROFILE_TASK_RESUME(taskID) taren_profiler::ProfileTask(taren_profiler::TagType::TaskResume, 0, taskID)
+#define PROFILE_TASK_END(taskID) taren_profiler::ProfileTask(taren_profiler::TagType::TaskEnd, 0, taskID)
+
+#define PROFILE_REQUEST(requestID) taren_profiler::ProfileRequestScope PROFILE_SCOPE_INTERNAL(taren_profile_request,__LINE__)(requestID)
+#define PROFILE_TRACE_CONTEXT_GET(name) const taren_profiler::TraceContext name = taren_profiler::GetTraceContext()
+#define PROFILE_TRACE_CONTEXT(context) taren_profiler::ProfileTraceContextScope PROFILE_SCOPE_INTERNAL(taren_profile_context,__LINE__)(context)
+
 #else // !TAREN_PROFILE_ENABLE
 
 #define PROFILE_BEGIN(...)
+#define PROFILE_BEGIN_MAPPEDFILE(...)
+#define PROFILE_BEGIN_SHAREDMEMORY(...)
+#define PROFILE_ATTACH_SHAREDMEMORY(...)
 #define PROFILE_END(...)
 #define PROFILE_ENDFILEJSON(...)
+#define PROFILE_SNAPSHOT(...)
+#define PROFILE_ROTATION_BEGIN(...)
+#define PROFILE_ROTATION_END()
+#define PROFILE_STREAM_BEGIN(...)
+#define PROFILE_STREAM_END()
+#define PROFILE_CONTROL_BEGIN(...)
+#define PROFILE_CONTROL_END()
+#define PROFILE_METRICS(...)
+#define PROFILE_METRICSFILE(...)
+#define PROFILE_INSTRUMENT_EXCLUDE(...)
 
 #define PROFILE_TAG_BEGIN(...)
+#define PROFILE_TAG_CATEGORY_BEGIN(...)
 #define PROFILE_TAG_COPY_BEGIN(...)
 #define PROFILE_TAG_FORMAT_BEGIN(...)
 #define PROFILE_TAG_PRINTF_BEGIN(...)
 #define PROFILE_TAG_END()
 
 #define PROFILE_SCOPE(...)
+#define PROFILE_SCOPE_CATEGORY(...)
 #define PROFILE_SCOPE_COPY(...)
 #define PROFILE_SCOPE_FORMAT(...)
 #define PROFILE_SCOPE_PRINTF(...)
 
+#define PROFILE_TAG_ENUM_BEGIN(...)
+#define PROFILE_SCOPE_ENUM(...)
+
+#define PROFILE_TAG_ARGS_BEGIN(...)
+#define PROFILE_SCOPE_ARGS(...)
+
+#define PROFILE_SCOPE_BUDGET(...)
+
 #define PROFILE_TAG_VALUE(...)
 #define PROFILE_TAG_VALUE_COPY(...)
 #define PROFILE_TAG_VALUE_FORMAT(...)
 #define PROFILE_TAG_VALUE_PRINTF(...)
 
+#define PROFILE_TASK_BEGIN(...)
+#define PROFILE_TASK_CATEGORY_BEGIN(...)
+#define PROFILE_TASK_SUSPEND(...)
+#define PROFILE_TASK_RESUME(...)
+#define PROFILE_TASK_END(...)
+
+#define PROFILE_REQUEST(...)
+#define PROFILE_TRACE_CONTEXT_GET(...)
+#define PROFILE_TRACE_CONTEXT(...)
+
 #endif // !TAREN_PROFILE_ENABLE
 
 #ifdef TAREN_PROFILE_ENABLE
 
 #include <string>
 #include <ostream>
+#include <cstdint>
+#include <chrono>
+#include <type_traits>
 
 #if (__cplusplus >= 202002L)
 #include <format>
@@ -108,11 +365,17 @@
 
 namespace taren_profiler
 {
-  enum class TagType
+  enum class TagType : uint8_t
   {
     Begin,
     End,
     Value,
+    FunctionBegin, // Begin tag where the string is a function address (used by function instrumentation)
+    TaskBegin,     // Begin of a task that can suspend and resume on any thread (the value is the task id)
+    TaskEnd,       // End of a task
+    TaskSuspend,   // A task is suspended
+    TaskResume,    // A suspended task is resumed
+    Gauge,         // A sampled value written as a counter track (used by the gauge sampler)
   };
 
   /// \brief Get if the profiler is currently running
@@ -123,6 +386,27 @@ namespace taren_profiler
   /// \return Returns true if profiling was started
   bool Begin();
   
+  /// \brief Start profiling recording into a file backed shared memory mapping (requires TAREN_PROFILER_MAPPED_FILE). 
+  ///        The records are persisted by the OS even if the process crashes. End() still writes the json as normal.
+  ///        Convert a crashed capture with Tools/ProfileMappedConvert.cpp
+  /// \param i_fileName The file to create (sized for TAREN_PROFILER_TAG_MAX_COUNT records, sparse on most file systems)
+  /// \return Returns true if profiling was started
+  bool BeginMappedFile(const char* i_fileName);
+
+  /// \brief Start profiling recording into a named shared memory arena (requires TAREN_PROFILER_SHARED_MEMORY). 
+  ///        Worker processes record into the same buffers with AttachSharedMemory() (forked children attach automatically), 
+  ///        and End() writes the records of all the processes. The name is unlinked at End(), or kept if the process crashes 
+  ///        (convert /dev/shm/name with Tools/ProfileMappedConvert.cpp). Snapshots are not supported.
+  /// \param i_name The shm_open() name (eg. "/myapp_profile")
+  /// \return Returns true if profiling was started
+  bool BeginSharedMemory(const char* i_name);
+
+  /// \brief Start recording into the shared memory arena of another process (requires TAREN_PROFILER_SHARED_MEMORY). 
+  ///        The process must be built with the same profiler defines. End() stops recording, the owner writes the trace.
+  /// \param i_name The name passed to BeginSharedMemory() by the owner process
+  /// \return Returns true if recording was started (false if the arena does not exist, does not match or has no free process slot)
+  bool AttachSharedMemory(const char* i_name);
+
   /// \brief Ends the profiling
   /// \param o_outStream The stream to write the json to
   /// \param o_outString The string to write the json to
@@ -136,6 +420,179 @@ namespace taren_profiler
   /// \return Returns true on success
   bool EndFileJson(const char* i_fileName, bool i_appendDateExtension = true);
 
+  /// \brief Writes the records captured since the last snapshot to a file without stopping profiling.
+  ///        Recording swaps to a second record buffer and the retired buffer is written on a background thread.
+  ///        If the previous snapshot is still being written, this call waits for it to complete (tag calls do not wait).
+  /// \param i_fileName The file name to write to.
+  /// \param i_appendDateExtension If true, the current date/time (with milliseconds) and the extension .json is appended to the filename before opening.
+  /// \return Returns true if the snapshot was started
+  bool Snapshot(const char* i_fileName, bool i_appendDateExtension = true);
+
+  /// \brief Starts a background thread that calls Snapshot() periodically, writing each period to a new timestamped file.
+  ///        Rotation is stopped by EndRotation() or End().
+  /// \param i_fileName The file name prefix to write to.
+  /// \param i_periodMS The time between snapshots in milliseconds
+  /// \return Returns true if rotation was started
+  bool BeginRotation(const char* i_fileName, uint32_t i_periodMS);
+
+  /// \brief Stops any periodic snapshots started with BeginRotation()
+  void EndRotation();
+
+  /// \brief Starts streaming the records to a receiver listening on a Unix domain socket (requires TAREN_PROFILER_STREAMING). 
+  ///        A background thread swaps the record buffers each period and sends the completed records, so the receiver 
+  ///        sees them live. Streaming is stopped by EndStream(), End() or if the receiver disconnects.
+  ///        Snapshots are not available while streaming.
+  /// \param i_socketPath The path of the receiver's socket (see Tools/ProfileStreamReceiver.cpp)
+  /// \param i_periodMS The time between record batches in milliseconds
+  /// \return Returns true if the receiver was connected and streaming was started
+  bool BeginStream(const char* i_socketPath, uint32_t i_periodMS = 100);
+
+  /// \brief Sends any remaining records and stops streaming started with BeginStream()
+  void EndStream();
+
+  /// \brief Starts a controller thread that begins and ends captures on request, so a running process can be profiled 
+  ///        on demand (requires TAREN_PROFILER_CONTROL). SIGUSR1 or the control file starts a capture, which is written 
+  ///        with EndFileJson() after i_durationMS or on SIGUSR2 / a control file containing "stop". The control file is 
+  ///        checked every 100 milliseconds and removed when read, it can contain "durationMS [fileName]" to override the 
+  ///        defaults for that capture. The signal handlers only set an atomic flag.
+  /// \param i_fileName The file name prefix of the captures (the date/time and .json is appended)
+  /// \param i_durationMS The max time of a capture in milliseconds
+  /// \param i_controlFile The control file to watch (nullptr for none)
+  /// \param i_useSignals If the SIGUSR1 / SIGUSR2 handlers are installed (the previous handlers are restored by EndControl())
+  /// \return Returns true if the controller was started
+  bool BeginControl(const char* i_fileName, uint32_t i_durationMS = 30000, const char* i_controlFile = nullptr, bool i_useSignals = true);
+
+  /// \brief Stops the controller started with BeginControl(), writing any capture it started
+  void EndControl();
+
+  const uint32_t c_statsBucketCount = 160; // The number of histogram buckets in TagStats (4 per power of 2 nanoseconds)
+
+  struct TagStats
+  {
+    const char* m_name = nullptr; // The tag name (valid until the next snapshot or end of profiling)
+    uint64_t m_count = 0;         // The number of scopes of the tag
+    uint64_t m_totalNS = 0;       // The total time of the scopes in nanoseconds
+    uint64_t m_maxNS = 0;         // The max time of a scope in nanoseconds
+    uint64_t m_p50NS = 0;         // The approximate 50th percentile time in nanoseconds
+    uint64_t m_p90NS = 0;         // The approximate 90th percentile time in nanoseconds
+    uint64_t m_p99NS = 0;         // The approximate 99th percentile time in nanoseconds
+
+    uint64_t m_key = 0;                            // Internal tag lookup key
+    uint32_t m_histogram[c_statsBucketCount] = {}; // Internal histogram of the scope times
+  };
+
+  /// \brief Query the per-tag statistics of the scopes completed so far, without stopping profiling. 
+  ///        Can be called from any thread while profiling. Only records since the snapshot before last are available.
+  /// \param o_stats The caller provided array to fill, sorted by total time (most expensive first)
+  /// \param i_maxStats The size of the o_stats array, tags that do not fit are skipped
+  /// \param i_windowMS Only include scopes that ended in the last i_windowMS milliseconds (0 for all)
+  /// \return Returns the number of o_stats entries filled
+  uint32_t QueryStats(TagStats* o_stats, uint32_t i_maxStats, uint32_t i_windowMS = 0);
+
+  /// \brief Writes the QueryStats() results in the OpenMetrics text format, as a call counter and a duration histogram per tag.
+  ///        Counters restart from the records available to QueryStats(), so are reset after snapshots.
+  ///        The stats have 4 buckets per power of 2, so an internal bucket that straddles a metric bucket bound (eg. 1ms) is 
+  ///        split by the part of its time range below the bound, approximating the cumulative counts at the bounds.
+  /// \param o_outStream The stream to write the metrics to
+  /// \param o_outString The string to write the metrics to
+  /// \param i_windowMS Only include scopes that ended in the last i_windowMS milliseconds (0 for all)
+  /// \return Returns true on success
+  bool WriteMetrics(std::ostream& o_outStream, uint32_t i_windowMS = 0);
+  bool WriteMetrics(std::string& o_outString, uint32_t i_windowMS = 0);
+
+  /// \brief Writes the OpenMetrics text to a file. A temporary file is written then renamed, so collectors never read a partial file.
+  /// \param i_fileName The file name to write to.
+  /// \param i_windowMS Only include scopes that ended in the last i_windowMS milliseconds (0 for all)
+  /// \return Returns true on success
+  bool WriteMetricsFile(const char* i_fileName, uint32_t i_windowMS = 0);
+
+  /// \brief Exclude functions from automatic function instrumentation (requires TAREN_PROFILER_INSTRUMENT_FUNCTIONS). 
+  ///        Call at startup, before the instrumented functions are first run.
+  /// \param i_namePrefix Functions with a demangled name starting with this literal string are not recorded (eg. "std::")
+  /// \return Returns false if the exclusion list is full
+  bool InstrumentExclude(const char* i_namePrefix);
+
+  /// \brief Register a named lock for contention stats (used by the ProfiledMutex wrappers in ProfilerMutex.h)
+  /// \param i_name The lock name, must be a literal string. Locks with the same name share stats.
+  /// \return Returns the lock id
+  uint32_t RegisterLock(const char* i_name);
+
+  /// \brief Get the tag id used for the wait scopes of a lock
+  /// \param i_lockID The id returned from RegisterLock()
+  /// \return Returns the tag id to pass to ProfileTagID()
+  uint32_t GetLockWaitTagID(uint32_t i_lockID);
+
+  /// \brief Record that a registered lock was acquired
+  /// \param i_lockID The id returned from RegisterLock()
+  /// \param i_waitNS The time spent waiting to acquire the lock in nanoseconds
+  /// \param i_contended If the lock was not immediately available
+  /// \param i_shared If the lock was acquired in shared mode
+  void ProfileLockAcquire(uint32_t i_lockID, uint64_t i_waitNS, bool i_contended, bool i_shared);
+
+  /// \brief Record that a registered lock was released
+  /// \param i_lockID The id returned from RegisterLock()
+  /// \param i_holdNS The time the lock was held in nanoseconds
+  void ProfileLockRelease(uint32_t i_lockID, uint64_t i_holdNS);
+
+  enum class IOType : uint8_t
+  {
+    Read,  // A read of i_result bytes
+    Write, // A write of i_result bytes
+    Sync,  // A flush to storage (eg. fsync)
+    Other, // Any other call (eg. open / close)
+  };
+
+  /// \brief Record a completed I/O call in the per file descriptor stats (used by the I/O wrappers in ProfilerIO.h)
+  /// \param i_type The type of the call
+  /// \param i_fd The file descriptor (fds of TAREN_PROFILER_IO_FD_COUNT or more are not tracked)
+  /// \param i_result The result of the call (bytes transferred for reads / writes, negative on error)
+  /// \param i_latencyNS The time of the call in nanoseconds
+  void ProfileIO(IOType i_type, int i_fd, int64_t i_result, uint64_t i_latencyNS);
+
+  /// \brief Set the path of a file descriptor in the I/O stats. Can be called while not profiling.
+  /// \param i_fd The file descriptor
+  /// \param i_path The path the fd was opened with (copied)
+  void SetIOPath(int i_fd, const char* i_path);
+
+  /// \brief Register a static tag descriptor. Called once per call site by the tag macros.
+  /// \param i_name The tag name, must be a literal string
+  /// \param i_file The source file of the call site, must be a literal string
+  /// \param i_line The source line of the call site
+  /// \param i_category The category of the tag, must be a literal string
+  /// \return Returns the tag id to pass to ProfileTagID()
+  uint32_t RegisterTag(const char* i_name, const char* i_file, uint32_t i_line, const char* i_category);
+
+  struct EnumTags
+  {
+    uint32_t m_baseTagID = 0; // The tag id of the first enum value (the values have consecutive ids)
+    uint32_t m_count = 0;     // The number of enum values (0 if there were not enough tag descriptors)
+  };
+
+  /// \brief Register a tag descriptor for each value of a sequential enum. Called once per call site by the enum tag macros, 
+  ///        the descriptors are only registered the first time for each enum type.
+  /// \param i_names The enum value strings (SequentialEnum<T>::s_strValues), used as the tag names
+  /// \param i_count The number of enum values
+  /// \param i_file The source file of the call site, must be a literal string
+  /// \param i_line The source line of the call site
+  /// \param i_category The category of the tags, must be a literal string
+  /// \return Returns the tag ids of the enum values
+  EnumTags RegisterEnumTags(const char* const* i_names, uint32_t i_count, const char* i_file, uint32_t i_line, const char* i_category);
+
+  /// \brief Get the tag id of an enum value
+  /// \param i_tags The tags returned from RegisterEnumTags()
+  /// \param i_value The enum value
+  /// \return Returns the tag id to pass to ProfileTagID() (the unknown tag id if the value is out of range)
+  inline uint32_t GetEnumTagID(const EnumTags& i_tags, uint32_t i_value)
+  {
+    return (i_value < i_tags.m_count) ? i_tags.m_baseTagID + i_value : 0;
+  }
+
+  /// \brief Set a profiling tag from a registered tag id
+  /// \param i_type The type of tag
+  /// \param i_tagID The id returned from RegisterTag() (can be 0 for end tags)
+  /// \param i_value The value to supply with the tag
+  void ProfileTagID(TagType i_type, uint32_t i_tagID, int32_t i_value = 0);
+
   /// \brief Set a profiling tag
   /// \param i_type The type of tag
   /// \param i_str The tag name, must be a literal string or i_copyTag set to true
@@ -143,10 +600,180 @@ namespace taren_profiler
   /// \param i_value The value to supply with the tag
   void ProfileTag(TagType i_type, const char* i_str, bool i_copyStr = false, int32_t i_value = 0);
 
+  /// \brief Set a task tag. Tasks (eg. coroutines) are written on their own track, independent of the thread tag stacks.
+  /// \param i_type The type of tag (TaskBegin, TaskEnd, TaskSuspend or TaskResume)
+  /// \param i_tagID The id returned from RegisterTag() for TaskBegin (can be 0 for the others)
+  /// \param i_taskID The id of the task, unique while the task is running (eg. the coroutine frame address). Folded to 32 bits.
+  void ProfileTask(TagType i_type, uint32_t i_tagID, uint64_t i_taskID);
+
+  const uint32_t c_maxTagArgs = 15; // The max number of key / value args of a tag
+
+  struct TagArg
+  {
+    enum class Type : uint8_t
+    {
+      Int,
+      Double,
+      String,
+    };
+
+    const char* m_key = nullptr; // The arg name, must be a literal string
+    Type m_type = Type::Int;     // The type of the value
+    union
+    {
+      int64_t m_int;             // Integer (and enum / bool) values
+      double m_double;           // Floating point values
+      const char* m_string;      // String values, must be a literal string
+    };
+
+    TagArg() : m_int(0) {}
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, int>::type = 0>
+    TagArg(const char* i_key, T i_value) : m_key(i_key), m_type(Type::Int), m_int((int64_t)i_value) {}
+
+    template <typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+    TagArg(const char* i_key, T i_value) : m_key(i_key), m_type(Type::Double), m_double((double)i_value) {}
+
+    TagArg(const char* i_key, const char* i_value) : m_key(i_key), m_type(Type::String), m_string(i_value) {}
+  };
+
+  /// \brief Set a begin tag with key / value args from a registered tag id. The args are copied to the record buffer.
+  /// \param i_tagID The id returned from RegisterTag()
+  /// \param i_args The args to copy
+  /// \param i_argCount The number of args (max c_maxTagArgs)
+  void ProfileTagArgArray(uint32_t i_tagID, const TagArg* i_args, uint32_t i_argCount);
+
+  /// \brief Set an end tag with key / value args, written on the end event. The args are copied to the record buffer.
+  /// \param i_args The args to copy
+  /// \param i_argCount The number of args (max c_maxTagArgs)
+  void ProfileEndArgArray(const TagArg* i_args, uint32_t i_argCount);
+
+  inline void FillTagArgs(TagArg*) {}
+
+  template <typename V, typename... T>
+  void FillTagArgs(TagArg* o_args, const char* i_key, const V& i_value, const T&... i_keyValues)
+  {
+    *o_args = TagArg(i_key, i_value);
+    FillTagArgs(o_args + 1, i_keyValues...);
+  }
+
+  /// \brief Set a begin tag with key / value args (used by PROFILE_SCOPE_ARGS)
+  /// \param i_tagID The id returned from RegisterTag()
+  /// \param i_keyValues Pairs of literal string keys and integer / floating point / literal string values
+  template <typename... T>
+  void ProfileTagArgs(uint32_t i_tagID, const T&... i_keyValues)
+  {
+    static_assert(sizeof...(T) % 2 == 0, "Args must be key / value pairs");
+    static_assert(sizeof...(T) / 2 <= c_maxTagArgs, "Too many args");
+    TagArg args[sizeof...(T) / 2];
+    FillTagArgs(args, i_keyValues...);
+    ProfileTagArgArray(i_tagID, args, (uint32_t)(sizeof...(T) / 2));
+  }
+
   struct ProfileScope
   {
-    ~ProfileScope() { ProfileTag(TagType::End, nullptr); }
+    ~ProfileScope() { ProfileTagID(TagType::End, 0); }
+  };
+
+  /// \brief Called when a PROFILE_SCOPE_BUDGET() scope ends over budget, on the thread that ended it. 
+  ///        Should be quick and lock free, as it runs inside the profiled code (eg. set a flag or bump a counter).
+  /// \param i_name The tag name
+  /// \param i_durationNS The time of the scope in nanoseconds
+  /// \param i_budgetNS The budget of the scope in nanoseconds
+  using BudgetCallback = void (*)(const char* i_name, uint64_t i_durationNS, uint64_t i_budgetNS);
+
+  /// \brief Set the callback for scopes that end over budget. Can be called from any thread.
+  /// \param i_callback The callback (nullptr for none)
+  void SetBudgetCallback(BudgetCallback i_callback);
+
+  /// \brief Set a begin tag for a budget scope (used by PROFILE_SCOPE_BUDGET)
+  /// \param i_tagID The id returned from RegisterTag()
+  /// \return Returns the begin time in nanoseconds to pass to EndBudgetScope() (0 if not profiling)
+  uint64_t BeginBudgetScope(uint32_t i_tagID);
+
+  /// \brief Set the end tag of a budget scope, marking it and calling the budget callback if it is over budget
+  /// \param i_tagID The id passed to BeginBudgetScope()
+  /// \param i_beginNS The time returned from BeginBudgetScope()
+  /// \param i_budgetNS The budget of the scope in nanoseconds
+  void EndBudgetScope(uint32_t i_tagID, uint64_t i_beginNS, uint64_t i_budgetNS);
+
+  template <typename R, typename P>
+  uint64_t GetBudgetNS(std::chrono::duration<R, P> i_budget)
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(i_budget).count();
+  }
+
+  struct ProfileBudgetScope
+  {
+    ProfileBudgetScope(uint32_t i_tagID, uint64_t i_budgetNS) : m_tagID(i_tagID), m_budgetNS(i_budgetNS), m_beginNS(BeginBudgetScope(i_tagID)) {}
+    ~ProfileBudgetScope() { EndBudgetScope(m_tagID, m_beginNS, m_budgetNS); }
+
+    uint32_t m_tagID;    // The tag id of the scope
+    uint64_t m_budgetNS; // The budget in nanoseconds
+    uint64_t m_beginNS;  // The begin time in nanoseconds
+  };
+
+  struct TraceContext
+  {
+    uint64_t m_requestID = 0; // The id of the request being handled (0 if none)
+    bool m_sampled = true;    // If the tags of the request are recorded
   };
+
+  /// \brief Set the head sampling rate of BeginRequest() (requires TAREN_PROFILER_TRACE_CONTEXT). Can be called from any thread.
+  /// \param i_oneIn Record one in this many requests (1 records every request, 0 none). The decision is a hash of the request id, 
+  ///        so every thread and process that handles a request makes the same decision.
+  void SetRequestSampleRate(uint32_t i_oneIn);
+
+  /// \brief Start handling a request on this thread (requires TAREN_PROFILER_TRACE_CONTEXT). The sampling decision is made 
+  ///        once here: while the context is set, the tags of an unsampled request are not recorded and the begin tags of a 
+  ///        sampled request get a "request_id" arg. Tasks begun while a request is set carry it to the threads that resume them.
+  /// \param i_requestID The request id (0 assigns the next id of a counter)
+  /// \return Returns the previous context, to restore with SetTraceContext() when the request is done
+  TraceContext BeginRequest(uint64_t i_requestID);
+
+  /// \brief Get the trace context of this thread, to hand the request to another thread (requires TAREN_PROFILER_TRACE_CONTEXT)
+  /// \return Returns the context (a request id of 0 if no request is set)
+  TraceContext GetTraceContext();
+
+  /// \brief Set the trace context of this thread (requires TAREN_PROFILER_TRACE_CONTEXT). Scopes must begin and end in the 
+  ///        same context, so set and restore it around whole scopes.
+  /// \param i_context The context to set
+  void SetTraceContext(const TraceContext& i_context);
+
+  struct ProfileRequestScope
+  {
+    explicit ProfileRequestScope(uint64_t i_requestID) : m_previous(BeginRequest(i_requestID)) {}
+    ~ProfileRequestScope() { SetTraceContext(m_previous); }
+
+    TraceContext m_previous; // The context to restore
+  };
+
+  struct ProfileTraceContextScope
+  {
+    explicit ProfileTraceContextScope(const TraceContext& i_context) : m_previous(GetTraceContext()) { SetTraceContext(i_context); }
+    ~ProfileTraceContextScope() { SetTraceContext(m_previous); }
+
+    TraceContext m_previous; // The context to restore
+  };
+
+  /// \brief Polled by the gauge sampler thread (requires TAREN_PROFILER_GAUGES) every TAREN_PROFILER_GAUGE_PERIOD_MS while profiling. 
+  ///        Called without the gauge lock, so it can register or unregister gauges, but must not call End().
+  /// \param i_userData The user data passed to RegisterGauge()
+  /// \return Returns the current value of the gauge (eg. a queue depth)
+  using GaugeCallback = int32_t (*)(void* i_userData);
+
+  /// \brief Register a gauge that is polled by the gauge sampler thread and written as a counter track (requires TAREN_PROFILER_GAUGES). 
+  ///        Gauges stay registered across captures.
+  /// \param i_name The gauge name, must be a literal string
+  /// \param i_callback The callback returning the gauge value
+  /// \param i_userData The user data passed to the callback
+  /// \return Returns the gauge id to pass to UnregisterGauge() (UINT32_MAX if TAREN_PROFILER_GAUGE_COUNT gauges are registered)
+  uint32_t RegisterGauge(const char* i_name, GaugeCallback i_callback, void* i_userData = nullptr);
+
+  /// \brief Stop polling a gauge. The callback is not running and will not be called again when this returns (only waits on this 
+  ///        gauge's callback, when called from a gauge callback the calling callback is still running).
+  /// \param i_gaugeID The id returned from RegisterGauge()
+  void UnregisterGauge(uint32_t i_gaugeID);
 }
 
 #ifdef TAREN_PROFILER_IMPLEMENTATION
@@ -159,299 +786,5104 @@ namespace taren_profiler
 #define TAREN_PROFILER_TAG_NAME_BUFFER_SIZE 1000000
 #endif //!TAREN_PROFILER_TAG_NAME_BUFFER_SIZE
 
+#ifndef TAREN_PROFILER_TAG_DESCRIPTOR_COUNT
+#define TAREN_PROFILER_TAG_DESCRIPTOR_COUNT 65536
+#endif //!TAREN_PROFILER_TAG_DESCRIPTOR_COUNT
+
+#ifndef TAREN_PROFILER_TAG_ARG_COUNT
+#define TAREN_PROFILER_TAG_ARG_COUNT 100000
+#endif //!TAREN_PROFILER_TAG_ARG_COUNT
+
+#ifndef TAREN_PROFILER_ADDRESS_TAG_COUNT
+#define TAREN_PROFILER_ADDRESS_TAG_COUNT 65536 // Must be a power of 2
+#endif //!TAREN_PROFILER_ADDRESS_TAG_COUNT
+
+#ifndef TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE
+#define TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE 4000000
+#endif //!TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+
+#ifndef TAREN_PROFILER_MAPPED_FILE
+#define TAREN_PROFILER_MAPPED_FILE
+#endif //!TAREN_PROFILER_MAPPED_FILE
+
+#ifndef TAREN_PROFILER_SHARED_PROCESS_COUNT
+#define TAREN_PROFILER_SHARED_PROCESS_COUNT 16
+#endif //!TAREN_PROFILER_SHARED_PROCESS_COUNT
+
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+#ifndef TAREN_PROFILER_LOCK_COUNT
+#define TAREN_PROFILER_LOCK_COUNT 256
+#endif //!TAREN_PROFILER_LOCK_COUNT
+
+#ifndef TAREN_PROFILER_IO_FD_COUNT
+#define TAREN_PROFILER_IO_FD_COUNT 1024
+#endif //!TAREN_PROFILER_IO_FD_COUNT
+
+#ifndef TAREN_PROFILER_METRICS_TAG_COUNT
+#define TAREN_PROFILER_METRICS_TAG_COUNT 1024
+#endif //!TAREN_PROFILER_METRICS_TAG_COUNT
+
+#ifndef TAREN_PROFILER_QUERY_THREAD_COUNT
+#define TAREN_PROFILER_QUERY_THREAD_COUNT 256
+#endif //!TAREN_PROFILER_QUERY_THREAD_COUNT
+
+#ifndef TAREN_PROFILER_QUERY_STACK_DEPTH
+#define TAREN_PROFILER_QUERY_STACK_DEPTH 64
+#endif //!TAREN_PROFILER_QUERY_STACK_DEPTH
+
+#ifdef TAREN_PROFILER_HISTOGRAMS
+
+#ifndef TAREN_PROFILER_HISTOGRAM_TAG_COUNT
+#define TAREN_PROFILER_HISTOGRAM_TAG_COUNT 256
+#endif //!TAREN_PROFILER_HISTOGRAM_TAG_COUNT
+
+#ifndef TAREN_PROFILER_HISTOGRAM_STACK_DEPTH
+#define TAREN_PROFILER_HISTOGRAM_STACK_DEPTH 64
+#endif //!TAREN_PROFILER_HISTOGRAM_STACK_DEPTH
+
+#ifndef TAREN_PROFILER_HISTOGRAM_THREAD_COUNT
+#define TAREN_PROFILER_HISTOGRAM_THREAD_COUNT 16
+#endif //!TAREN_PROFILER_HISTOGRAM_THREAD_COUNT
+
+#endif // TAREN_PROFILER_HISTOGRAMS
+
+#ifdef TAREN_PROFILER_SLOWEST
+
+#ifndef TAREN_PROFILER_SLOWEST_COUNT
+#define TAREN_PROFILER_SLOWEST_COUNT 8
+#endif //!TAREN_PROFILER_SLOWEST_COUNT
+
+#ifndef TAREN_PROFILER_SLOWEST_TAG_COUNT
+#define TAREN_PROFILER_SLOWEST_TAG_COUNT 256
+#endif //!TAREN_PROFILER_SLOWEST_TAG_COUNT
+
+#ifndef TAREN_PROFILER_SLOWEST_RECORD_COUNT
+#define TAREN_PROFILER_SLOWEST_RECORD_COUNT 256
+#endif //!TAREN_PROFILER_SLOWEST_RECORD_COUNT
+
+#endif // TAREN_PROFILER_SLOWEST
+
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+
+#ifndef TAREN_PROFILER_TASK_CONTEXT_COUNT
+#define TAREN_PROFILER_TASK_CONTEXT_COUNT 1024
+#endif //!TAREN_PROFILER_TASK_CONTEXT_COUNT
+
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+
+#ifdef TAREN_PROFILER_SAMPLING
+
+#ifndef TAREN_PROFILER_SAMPLE_RATE
+#define TAREN_PROFILER_SAMPLE_RATE 1000
+#endif //!TAREN_PROFILER_SAMPLE_RATE
+
+#ifndef TAREN_PROFILER_SAMPLE_COUNT
+#define TAREN_PROFILER_SAMPLE_COUNT 100000
+#endif //!TAREN_PROFILER_SAMPLE_COUNT
+
+#ifndef TAREN_PROFILER_SAMPLE_DEPTH
+#define TAREN_PROFILER_SAMPLE_DEPTH 32
+#endif //!TAREN_PROFILER_SAMPLE_DEPTH
+
+#endif // TAREN_PROFILER_SAMPLING
+
+#ifdef TAREN_PROFILER_GAUGES
+
+#ifndef TAREN_PROFILER_GAUGE_PERIOD_MS
+#define TAREN_PROFILER_GAUGE_PERIOD_MS 10
+#endif //!TAREN_PROFILER_GAUGE_PERIOD_MS
+
+#ifndef TAREN_PROFILER_GAUGE_COUNT
+#define TAREN_PROFILER_GAUGE_COUNT 64
+#endif //!TAREN_PROFILER_GAUGE_COUNT
+
+#endif // TAREN_PROFILER_GAUGES
+
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
+#ifndef TAREN_PROFILER_INSTRUMENT_MAX_DEPTH
+#define TAREN_PROFILER_INSTRUMENT_MAX_DEPTH 64
+#endif //!TAREN_PROFILER_INSTRUMENT_MAX_DEPTH
+
+#ifndef TAREN_PROFILER_INSTRUMENT_EXCLUDE_COUNT
+#define TAREN_PROFILER_INSTRUMENT_EXCLUDE_COUNT 32
+#endif //!TAREN_PROFILER_INSTRUMENT_EXCLUDE_COUNT
+
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <ctime>
+#include <cstring>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+#ifndef __linux__
+#error "TAREN_PROFILER_PERF_COUNTERS is only supported on Linux"
+#endif
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+#if defined(__linux__)
+#include <sched.h>
+#elif defined(_WIN32)
+extern "C" __declspec(dllimport) unsigned long __stdcall GetCurrentProcessorNumber();
+#else
+#error "TAREN_PROFILER_RECORD_CPU is not supported on this platform"
+#endif
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+#if defined(_WIN32)
+#error "TAREN_PROFILER_THREAD_CPU_TIME is only supported on POSIX platforms"
+#endif
+#include <time.h>
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+#ifdef TAREN_PROFILER_MAPPED_FILE
+#if defined(_WIN32)
+#error "TAREN_PROFILER_MAPPED_FILE is only supported on POSIX platforms"
+#endif
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstddef>
+#endif // TAREN_PROFILER_MAPPED_FILE
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+#include <sys/stat.h>
+#include <pthread.h>
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+#ifndef __GNUC__
+#error "TAREN_PROFILER_INSTRUMENT_FUNCTIONS requires GCC or Clang"
+#endif
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <cstdlib>
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
+#ifdef TAREN_PROFILER_SAMPLING
+#if defined(_WIN32) || !defined(__GNUC__)
+#error "TAREN_PROFILER_SAMPLING is only supported on POSIX platforms with GCC or Clang"
+#endif
+#include <signal.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <cstdlib>
+#include <cerrno>
+#endif // TAREN_PROFILER_SAMPLING
+
+#if defined(TAREN_PROFILER_GAUGES) && !defined(_WIN32)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif // TAREN_PROFILER_GAUGES
+
+#ifdef TAREN_PROFILER_STREAMING
+#if defined(_WIN32)
+#error "TAREN_PROFILER_STREAMING is only supported on POSIX platforms"
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+#endif // TAREN_PROFILER_STREAMING
+
+#ifdef TAREN_PROFILER_CONTROL
+#if defined(_WIN32)
+#error "TAREN_PROFILER_CONTROL is only supported on POSIX platforms"
+#endif
+#include <signal.h>
+#include <unistd.h>
+#endif // TAREN_PROFILER_CONTROL
 
 namespace
 {
   using clock = std::chrono::high_resolution_clock;
 
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+  const uint32_t c_perfCounterCount = 4; // The number of perf counters read with each tag
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+  const uint32_t c_copyTagFlag = 0x80000000;    // Tag id flag for an offset into the record buffer's copy buffer
+  const uint32_t c_addressTagFlag = 0x40000000; // Tag id flag for an index into the address tag table
+  const uint32_t c_tagIndexMask = 0x3FFFFFFF;   // Mask to get the offset / index from a tag id
+
+  const uint32_t c_unknownTagID = 0;           // Descriptor id used for end tags and unknown tags
+  const uint32_t c_outOfBufferTagID = 1;       // Descriptor id used when the copy buffer is full
+  const uint32_t c_outOfDescriptorsTagID = 2;  // Descriptor id used when there are no more descriptors
+
+  const uint8_t c_overBudgetFlag = 0x01; // Record flag for the end of a budget scope that went over budget (the value is the budget)
+
+  struct RecordGeneration
+  {
+    std::atomic_uint32_t m_value{ 0 }; // The buffer generation
+
+    RecordGeneration() = default;
+    RecordGeneration(const RecordGeneration& i_copy) : m_value(i_copy.m_value.load(std::memory_order_relaxed)) {}
+    RecordGeneration& operator=(const RecordGeneration& i_copy) { m_value.store(i_copy.m_value.load(std::memory_order_relaxed), std::memory_order_relaxed); return *this; }
+  };
+
   struct ProfileRecord
   {
     clock::time_point m_time;    // The time of the profile data
-    const char* m_tag = nullptr; // The tag used in profiling - if empty is an end event
     std::thread::id m_threadID;  // The id of the thread
+    uint32_t m_tagID = 0;        // The tag descriptor id (or copy buffer offset / address tag index if flagged)
+    int32_t m_value = 0;         // Misc value used with the tag
 
     taren_profiler::TagType m_type; // The tag type
-    int32_t m_value = 0;            // Misc value used with the tag
+    uint8_t m_argCount = 0;         // The number of args in the record buffer's arg array (starting at index m_value)
+    uint8_t m_flags = 0;            // The record flags (c_overBudgetFlag)
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    uint16_t m_process = 0;         // The shared memory process slot that wrote the record (0 is the owner process)
+#endif // TAREN_PROFILER_SHARED_MEMORY
+    RecordGeneration m_generation;  // Set to the buffer generation as the last write, to flag that the record is complete
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+    uint64_t m_counters[c_perfCounterCount]; // The perf counter values at the time of the tag
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+    uint32_t m_cpu = 0; // The cpu core the tag was recorded on
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+    uint64_t m_cpuTimeNS = 0; // The cpu time of the thread at the time of the tag
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    uint64_t m_requestID = 0; // The request id of the thread's trace context (0 if none)
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  };
+
+  struct RecordBuffer
+  {
+    std::atomic_uint64_t m_slotCount = 0;                  // The current slot counter (64 bit so it can keep counting when the buffer is full)
+    std::atomic_uint32_t m_recordCount = 0;                // The current record count
+    std::atomic_uint32_t m_generation = 0;                 // Incremented each time the buffer is reset
+    ProfileRecord m_records[TAREN_PROFILER_TAG_MAX_COUNT]; // The profiling records
+
+    std::atomic_uint32_t m_copyBufferSize = 0;              // The current copy buffer usage count
+    char m_copyBuffer[TAREN_PROFILER_TAG_NAME_BUFFER_SIZE]; // The buffer to store copied tag names
+
+    std::atomic_uint32_t m_argCount = 0;                      // The current arg count
+    taren_profiler::TagArg m_args[TAREN_PROFILER_TAG_ARG_COUNT]; // The key / value args of the records
+
+    uint64_t m_droppedCount = 0; // The number of records dropped as the buffer was full (set when the buffer is closed)
   };
 
   std::atomic_bool g_enabled = false; // If profiling is enabled
   clock::time_point g_startTime;      // The start time of the profile
+  int64_t g_startMonotonicNS = 0;     // The start time on the system wide monotonic clock (steady_clock), to align captures of several processes
+  int64_t g_startSystemNS = 0;        // The start time on the system clock (nanoseconds since the unix epoch)
 
-  std::atomic_uint32_t g_slotCount = 0;                  // The current slot counter
-  std::atomic_uint32_t g_recordCount = 0;                // The current record count
-  ProfileRecord g_records[TAREN_PROFILER_TAG_MAX_COUNT]; // The profiling records
+  std::atomic_uint32_t g_activeBuffer = 0; // The index of the buffer that is being recorded into
+  RecordBuffer g_recordBuffers[2];           // The record buffers - one records while the other is written by a snapshot
+  RecordBuffer* g_buffers = g_recordBuffers; // The record buffers in use (can be in a mapped file)
 
-  std::atomic_uint32_t g_copyBufferSize = 0;              // The current copy buffer usage count
-  char g_copyBuffer[TAREN_PROFILER_TAG_NAME_BUFFER_SIZE]; // The buffer to store copied tag names
+  std::mutex g_controlMutex; // Mutex protecting the snapshot / end calls
+  std::thread g_writeThread; // The thread writing the last snapshot
 
-  const char* CopyStr(const char* i_str)
+  std::mutex g_rotationJoinMutex;              // Mutex serializing the rotation thread start / stop, so it is only joined once
+  std::mutex g_rotationMutex;                  // Mutex for the rotation thread state
+  std::condition_variable g_rotationCondition; // Condition to wake the rotation thread on shutdown
+  std::thread g_rotationThread;                // The thread calling snapshot periodically
+  bool g_rotationStop = false;                 // If the rotation thread should exit
+
+#ifdef TAREN_PROFILER_STREAMING
+  std::mutex g_streamJoinMutex;                // Mutex serializing the stream thread start / stop, so it is only joined once
+  std::mutex g_streamMutex;                    // Mutex for the stream thread state
+  std::condition_variable g_streamCondition;   // Condition to wake the stream thread on shutdown
+  std::thread g_streamThread;                  // The thread sending the records periodically
+  bool g_streamStop = false;                   // If the stream thread should exit
+  std::atomic_bool g_streaming = false;        // If the record buffers are being swapped by the stream thread
+#endif // TAREN_PROFILER_STREAMING
+
+#ifdef TAREN_PROFILER_CONTROL
+  enum ControlRequest : uint32_t
   {
-    if (i_str == nullptr)
-    {
-      return nullptr;
-    }
+    ControlStart = 1 << 0, // Start a capture
+    ControlStop = 1 << 1,  // End the capture early
+  };
 
-    // Allocate space to copy into
-    uint32_t len = (uint32_t)strlen(i_str) + 1;
-    uint32_t startOffset = g_copyBufferSize.fetch_add(len);
-    if ((startOffset + len) <= TAREN_PROFILER_TAG_NAME_BUFFER_SIZE)
-    {
-      char* outBuffer = &g_copyBuffer[startOffset];
-      memcpy(outBuffer, i_str, len);
-      return outBuffer;
-    }
-    else
-    {
-      g_copyBufferSize -= len; // Undo the add to make room for a smaller tag
-    }
+  const uint32_t c_controlPollMS = 100;               // How often the controller checks for requests
 
-    return "OutOfTagBufferSpace";
-  }
-}
+  std::mutex g_controllerJoinMutex;                   // Mutex serializing the controller thread start / stop, so it is only joined once
+  std::mutex g_controllerMutex;                       // Mutex for the controller thread state
+  std::condition_variable g_controllerCondition;      // Condition to wake the controller thread on shutdown
+  std::thread g_controllerThread;                     // The thread starting and ending the requested captures
+  bool g_controllerStop = false;                      // If the controller thread should exit
+  bool g_controllerSignals = false;                   // If the signal handlers are installed
+  struct sigaction g_previousStartAction = {};        // The SIGUSR1 handler before the controller
+  struct sigaction g_previousStopAction = {};         // The SIGUSR2 handler before the controller
+  std::atomic_uint32_t g_controlRequests = 0;         // The ControlRequest flags set by the signal handlers
+  static_assert(std::atomic_uint32_t::is_always_lock_free, "The control signal handler needs a lock free atomic");
+#endif // TAREN_PROFILER_CONTROL
 
-namespace taren_profiler
-{
-  void ProfileTag(TagType i_type, const char* i_str, bool i_copyStr, int32_t i_value)
+  struct TagDescriptor
   {
-    if (!g_enabled)
-    {
-      return;
-    }
+    const char* m_name = nullptr;     // The tag name
+    const char* m_file = nullptr;     // The file of the call site
+    uint32_t m_line = 0;              // The line of the call site
+    const char* m_category = nullptr; // The tag category
+  };
 
-    // Get the slot to put the record
-    uint32_t recordIndex = g_slotCount.fetch_add(1);
-    if (recordIndex < TAREN_PROFILER_TAG_MAX_COUNT)
-    {
-      ProfileRecord& newData = g_records[recordIndex];
-      newData.m_type = i_type;
-      newData.m_threadID = std::this_thread::get_id();
-      newData.m_tag = i_copyStr ? CopyStr(i_str) : i_str;
-      newData.m_value = i_value;
-      newData.m_time = clock::now();  // Assign the time as the last possible thing
+  std::atomic_uint32_t g_tagDescriptorCount = 3;                            // The number of registered descriptors (includes the built in ones)
+  TagDescriptor g_tagDescriptors[TAREN_PROFILER_TAG_DESCRIPTOR_COUNT] =     // The registered tag descriptors, indexed by tag id
+  {
+    { "Unknown", "", 0, "" },
+    { "OutOfTagBufferSpace", "", 0, "" },
+    { "OutOfTagDescriptors", "", 0, "" },
+  };
 
-      g_recordCount++; // Flag that the record is complete
-    }
-    else
-    {
-      g_slotCount--; // Only hit if exceeded the record count or end of profiling, reverse the add
-    }
-  }
+  std::atomic<taren_profiler::BudgetCallback> g_budgetCallback{ nullptr }; // The callback for scopes that end over budget
 
-  bool IsProfiling()
+  std::mutex g_enumTagMutex;                                                        // Mutex protecting enum tag registration
+  std::vector<std::pair<const char* const*, taren_profiler::EnumTags>> g_enumTags; // The registered enum types, by string table
+
+  struct LockStats
   {
-    return g_enabled;
-  }
+    const char* m_name = nullptr;              // The lock name
+    uint32_t m_waitTagID = 0;                  // The tag id of the wait scopes
+    std::atomic_uint64_t m_acquires{ 0 };       // The number of exclusive acquires
+    std::atomic_uint64_t m_sharedAcquires{ 0 }; // The number of shared acquires
+    std::atomic_uint64_t m_contended{ 0 };      // The number of acquires that had to wait
+    std::atomic_uint64_t m_waitNS{ 0 };         // The total wait time in nanoseconds
+    std::atomic_uint64_t m_maxWaitNS{ 0 };      // The max wait time in nanoseconds
+    std::atomic_uint64_t m_holdNS{ 0 };         // The total exclusive hold time in nanoseconds
+    std::atomic_uint64_t m_maxHoldNS{ 0 };      // The max exclusive hold time in nanoseconds
+  };
 
-  bool Begin()
+  std::mutex g_lockMutex;                          // Mutex protecting lock registration
+  std::atomic_uint32_t g_lockCount = 0;            // The number of registered locks
+  LockStats g_locks[TAREN_PROFILER_LOCK_COUNT];    // The registered lock stats, indexed by lock id
+
+  const uint32_t c_ioTypeCount = 4; // The number of taren_profiler::IOType values
+
+  struct IOStats
   {
-    if (g_enabled)
+    std::atomic_uint64_t m_calls[c_ioTypeCount] = {}; // The number of calls of each type
+    std::atomic_uint64_t m_bytes[c_ioTypeCount] = {}; // The bytes transferred by each type
+    std::atomic_uint64_t m_ns[c_ioTypeCount] = {};    // The total time of each type in nanoseconds
+    std::atomic_uint64_t m_maxNS{ 0 };                 // The max time of a call in nanoseconds
+    std::atomic_uint64_t m_errors{ 0 };                // The number of calls that failed
+    std::string m_path;                                // The path the fd was last opened with (protected by g_ioMutex)
+  };
+
+  std::mutex g_ioMutex;                          // Mutex protecting the I/O stat paths
+  IOStats g_ioStats[TAREN_PROFILER_IO_FD_COUNT]; // The I/O stats, indexed by file descriptor
+
+  void UpdateMax(std::atomic_uint64_t& io_max, uint64_t i_value)
+  {
+    uint64_t current = io_max.load(std::memory_order_relaxed);
+    while (i_value > current &&
+           !io_max.compare_exchange_weak(current, i_value, std::memory_order_relaxed))
     {
-      return false;
     }
-
-    // Clear all data (may have been some extra in buffers from previous enable)
-    g_recordCount = 0;
-    g_slotCount = 0;
-    g_copyBufferSize = 0;
-    g_startTime = clock::now();
-    g_enabled = true;
-    return true;
   }
 
-  static void CleanJsonStr(std::string& io_str)
+  static_assert((TAREN_PROFILER_ADDRESS_TAG_COUNT & (TAREN_PROFILER_ADDRESS_TAG_COUNT - 1)) == 0, "Address tag count must be a power of 2");
+  static_assert(TAREN_PROFILER_ADDRESS_TAG_COUNT <= c_tagIndexMask, "Address tag count too large");
+  static_assert(TAREN_PROFILER_TAG_NAME_BUFFER_SIZE <= c_tagIndexMask, "Tag name buffer size too large");
+  static_assert(TAREN_PROFILER_TAG_ARG_COUNT <= INT32_MAX, "Tag arg count too large");
+
+  struct AddressTag
+  {
+    std::atomic<uintptr_t> m_address = 0; // The function or string address (0 if the slot is unused)
+    std::atomic_uint8_t m_state = 0;      // Function instrumentation state: 0 = being resolved, 1 = included, 2 = excluded (3 = ProfileTag() string)
+  };
+  AddressTag g_addressTags[TAREN_PROFILER_ADDRESS_TAG_COUNT]; // Lock free hash table of addresses used as tags
+
+#ifdef __GNUC__
+  __attribute__((no_instrument_function))
+#endif
+  uint32_t GetAddressTagIndex(const void* i_address, bool& o_inserted)
+  {
+    // Linear probe from the address hash, inserting if not found
+    const uintptr_t address = (uintptr_t)i_address;
+    const uint32_t mask = TAREN_PROFILER_ADDRESS_TAG_COUNT - 1;
+    const uint32_t startIndex = (uint32_t)((address >> 4) * 2654435761u);
+    o_inserted = false;
+    for (uint32_t i = 0; i < 32; i++)
+    {
+      uint32_t index = (startIndex + i) & mask;
+      AddressTag& addressTag = g_addressTags[index];
+      uintptr_t slotAddress = addressTag.m_address;
+      if (slotAddress == 0 &&
+          addressTag.m_address.compare_exchange_strong(slotAddress, address))
+      {
+        o_inserted = true;
+        return index;
+      }
+      if (slotAddress == address)
+      {
+        return index;
+      }
+    }
+    return UINT32_MAX; // Table is full
+  }
+
+  const uint8_t c_addressStateString = 3; // Address tag state for ProfileTag() strings (functions use 0-2)
+
+#ifdef TAREN_PROFILER_MAPPED_FILE
+  const uint32_t c_mappedFileVersion = 2; // Update with Tools/ProfileMappedConvert.cpp if the layout changes
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+  static_assert(TAREN_PROFILER_SHARED_PROCESS_COUNT > 0 && TAREN_PROFILER_SHARED_PROCESS_COUNT <= UINT16_MAX, "Invalid shared process count");
+  const uint32_t c_mappedProcessCount = TAREN_PROFILER_SHARED_PROCESS_COUNT; // The number of per-process tag tables in the mapping
+#else
+  const uint32_t c_mappedProcessCount = 1; // The number of per-process tag tables in the mapping
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+  struct MappedDescriptor
+  {
+    uint32_t m_name;     // The name offset in the name table
+    uint32_t m_file;     // The file offset in the name table
+    uint32_t m_category; // The category offset in the name table
+    uint32_t m_line;     // The line of the call site
+  };
+
+  struct MappedFileHeader
+  {
+    char m_magic[8];                    // "TARENPF"
+    uint32_t m_version;                 // c_mappedFileVersion
+    uint32_t m_state;                   // 1 = recording, 2 = ended
+    uint64_t m_headerSize;              // The size of the header and tables, the two RecordBuffers follow
+    uint64_t m_bufferSize;              // sizeof(RecordBuffer)
+    uint64_t m_slotCountOffset;         // offsetof(RecordBuffer, m_slotCount)
+    uint64_t m_recordCountOffset;       // offsetof(RecordBuffer, m_recordCount)
+    uint64_t m_generationOffset;        // offsetof(RecordBuffer, m_generation)
+    uint64_t m_recordsOffset;           // offsetof(RecordBuffer, m_records)
+    uint64_t m_copyBufferOffset;        // offsetof(RecordBuffer, m_copyBuffer)
+    uint32_t m_recordSize;              // sizeof(ProfileRecord)
+    uint32_t m_recordMaxCount;          // TAREN_PROFILER_TAG_MAX_COUNT
+    uint32_t m_copyBufferSize;          // TAREN_PROFILER_TAG_NAME_BUFFER_SIZE
+    uint32_t m_timeOffset;              // offsetof(ProfileRecord, m_time)
+    uint32_t m_threadIDOffset;          // offsetof(ProfileRecord, m_threadID)
+    uint32_t m_threadIDSize;            // sizeof(std::thread::id)
+    uint32_t m_tagIDOffset;             // offsetof(ProfileRecord, m_tagID)
+    uint32_t m_valueOffset;             // offsetof(ProfileRecord, m_value)
+    uint32_t m_typeOffset;              // offsetof(ProfileRecord, m_type)
+    uint32_t m_recordGenerationOffset;  // offsetof(ProfileRecord, m_generation)
+    uint32_t m_processOffset;           // offsetof(ProfileRecord, m_process) (UINT32_MAX if records have no process slot)
+    int64_t m_startTime;                // The profile start time in clock ticks
+    int64_t m_clockNum;                 // The clock tick period numerator (seconds)
+    int64_t m_clockDen;                 // The clock tick period denominator (seconds)
+    uint32_t m_descriptorCount;         // The size of the descriptor table
+    uint32_t m_addressTagCount;         // The size of the address name table
+    uint32_t m_processTableCount;       // The number of process slots, each with a descriptor and address name table
+    uint64_t m_processTableStride;      // The offset between the tables of consecutive process slots
+    uint64_t m_processesOffset;         // The file offset of the process id (int32_t) of each slot
+    uint64_t m_descriptorsOffset;       // The file offset of the MappedDescriptor table (of process slot 0)
+    uint64_t m_addressNamesOffset;      // The file offset of the address tag name offsets (of process slot 0)
+    uint64_t m_nameTableOffset;         // The file offset of the name table
+    uint32_t m_nameTableSize;           // The size of the name table
+    std::atomic_uint32_t m_nameTableUsed; // The used size of the name table
+    std::atomic_uint32_t m_activeBuffer;  // The index of the buffer being recorded into
+    std::atomic_uint32_t m_processCount;  // The number of claimed process slots
+  };
+
+  std::atomic<MappedFileHeader*> g_mappedHeader{ nullptr }; // The header of the mapped file (if recording to a mapped file)
+  size_t g_mappedSize = 0;                                  // The size of the mapping
+  uint16_t g_processIndex = 0;                              // The process slot of this process (0 unless attached to the shared memory of another process)
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+  bool g_sharedMemory = false;  // If the mapping is a shared memory arena that other processes can record into
+  std::string g_sharedName;     // The shared memory name to unlink at End() (only set in the owner process)
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+  MappedDescriptor* GetMappedDescriptors(const MappedFileHeader& i_header, uint32_t i_process)
+  {
+    return (MappedDescriptor*)((char*)&i_header + i_header.m_descriptorsOffset + i_header.m_processTableStride * i_process);
+  }
+
+  uint32_t* GetMappedAddressNames(const MappedFileHeader& i_header, uint32_t i_process)
+  {
+    return (uint32_t*)((char*)&i_header + i_header.m_addressNamesOffset + i_header.m_processTableStride * i_process);
+  }
+
+  int32_t* GetMappedProcessIDs(const MappedFileHeader& i_header)
+  {
+    return (int32_t*)((char*)&i_header + i_header.m_processesOffset);
+  }
+
+  uint32_t MapString(MappedFileHeader& io_header, const char* i_str)
+  {
+    // Offset 0 is an empty string
+    if (i_str == nullptr || i_str[0] == 0)
+    {
+      return 0;
+    }
+    uint32_t len = (uint32_t)strlen(i_str) + 1;
+    uint32_t offset = io_header.m_nameTableUsed.fetch_add(len);
+    if (offset + len > io_header.m_nameTableSize)
+    {
+      return 0;
+    }
+    memcpy((char*)&io_header + io_header.m_nameTableOffset + offset, i_str, len);
+    return offset;
+  }
+
+  void MapDescriptor(uint32_t i_tagID)
+  {
+    MappedFileHeader* header = g_mappedHeader;
+    if (header != nullptr)
+    {
+      const TagDescriptor& descriptor = g_tagDescriptors[i_tagID];
+      MappedDescriptor& mapped = GetMappedDescriptors(*header, g_processIndex)[i_tagID];
+      mapped.m_name = MapString(*header, descriptor.m_name);
+      mapped.m_file = MapString(*header, descriptor.m_file);
+      mapped.m_category = MapString(*header, descriptor.m_category);
+      mapped.m_line = descriptor.m_line;
+    }
+  }
+
+  void MapAddressTag(uint32_t i_addressIndex)
+  {
+    MappedFileHeader* header = g_mappedHeader;
+    if (header != nullptr)
+    {
+      // Strings are copied, function addresses are written as hex as names can only be resolved in process
+      const AddressTag& addressTag = g_addressTags[i_addressIndex];
+      char buf[32];
+      const char* name = (const char*)addressTag.m_address.load();
+      if (addressTag.m_state != c_addressStateString)
+      {
+        std::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)addressTag.m_address.load());
+        name = buf;
+      }
+      GetMappedAddressNames(*header, g_processIndex)[i_addressIndex] = MapString(*header, name);
+    }
+  }
+
+  void MapRegisteredTags()
+  {
+    uint32_t descriptorCount = std::min<uint32_t>(g_tagDescriptorCount, TAREN_PROFILER_TAG_DESCRIPTOR_COUNT);
+    for (uint32_t i = 0; i < descriptorCount; i++)
+    {
+      MapDescriptor(i);
+    }
+    for (uint32_t i = 0; i < TAREN_PROFILER_ADDRESS_TAG_COUNT; i++)
+    {
+      if (g_addressTags[i].m_address != 0)
+      {
+        MapAddressTag(i);
+      }
+    }
+  }
+
+  void UnmapFile()
+  {
+    MappedFileHeader* header = g_mappedHeader.exchange(nullptr);
+    g_buffers = g_recordBuffers;
+    g_processIndex = 0;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    g_sharedMemory = false;
+#endif // TAREN_PROFILER_SHARED_MEMORY
+    if (header != nullptr)
+    {
+      munmap(header, g_mappedSize);
+    }
+  }
+
+  bool MapFile(int i_file)
+  {
+    // Tables follow the header, with the record buffers page aligned after them
+    const uint64_t processesOffset = (sizeof(MappedFileHeader) + 63) & ~(uint64_t)63;
+    const uint64_t descriptorsOffset = (processesOffset + sizeof(int32_t) * c_mappedProcessCount + 63) & ~(uint64_t)63;
+    const uint64_t addressNamesOffset = descriptorsOffset + sizeof(MappedDescriptor) * TAREN_PROFILER_TAG_DESCRIPTOR_COUNT;
+    const uint64_t processTableStride = addressNamesOffset + sizeof(uint32_t) * TAREN_PROFILER_ADDRESS_TAG_COUNT - descriptorsOffset;
+    const uint64_t nameTableOffset = descriptorsOffset + processTableStride * c_mappedProcessCount;
+    const uint64_t headerSize = (nameTableOffset + TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE + 4095) & ~(uint64_t)4095;
+    const size_t mappedSize = (size_t)(headerSize + sizeof(RecordBuffer) * 2);
+
+    void* mapping = MAP_FAILED;
+    if (ftruncate(i_file, (off_t)mappedSize) == 0)
+    {
+      mapping = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, i_file, 0);
+    }
+    if (mapping == MAP_FAILED)
+    {
+      return false;
+    }
+
+    // The file is zero filled, which is a valid empty header and RecordBuffer
+    UnmapFile();
+    MappedFileHeader* header = (MappedFileHeader*)mapping;
+    memcpy(header->m_magic, "TARENPF", 8);
+    header->m_version = c_mappedFileVersion;
+    header->m_state = 1;
+    header->m_headerSize = headerSize;
+    header->m_bufferSize = sizeof(RecordBuffer);
+    header->m_slotCountOffset = offsetof(RecordBuffer, m_slotCount);
+    header->m_recordCountOffset = offsetof(RecordBuffer, m_recordCount);
+    header->m_generationOffset = offsetof(RecordBuffer, m_generation);
+    header->m_recordsOffset = offsetof(RecordBuffer, m_records);
+    header->m_copyBufferOffset = offsetof(RecordBuffer, m_copyBuffer);
+    header->m_recordSize = sizeof(ProfileRecord);
+    header->m_recordMaxCount = TAREN_PROFILER_TAG_MAX_COUNT;
+    header->m_copyBufferSize = TAREN_PROFILER_TAG_NAME_BUFFER_SIZE;
+    header->m_timeOffset = offsetof(ProfileRecord, m_time);
+    header->m_threadIDOffset = offsetof(ProfileRecord, m_threadID);
+    header->m_threadIDSize = sizeof(std::thread::id);
+    header->m_tagIDOffset = offsetof(ProfileRecord, m_tagID);
+    header->m_valueOffset = offsetof(ProfileRecord, m_value);
+    header->m_typeOffset = offsetof(ProfileRecord, m_type);
+    header->m_recordGenerationOffset = offsetof(ProfileRecord, m_generation);
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    header->m_processOffset = offsetof(ProfileRecord, m_process);
+#else
+    header->m_processOffset = UINT32_MAX;
+#endif // TAREN_PROFILER_SHARED_MEMORY
+    header->m_clockNum = clock::period::num;
+    header->m_clockDen = clock::period::den;
+    header->m_descriptorCount = TAREN_PROFILER_TAG_DESCRIPTOR_COUNT;
+    header->m_addressTagCount = TAREN_PROFILER_ADDRESS_TAG_COUNT;
+    header->m_processTableCount = c_mappedProcessCount;
+    header->m_processTableStride = processTableStride;
+    header->m_processesOffset = processesOffset;
+    header->m_descriptorsOffset = descriptorsOffset;
+    header->m_addressNamesOffset = addressNamesOffset;
+    header->m_nameTableOffset = nameTableOffset;
+    header->m_nameTableSize = TAREN_PROFILER_MAPPED_NAME_TABLE_SIZE;
+    header->m_nameTableUsed = 1;
+    header->m_processCount = 1;
+    GetMappedProcessIDs(*header)[0] = (int32_t)getpid();
+
+    g_mappedSize = mappedSize;
+    g_buffers = (RecordBuffer*)((char*)mapping + headerSize);
+    g_mappedHeader = header;
+
+    // Copy the tags that are already registered
+    MapRegisteredTags();
+    return true;
+  }
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+  const char* GetMappedString(const MappedFileHeader& i_header, uint32_t i_offset)
+  {
+    return (i_offset < i_header.m_nameTableSize) ? (const char*)&i_header + i_header.m_nameTableOffset + i_offset : "";
+  }
+
+  bool ClaimProcessSlot(MappedFileHeader& io_header)
+  {
+    // Slots are never reused, so a process that exits keeps its tag tables for the owner's End()
+    uint32_t process = io_header.m_processCount.fetch_add(1);
+    if (process >= io_header.m_processTableCount)
+    {
+      return false;
+    }
+    GetMappedProcessIDs(io_header)[process] = (int32_t)getpid();
+    g_processIndex = (uint16_t)process;
+    MapRegisteredTags();
+    return true;
+  }
+
+  void AttachForkedChild()
+  {
+    // A forked child inherits the shared mapping, but needs its own process slot as thread ids can repeat in each process
+    MappedFileHeader* header = g_mappedHeader;
+    if (header != nullptr && g_sharedMemory && g_enabled)
+    {
+      g_sharedName.clear(); // Only the owner unlinks
+      if (!ClaimProcessSlot(*header))
+      {
+        g_enabled = false;
+      }
+    }
+  }
+
+  void InstallForkHandler()
+  {
+    static bool s_installed = false;
+    if (!s_installed)
+    {
+      pthread_atfork(nullptr, nullptr, AttachForkedChild);
+      s_installed = true;
+    }
+  }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+#endif // TAREN_PROFILER_MAPPED_FILE
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+  struct PerfCounterConfig
+  {
+    uint32_t m_type = 0;          // The perf_event type
+    uint64_t m_config = 0;        // The perf_event config
+    const char* m_name = nullptr; // The name used in the json output
+    bool m_excludeKernel = true;  // If kernel events should be excluded (required when unprivileged)
+  };
+
+  struct PerfThreadCounters
+  {
+    int m_fds[c_perfCounterCount] = { -1, -1, -1, -1 }; // The opened counter file descriptors (first is the group leader)
+    uint32_t m_groupSlots[c_perfCounterCount] = {};     // The counter slot of each value in the group read
+    uint32_t m_groupCount = 0;                          // The number of counters in the group
+    bool m_opened = false;                              // If the counters have been opened for this thread
+
+    ~PerfThreadCounters()
+    {
+      for (int fd : m_fds)
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      }
+    }
+  };
+
+  thread_local PerfThreadCounters t_perfCounters; // The perf counters of each thread
+
+  int OpenPerfCounter(const PerfCounterConfig& i_config, int i_groupFd)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = i_config.m_type;
+    attr.config = i_config.m_config;
+    attr.exclude_kernel = i_config.m_excludeKernel ? 1 : 0;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, i_groupFd, 0); // Measure the calling thread on any cpu
+  }
+
+  const PerfCounterConfig* GetPerfCounterConfig()
+  {
+    // Probe once which counters are available, falling back to software counters (eg. in virtual machines)
+    static const PerfCounterConfig* s_config = []()
+    {
+      static PerfCounterConfig configs[c_perfCounterCount] =
+      {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses" },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses" },
+      };
+      const PerfCounterConfig fallbacks[c_perfCounterCount] =
+      {
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns" },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults" },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches" },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu_migrations" },
+      };
+
+      for (uint32_t i = 0; i < c_perfCounterCount; i++)
+      {
+        int fd = OpenPerfCounter(configs[i], -1);
+        if (fd < 0)
+        {
+          // Software counters that happen in the kernel (eg. context switches) are not counted if the kernel is excluded
+          configs[i] = fallbacks[i];
+          configs[i].m_excludeKernel = false;
+          fd = OpenPerfCounter(configs[i], -1);
+          if (fd < 0)
+          {
+            configs[i].m_excludeKernel = true;
+          }
+        }
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      }
+      return configs;
+    }();
+    return s_config;
+  }
+
+  void ReadPerfCounters(uint64_t (&o_counters)[c_perfCounterCount])
+  {
+    PerfThreadCounters& counters = t_perfCounters;
+    if (!counters.m_opened)
+    {
+      counters.m_opened = true;
+
+      // Open the counters as a group so they can be read with one call
+      const PerfCounterConfig* configs = GetPerfCounterConfig();
+      for (uint32_t i = 0; i < c_perfCounterCount; i++)
+      {
+        int fd = OpenPerfCounter(configs[i], counters.m_fds[0]);
+        if (fd >= 0)
+        {
+          counters.m_fds[counters.m_groupCount] = fd;
+          counters.m_groupSlots[counters.m_groupCount] = i;
+          counters.m_groupCount++;
+        }
+      }
+    }
+
+    uint64_t readBuffer[1 + c_perfCounterCount] = {}; // The counter count followed by the values
+    memset(o_counters, 0, sizeof(o_counters));
+    if (counters.m_groupCount > 0 &&
+        read(counters.m_fds[0], readBuffer, sizeof(readBuffer)) > 0)
+    {
+      for (uint32_t i = 0; i < counters.m_groupCount && i < readBuffer[0]; i++)
+      {
+        o_counters[counters.m_groupSlots[i]] = readBuffer[1 + i];
+      }
+    }
+  }
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+  inline uint32_t GetCurrentCpu()
+  {
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? (uint32_t)cpu : 0;
+#else
+    return (uint32_t)GetCurrentProcessorNumber();
+#endif
+  }
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+  inline uint64_t GetThreadCpuTimeNS()
+  {
+    timespec time = {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+  }
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+  struct TagAggregate
+  {
+    const char* m_name = nullptr;  // The tag name (if not a copied tag)
+    uint64_t m_count = 0;          // The number of times the tag was ended
+    clock::duration m_totalTime{}; // The total time in the tag
+    clock::duration m_selfTime{};  // The time in the tag, excluding child tags
+    clock::duration m_maxTime{};   // The longest single time in the tag
+    uint64_t m_overBudget = 0;     // The number of PROFILE_SCOPE_BUDGET() scopes that ended over budget
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+    uint64_t m_counters[c_perfCounterCount] = {}; // The total perf counter deltas
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+    uint64_t m_migrations = 0; // The number of cpu migrations during the tag
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+    uint64_t m_cpuTimeNS = 0; // The total thread cpu time in the tag
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+  };
+
+  struct JsonState
+  {
+    struct OpenTag
+    {
+      ProfileRecord m_begin;        // The begin record
+      const char* m_name = nullptr; // The tag name
+      clock::duration m_childTime{}; // The time spent in child tags
+#ifdef TAREN_PROFILER_RECORD_CPU
+      uint64_t m_migrations = 0;     // The cpu migrations during the tag (including child tags)
+#endif // TAREN_PROFILER_RECORD_CPU
+    };
+
+    struct Tags
+    {
+      int32_t m_index = -1;         // The index of the thread
+      std::vector<OpenTag> m_tags;  // The begin tag stack
+#ifdef TAREN_PROFILER_RECORD_CPU
+      uint32_t m_lastCpu = UINT32_MAX; // The cpu of the last record on the thread
+#endif // TAREN_PROFILER_RECORD_CPU
+    };
+
+    struct OpenTask
+    {
+      uint32_t m_tagID = 0;               // The task tag descriptor id
+      clock::time_point m_begin;          // The task begin time
+      clock::time_point m_suspend;        // The time the task was suspended (default if running)
+      clock::duration m_suspendedTime{};  // The total time suspended
+    };
+
+    struct TaskAggregate
+    {
+      uint64_t m_count = 0;              // The number of times the task ended
+      clock::duration m_totalTime{};     // The total time from begin to end
+      clock::duration m_suspendedTime{}; // The total time suspended
+      clock::duration m_maxTime{};       // The longest single task
+    };
+
+    struct ThreadKey
+    {
+      std::thread::id m_threadID; // The thread id
+      uint32_t m_process = 0;     // The shared memory process slot of the thread (thread ids can repeat in each process)
+
+      bool operator==(const ThreadKey& i_other) const { return m_threadID == i_other.m_threadID && m_process == i_other.m_process; }
+    };
+
+    struct ThreadKeyHash
+    {
+      size_t operator()(const ThreadKey& i_key) const { return std::hash<std::thread::id>()(i_key.m_threadID) ^ i_key.m_process; }
+    };
+
+    int32_t m_threadCounter = 0;                                          // The thread index counter
+    std::unordered_map<ThreadKey, Tags, ThreadKeyHash> m_threadStack;     // The tag stack of each thread
+    int32_t m_taskIndex = -1;                                  // The index of the task track (assigned on the first task)
+    std::unordered_map<uint32_t, OpenTask> m_openTasks;        // The running tasks by task id
+    std::unordered_map<uint32_t, TaskAggregate> m_taskAggregates; // The per-task aggregates since the last write, by descriptor id
+    std::deque<std::string> m_pinnedTags;                      // Copies of open tag names that are still in use after the buffer is reused
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    std::unordered_map<uint64_t, uint32_t> m_processTagIDs;    // The tag ids of worker processes (process slot << 32 | tag id) as tag ids of this process
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+    std::vector<TagAggregate> m_tagAggregates;                      // The per-tag aggregates since the last write, indexed by descriptor id
+    std::vector<TagAggregate> m_addressAggregates;                  // The per-tag aggregates of address tags, indexed by address tag index
+    std::unordered_map<std::string, TagAggregate> m_copyAggregates; // The per-tag aggregates of copied tags
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+    std::deque<std::string> m_functionNames; // The resolved names of instrumented functions, indexed by address tag index
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+  };
+  JsonState g_jsonState; // The json writing state that persists across snapshots
+
+#if defined(TAREN_PROFILER_INSTRUMENT_FUNCTIONS) || defined(TAREN_PROFILER_SAMPLING)
+  std::string ResolveSymbolName(const void* i_address)
+  {
+    Dl_info info;
+    if (dladdr(i_address, &info) != 0 && info.dli_sname != nullptr)
+    {
+      int status = 0;
+      char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      std::string name = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+      free(demangled);
+      return name;
+    }
+
+    // No symbol (not exported, link with -rdynamic), so use the module offset
+    char buf[64];
+    if (dladdr(i_address, &info) != 0 && info.dli_fname != nullptr)
+    {
+      const char* moduleName = strrchr(info.dli_fname, '/');
+      moduleName = (moduleName != nullptr) ? moduleName + 1 : info.dli_fname;
+      std::snprintf(buf, sizeof(buf), "+0x%llx", (unsigned long long)((uintptr_t)i_address - (uintptr_t)info.dli_fbase));
+      return std::string(moduleName) + buf;
+    }
+    std::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)(uintptr_t)i_address);
+    return buf;
+  }
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS || TAREN_PROFILER_SAMPLING
+
+#ifdef TAREN_PROFILER_SAMPLING
+  struct StackSample
+  {
+    clock::time_point m_time;                      // The time of the sample
+    std::thread::id m_threadID;                    // The sampled thread
+    uint32_t m_frameCount = 0;                     // The number of frames
+    void* m_frames[TAREN_PROFILER_SAMPLE_DEPTH];   // The return addresses (leaf first)
+  };
+  StackSample g_samples[TAREN_PROFILER_SAMPLE_COUNT];                          // The stack samples of the capture
+  std::atomic_uint32_t g_sampleSlotCount{ TAREN_PROFILER_SAMPLE_COUNT };       // The claimed sample count (TAREN_PROFILER_SAMPLE_COUNT when not sampling)
+  std::atomic_uint32_t g_sampleCount{ 0 };                                     // The completely written sample count
+  std::atomic_uint32_t g_sampleWriteCount{ 0 };                                // The sample count to write at End()
+  bool g_sampleHandlerInstalled = false;                                       // If the SIGPROF handler is installed
+
+  void SampleSignalHandler(int, siginfo_t*, void*)
+  {
+    // Only async signal safe calls (backtrace is pre-loaded before sampling starts)
+    int savedErrno = errno;
+    uint32_t index = g_sampleSlotCount.fetch_add(1, std::memory_order_relaxed);
+    if (index < TAREN_PROFILER_SAMPLE_COUNT)
+    {
+      // Skip the signal handler and signal trampoline frames
+      const int c_skipFrames = 2;
+      void* frames[TAREN_PROFILER_SAMPLE_DEPTH + c_skipFrames];
+      int frameCount = backtrace(frames, TAREN_PROFILER_SAMPLE_DEPTH + c_skipFrames);
+
+      StackSample& sample = g_samples[index];
+      sample.m_time = clock::now();
+      sample.m_threadID = std::this_thread::get_id();
+      sample.m_frameCount = (frameCount > c_skipFrames) ? (uint32_t)(frameCount - c_skipFrames) : 0;
+      memcpy(sample.m_frames, frames + c_skipFrames, sample.m_frameCount * sizeof(void*));
+      g_sampleCount.fetch_add(1, std::memory_order_release);
+    }
+    errno = savedErrno;
+  }
+
+  void StartSampling()
+  {
+    if (!g_sampleHandlerInstalled)
+    {
+      // The first backtrace() call loads the unwinder, which is not safe in a signal handler
+      void* frames[1];
+      backtrace(frames, 1);
+
+      // The handler stays installed, as a SIGPROF could still be pending after the timer stops
+      struct sigaction action = {};
+      action.sa_sigaction = SampleSignalHandler;
+      action.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      g_sampleHandlerInstalled = (sigaction(SIGPROF, &action, nullptr) == 0);
+    }
+
+    g_sampleCount = 0;
+    g_sampleWriteCount = 0;
+    g_sampleSlotCount = 0; // Reset last as this opens the buffer to new samples
+
+    itimerval timer = {};
+    timer.it_interval.tv_usec = std::max(1000000 / TAREN_PROFILER_SAMPLE_RATE, 1);
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+
+  void StopSampling()
+  {
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    // Close the buffer, then wait for any handler still writing a sample
+    uint32_t sampleCount = std::min<uint32_t>(g_sampleSlotCount.exchange(TAREN_PROFILER_SAMPLE_COUNT), TAREN_PROFILER_SAMPLE_COUNT);
+    while (g_sampleCount.load(std::memory_order_acquire) != sampleCount)
+    {
+      std::this_thread::yield();
+    }
+    g_sampleWriteCount = sampleCount;
+  }
+#endif // TAREN_PROFILER_SAMPLING
+
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+  std::atomic_uint32_t g_instrumentExcludeCount = 0;                        // The number of exclusion prefixes
+  const char* g_instrumentExcludes[TAREN_PROFILER_INSTRUMENT_EXCLUDE_COUNT]; // The function name prefixes to exclude
+
+  thread_local uint32_t t_instrumentDepth = 0;                                   // The call depth of instrumented functions
+  thread_local bool t_instrumentRecorded[TAREN_PROFILER_INSTRUMENT_MAX_DEPTH + 1]; // If a begin tag was recorded at each depth
+  thread_local bool t_instrumentActive = false;                                  // Re-entry guard if the profiler itself is instrumented
+
+  __attribute__((no_instrument_function))
+  bool IsExcludedFunctionName(void* i_function)
+  {
+    Dl_info info;
+    if (dladdr(i_function, &info) == 0 || info.dli_sname == nullptr)
+    {
+      return false;
+    }
+
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    const char* name = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+
+    bool excluded = false;
+    uint32_t excludeCount = g_instrumentExcludeCount;
+    for (uint32_t i = 0; i < excludeCount && !excluded; i++)
+    {
+      excluded = strncmp(name, g_instrumentExcludes[i], strlen(g_instrumentExcludes[i])) == 0;
+    }
+
+    free(demangled);
+    return excluded;
+  }
+
+  __attribute__((no_instrument_function))
+  bool IsExcludedFunction(void* i_function, uint32_t i_addressIndex, bool i_inserted)
+  {
+    if (g_instrumentExcludeCount == 0)
+    {
+      return false;
+    }
+
+    // The exclusion state is cached with the address tag, so the name is only checked the first time it is called
+    AddressTag& addressTag = g_addressTags[i_addressIndex];
+    if (i_inserted)
+    {
+      bool excluded = IsExcludedFunctionName(i_function);
+      addressTag.m_state = excluded ? 2 : 1;
+      return excluded;
+    }
+
+    uint8_t state = addressTag.m_state;
+    return (state == 0) ? IsExcludedFunctionName(i_function) : (state == 2); // Resolve if another thread is still resolving
+  }
+
+  const char* GetFunctionName(JsonState& io_state, uint32_t i_addressIndex)
+  {
+    if (io_state.m_functionNames.size() <= i_addressIndex)
+    {
+      io_state.m_functionNames.resize(i_addressIndex + 1);
+    }
+
+    std::string& name = io_state.m_functionNames[i_addressIndex];
+    if (name.empty())
+    {
+      name = ResolveSymbolName((const void*)g_addressTags[i_addressIndex].m_address.load());
+    }
+    return name.c_str();
+  }
+
+  const char* GetSymbolName(uint32_t i_addressIndex)
+  {
+    // Get the raw symbol name without allocating (used when the json state cannot be accessed)
+    Dl_info info;
+    if (dladdr((const void*)g_addressTags[i_addressIndex].m_address.load(), &info) != 0 && info.dli_sname != nullptr)
+    {
+      return info.dli_sname;
+    }
+    return "Unknown";
+  }
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
+  uint32_t CopyStr(RecordBuffer& io_buffer, const char* i_str)
+  {
+    // Allocate space to copy into
+    uint32_t len = (uint32_t)strlen(i_str) + 1;
+    uint32_t startOffset = io_buffer.m_copyBufferSize.fetch_add(len);
+    if ((startOffset + len) <= TAREN_PROFILER_TAG_NAME_BUFFER_SIZE)
+    {
+      char* outBuffer = &io_buffer.m_copyBuffer[startOffset];
+      memcpy(outBuffer, i_str, len);
+      return startOffset | c_copyTagFlag;
+    }
+    else
+    {
+      io_buffer.m_copyBufferSize -= len; // Undo the add to make room for a smaller tag
+    }
+
+    return c_outOfBufferTagID;
+  }
+
+  uint32_t CopyArgs(RecordBuffer& io_buffer, const taren_profiler::TagArg* i_args, uint32_t i_argCount, uint8_t& o_argCount)
+  {
+    // The args are dropped if the arg array is full
+    uint32_t startIndex = io_buffer.m_argCount.fetch_add(i_argCount);
+    if ((startIndex + i_argCount) > TAREN_PROFILER_TAG_ARG_COUNT)
+    {
+      io_buffer.m_argCount -= i_argCount; // Undo the add to make room for a tag with fewer args
+      o_argCount = 0;
+      return 0;
+    }
+    memcpy((void*)&io_buffer.m_args[startIndex], i_args, sizeof(taren_profiler::TagArg) * i_argCount);
+    o_argCount = (uint8_t)i_argCount;
+    return startIndex;
+  }
+
+#ifdef TAREN_PROFILER_HISTOGRAMS
+  const uint32_t c_histogramSubBucketCount = 64;                                  // Sub buckets per power of 2 (about 2 significant digits)
+  const uint32_t c_histogramMaxExponent = 40;                                     // Max power of 2 nanoseconds recorded (about 36 minutes)
+  const uint32_t c_histogramBucketCount = c_histogramSubBucketCount * (c_histogramMaxExponent - 4); // Values below 128ns are exact
+
+  struct Histogram
+  {
+    std::atomic_uint32_t m_state{ 0 };                              // The HistogramState
+    uint32_t m_tagID = 0;                                           // The tag id
+    taren_profiler::TagType m_type = taren_profiler::TagType::Begin; // The begin tag type (to resolve function names)
+    std::atomic_uint64_t m_maxNS{ 0 };                              // The max time in nanoseconds
+    std::atomic_uint32_t m_counts[c_histogramBucketCount];          // The count of each bucket (only written by the owning thread)
+  };
+
+  struct HistogramOpenTag
+  {
+    uint32_t m_tagID;                // The tag id
+    taren_profiler::TagType m_type;  // The begin tag type
+    clock::time_point m_time;        // The begin time
+  };
+
+  const uint32_t c_histogramPoolCount = TAREN_PROFILER_HISTOGRAM_TAG_COUNT * TAREN_PROFILER_HISTOGRAM_THREAD_COUNT; // The number of pooled histograms
+
+  enum HistogramState : uint32_t
+  {
+    HistogramStateFree = 0, // In the pool (cleared)
+    HistogramStateThread,   // Owned by a running thread
+    HistogramStateRetired,  // Holds the merged counts of threads that have exited
+  };
+
+  std::mutex g_histogramMutex;                                  // Mutex protecting the thread exit merges and the reset (not taken by tag calls)
+  std::atomic_uint32_t g_histogramSession = 0;                  // Incremented each Begin() so stale thread stacks are reset
+  std::atomic_uint32_t g_histogramNext = 0;                     // Where the next claim starts looking for a free histogram
+  std::atomic_uint32_t g_histogramFreeCount = c_histogramPoolCount; // The number of free histograms in the pool
+  Histogram g_histograms[c_histogramPoolCount];                 // The histogram pool (zero initialized, so unused pages are not touched)
+  Histogram* g_retiredHistograms[TAREN_PROFILER_HISTOGRAM_TAG_COUNT]; // The retired histogram of each tag, hashed by tag id (protected by g_histogramMutex)
+
+  thread_local Histogram* t_histograms[TAREN_PROFILER_HISTOGRAM_TAG_COUNT];              // The thread's histograms, hashed by tag id
+  thread_local HistogramOpenTag t_histogramStack[TAREN_PROFILER_HISTOGRAM_STACK_DEPTH];  // The thread's open tags
+  thread_local uint32_t t_histogramDepth = 0;                                            // The number of open tags (can be larger than the stack size)
+  thread_local uint32_t t_histogramSession = 0;                                          // The session the thread's stack is from
+  thread_local bool t_histogramsReleased = false;                                        // If the thread is exiting
+
+  uint32_t GetHistogramBucket(uint64_t i_timeNS)
+  {
+    if (i_timeNS < c_histogramSubBucketCount * 2)
+    {
+      return (uint32_t)i_timeNS;
+    }
+
+    uint32_t exponent = 0;
+    while ((i_timeNS >> (exponent + 1)) != 0)
+    {
+      exponent++;
+    }
+    if (exponent > c_histogramMaxExponent)
+    {
+      return c_histogramBucketCount - 1;
+    }
+
+    // The top 7 bits select the sub bucket
+    uint32_t shift = exponent - 6;
+    return c_histogramSubBucketCount * (exponent - 5) + (uint32_t)(i_timeNS >> shift) - c_histogramSubBucketCount;
+  }
+
+  uint64_t GetHistogramBucketMax(uint32_t i_bucket)
+  {
+    if (i_bucket < c_histogramSubBucketCount * 2)
+    {
+      return i_bucket;
+    }
+    uint32_t exponent = i_bucket / c_histogramSubBucketCount + 5;
+    uint64_t subBucket = i_bucket % c_histogramSubBucketCount + c_histogramSubBucketCount;
+    return ((subBucket + 1) << (exponent - 6)) - 1;
+  }
+
+  void ClearHistogram(Histogram& o_histogram)
+  {
+    o_histogram.m_maxNS.store(0, std::memory_order_relaxed);
+    for (std::atomic_uint32_t& count : o_histogram.m_counts)
+    {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void MergeHistogram(Histogram& io_histogram, const Histogram& i_add)
+  {
+    io_histogram.m_maxNS.store(std::max(io_histogram.m_maxNS.load(std::memory_order_relaxed), i_add.m_maxNS.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+    for (uint32_t i = 0; i < c_histogramBucketCount; i++)
+    {
+      io_histogram.m_counts[i].store(io_histogram.m_counts[i].load(std::memory_order_relaxed) + i_add.m_counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+  }
+
+  Histogram* ClaimHistogram(uint32_t i_tagID, taren_profiler::TagType i_type)
+  {
+    // Free histograms are already cleared, so claiming one is a compare exchange of its state
+    uint32_t freeCount = g_histogramFreeCount.load(std::memory_order_relaxed);
+    while (freeCount > 0)
+    {
+      if (!g_histogramFreeCount.compare_exchange_weak(freeCount, freeCount - 1, std::memory_order_relaxed))
+      {
+        continue;
+      }
+      uint32_t startIndex = g_histogramNext.fetch_add(1, std::memory_order_relaxed);
+      for (uint32_t i = 0; ; i++)
+      {
+        Histogram& histogram = g_histograms[(startIndex + i) % c_histogramPoolCount];
+        uint32_t state = HistogramStateFree;
+        if (histogram.m_state.load(std::memory_order_relaxed) == HistogramStateFree &&
+            histogram.m_state.compare_exchange_strong(state, HistogramStateThread, std::memory_order_acquire))
+        {
+          histogram.m_tagID = i_tagID;
+          histogram.m_type = i_type;
+          return &histogram;
+        }
+      }
+    }
+    return nullptr; // Pool is empty
+  }
+
+  void FreeHistogram(Histogram& io_histogram)
+  {
+    ClearHistogram(io_histogram);
+    io_histogram.m_state.store(HistogramStateFree, std::memory_order_release);
+    g_histogramFreeCount++;
+  }
+
+  struct HistogramThread
+  {
+    ~HistogramThread()
+    {
+      // Merge into the retired histogram of the tag (or keep it as the retired one), so the pool can be reused by new threads
+      std::lock_guard<std::mutex> lock(g_histogramMutex);
+      t_histogramsReleased = true;
+      for (Histogram*& histogram : t_histograms)
+      {
+        if (histogram == nullptr)
+        {
+          continue;
+        }
+
+        bool merged = false;
+        uint32_t startIndex = (uint32_t)(histogram->m_tagID * 2654435761u) % TAREN_PROFILER_HISTOGRAM_TAG_COUNT;
+        for (uint32_t i = 0; i < TAREN_PROFILER_HISTOGRAM_TAG_COUNT; i++)
+        {
+          Histogram*& retired = g_retiredHistograms[(startIndex + i) % TAREN_PROFILER_HISTOGRAM_TAG_COUNT];
+          if (retired == nullptr)
+          {
+            retired = histogram;
+            break;
+          }
+          if (retired->m_tagID == histogram->m_tagID)
+          {
+            MergeHistogram(*retired, *histogram);
+            merged = true;
+            break;
+          }
+        }
+        if (merged)
+        {
+          FreeHistogram(*histogram);
+        }
+        else
+        {
+          histogram->m_state.store(HistogramStateRetired, std::memory_order_relaxed); // The first retired histogram of the tag (or the table is full)
+        }
+        histogram = nullptr;
+      }
+    }
+  };
+  thread_local HistogramThread t_histogramThread; // Releases the thread's histograms on thread exit
+
+  Histogram* GetHistogram(uint32_t i_tagID, taren_profiler::TagType i_type)
+  {
+    uint32_t startIndex = (uint32_t)(i_tagID * 2654435761u) % TAREN_PROFILER_HISTOGRAM_TAG_COUNT;
+    for (uint32_t i = 0; i < TAREN_PROFILER_HISTOGRAM_TAG_COUNT; i++)
+    {
+      Histogram*& histogram = t_histograms[(startIndex + i) % TAREN_PROFILER_HISTOGRAM_TAG_COUNT];
+      if (histogram == nullptr)
+      {
+        // First use of the tag on this thread
+        (void)&t_histogramThread;
+        histogram = ClaimHistogram(i_tagID, i_type);
+        return histogram;
+      }
+      if (histogram->m_tagID == i_tagID)
+      {
+        return histogram;
+      }
+    }
+    return nullptr; // Table is full
+  }
+
+  void AddHistogramTag(taren_profiler::TagType i_type, uint32_t i_tagID, clock::time_point i_time)
+  {
+    if (t_histogramsReleased)
+    {
+      return;
+    }
+
+    // Reset the stack if left over from a previous profile
+    uint32_t session = g_histogramSession.load(std::memory_order_relaxed);
+    if (t_histogramSession != session)
+    {
+      t_histogramSession = session;
+      t_histogramDepth = 0;
+    }
+
+    if (i_type == taren_profiler::TagType::Begin ||
+        i_type == taren_profiler::TagType::FunctionBegin)
+    {
+      if (t_histogramDepth < TAREN_PROFILER_HISTOGRAM_STACK_DEPTH)
+      {
+        t_histogramStack[t_histogramDepth] = HistogramOpenTag{ i_tagID, i_type, i_time };
+      }
+      t_histogramDepth++;
+    }
+    else if (i_type == taren_profiler::TagType::End &&
+             t_histogramDepth > 0)
+    {
+      t_histogramDepth--;
+      if (t_histogramDepth >= TAREN_PROFILER_HISTOGRAM_STACK_DEPTH)
+      {
+        return;
+      }
+
+      // Unknown and copied tags are not tracked
+      const HistogramOpenTag& openTag = t_histogramStack[t_histogramDepth];
+      if (openTag.m_tagID == c_unknownTagID)
+      {
+        return;
+      }
+
+      Histogram* histogram = GetHistogram(openTag.m_tagID, openTag.m_type);
+      if (histogram != nullptr)
+      {
+        uint64_t timeNS = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(i_time - openTag.m_time).count();
+        std::atomic_uint32_t& count = histogram->m_counts[GetHistogramBucket(timeNS)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (timeNS > histogram->m_maxNS.load(std::memory_order_relaxed))
+        {
+          histogram->m_maxNS.store(timeNS, std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  void ResetHistograms()
+  {
+    std::lock_guard<std::mutex> lock(g_histogramMutex);
+    g_histogramSession++;
+    for (Histogram& histogram : g_histograms)
+    {
+      uint32_t state = histogram.m_state.load(std::memory_order_relaxed);
+      if (state == HistogramStateThread)
+      {
+        ClearHistogram(histogram);
+      }
+      else if (state == HistogramStateRetired)
+      {
+        FreeHistogram(histogram);
+      }
+    }
+    for (Histogram*& retired : g_retiredHistograms)
+    {
+      retired = nullptr;
+    }
+  }
+#endif // TAREN_PROFILER_HISTOGRAMS
+
+#ifdef TAREN_PROFILER_SLOWEST
+  // The kept scopes are static, so all the members are zero initialized (the pages of unused slots are never touched)
+  struct SlowestRecord
+  {
+    clock::time_point m_time;                     // The record time
+    uint64_t m_sequence = 0;                      // The index of the record on its thread
+    uint32_t m_tagID = 0;                         // The tag id (the begin tag id for end records, c_copyTagFlag for copied tags)
+    int32_t m_value = 0;                          // The value of value tags
+    uint32_t m_recordIndex = 0;                   // The index of the record in the record buffer (UINT32_MAX if not recorded)
+    const RecordBuffer* m_buffer = nullptr;       // The record buffer the record was written to (nullptr if not recorded)
+    taren_profiler::TagType m_type = taren_profiler::TagType::Begin; // The record type
+    char m_copyName[TAREN_PROFILER_FORMAT_COUNT]; // The name of a copied tag
+  };
+
+  struct SlowestInstance
+  {
+    uint64_t m_timeNS = 0;        // The scope time in nanoseconds (0 if the slot is unused)
+    std::thread::id m_threadID;   // The thread of the scope
+    bool m_truncated = false;     // If the nested records were overwritten before the scope ended (only the scope is kept)
+    uint32_t m_recordCount = 0;   // The number of records
+    SlowestRecord m_records[TAREN_PROFILER_SLOWEST_RECORD_COUNT]; // The records from the scope begin to the scope end
+  };
+
+  struct SlowestTag
+  {
+    std::atomic_uint32_t m_tagID{ 0 };                    // The tag id (0 if the slot is unused)
+    std::atomic_uint64_t m_thresholdNS{ 0 };              // The time a scope has to exceed to be kept
+    std::atomic_bool m_busy{ false };                     // Set while a scope is being kept or End() reads the kept scopes
+    SlowestInstance m_instances[TAREN_PROFILER_SLOWEST_COUNT]; // The kept scope slots
+  };
+
+  struct SlowestOpenTag
+  {
+    uint32_t m_tagID;               // The tag id
+    taren_profiler::TagType m_type; // The begin tag type
+    clock::time_point m_time;       // The begin time
+    uint64_t m_sequence;            // The begin record index on the thread
+  };
+
+  std::atomic_uint32_t g_slowestSession = 0;                       // Incremented each Begin() so stale thread stacks are reset
+  SlowestTag g_slowestTags[TAREN_PROFILER_SLOWEST_TAG_COUNT];      // The kept scopes of each tag, hashed by tag id
+
+  thread_local SlowestRecord t_slowestRecords[TAREN_PROFILER_SLOWEST_RECORD_COUNT]; // The thread's latest records (ring buffer)
+  thread_local SlowestOpenTag t_slowestStack[TAREN_PROFILER_SLOWEST_RECORD_COUNT];  // The thread's open tags
+  thread_local uint32_t t_slowestDepth = 0;                                         // The number of open tags (can be larger than the stack size)
+  thread_local uint64_t t_slowestSequence = 0;                                      // The index of the next record on the thread
+  thread_local uint32_t t_slowestSession = 0;                                       // The session the thread's stack is from
+
+  struct SlowestTagsLock
+  {
+    // Waits for the instrumented threads to finish keeping scopes, they skip the tags while locked (so never wait)
+    SlowestTagsLock()
+    {
+      for (SlowestTag& tag : g_slowestTags)
+      {
+        while (tag.m_busy.exchange(true, std::memory_order_acquire))
+        {
+          std::this_thread::yield();
+        }
+      }
+    }
+    ~SlowestTagsLock()
+    {
+      for (SlowestTag& tag : g_slowestTags)
+      {
+        tag.m_busy.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  SlowestTag* GetSlowestTag(uint32_t i_tagID)
+  {
+    uint32_t startIndex = (uint32_t)(i_tagID * 2654435761u) % TAREN_PROFILER_SLOWEST_TAG_COUNT;
+    for (uint32_t i = 0; i < TAREN_PROFILER_SLOWEST_TAG_COUNT; i++)
+    {
+      SlowestTag& tag = g_slowestTags[(startIndex + i) % TAREN_PROFILER_SLOWEST_TAG_COUNT];
+      uint32_t tagID = tag.m_tagID.load(std::memory_order_acquire);
+      if (tagID == 0 &&
+          tag.m_tagID.compare_exchange_strong(tagID, i_tagID, std::memory_order_acq_rel))
+      {
+        return &tag;
+      }
+      if (tagID == i_tagID)
+      {
+        return &tag;
+      }
+    }
+    return nullptr; // Table is full
+  }
+
+  void AddSlowestInstance(SlowestTag& io_tag, const SlowestOpenTag& i_openTag, uint64_t i_endSequence, uint64_t i_timeNS)
+  {
+    // Skip the scope if another thread is keeping a scope of the tag
+    if (io_tag.m_busy.exchange(true, std::memory_order_acquire))
+    {
+      return;
+    }
+    SlowestInstance* instances = io_tag.m_instances;
+
+    // Replace the fastest kept scope (unused slots have a time of 0)
+    SlowestInstance* fastest = &instances[0];
+    for (uint32_t i = 1; i < TAREN_PROFILER_SLOWEST_COUNT; i++)
+    {
+      fastest = (instances[i].m_timeNS < fastest->m_timeNS) ? &instances[i] : fastest;
+    }
+    if (i_timeNS > fastest->m_timeNS)
+    {
+      SlowestInstance& instance = *fastest;
+      instance.m_timeNS = i_timeNS;
+      instance.m_threadID = std::this_thread::get_id();
+
+      // Copy the scope and the nested records, or only the scope if the begin record has been overwritten
+      instance.m_truncated = (i_endSequence - i_openTag.m_sequence) >= TAREN_PROFILER_SLOWEST_RECORD_COUNT;
+      if (instance.m_truncated)
+      {
+        SlowestRecord& begin = instance.m_records[0];
+        begin = SlowestRecord();
+        begin.m_recordIndex = UINT32_MAX;
+        begin.m_time = i_openTag.m_time;
+        begin.m_sequence = i_openTag.m_sequence;
+        begin.m_tagID = i_openTag.m_tagID;
+        begin.m_type = i_openTag.m_type;
+        instance.m_records[1] = t_slowestRecords[i_endSequence % TAREN_PROFILER_SLOWEST_RECORD_COUNT];
+        instance.m_recordCount = 2;
+      }
+      else
+      {
+        instance.m_recordCount = 0;
+        for (uint64_t i = i_openTag.m_sequence; i <= i_endSequence; i++)
+        {
+          instance.m_records[instance.m_recordCount++] = t_slowestRecords[i % TAREN_PROFILER_SLOWEST_RECORD_COUNT];
+        }
+      }
+
+      // The threshold stays 0 until every slot is used
+      uint64_t thresholdNS = instances[0].m_timeNS;
+      for (uint32_t i = 1; i < TAREN_PROFILER_SLOWEST_COUNT; i++)
+      {
+        thresholdNS = std::min(thresholdNS, instances[i].m_timeNS);
+      }
+      io_tag.m_thresholdNS.store(thresholdNS, std::memory_order_relaxed);
+    }
+    io_tag.m_busy.store(false, std::memory_order_release);
+  }
+
+  void AddSlowestTag(taren_profiler::TagType i_type, uint32_t i_tagID, const char* i_copyStr, int32_t i_value, const RecordBuffer* i_buffer, uint64_t i_recordIndex, clock::time_point i_time)
+  {
+    if (i_type != taren_profiler::TagType::Begin &&
+        i_type != taren_profiler::TagType::FunctionBegin &&
+        i_type != taren_profiler::TagType::End &&
+        i_type != taren_profiler::TagType::Value)
+    {
+      return;
+    }
+
+    // Reset the stack if left over from a previous profile
+    uint32_t session = g_slowestSession.load(std::memory_order_relaxed);
+    if (t_slowestSession != session)
+    {
+      t_slowestSession = session;
+      t_slowestDepth = 0;
+    }
+
+    // Add to the thread's ring of records
+    uint64_t sequence = t_slowestSequence++;
+    SlowestRecord& record = t_slowestRecords[sequence % TAREN_PROFILER_SLOWEST_RECORD_COUNT];
+    record.m_time = i_time;
+    record.m_sequence = sequence;
+    record.m_tagID = (i_copyStr != nullptr) ? c_copyTagFlag : i_tagID;
+    record.m_value = i_value;
+    record.m_recordIndex = (i_recordIndex < TAREN_PROFILER_TAG_MAX_COUNT) ? (uint32_t)i_recordIndex : UINT32_MAX;
+    record.m_buffer = i_buffer;
+    record.m_type = i_type;
+    if (i_copyStr != nullptr)
+    {
+      strncpy(record.m_copyName, i_copyStr, TAREN_PROFILER_FORMAT_COUNT - 1);
+      record.m_copyName[TAREN_PROFILER_FORMAT_COUNT - 1] = '\0';
+    }
+
+    if (i_type == taren_profiler::TagType::Begin ||
+        i_type == taren_profiler::TagType::FunctionBegin)
+    {
+      if (t_slowestDepth < TAREN_PROFILER_SLOWEST_RECORD_COUNT)
+      {
+        t_slowestStack[t_slowestDepth] = SlowestOpenTag{ record.m_tagID, i_type, i_time, sequence };
+      }
+      t_slowestDepth++;
+    }
+    else if (i_type == taren_profiler::TagType::End)
+    {
+      record.m_tagID = c_unknownTagID;
+      if (t_slowestDepth == 0)
+      {
+        return;
+      }
+      t_slowestDepth--;
+      if (t_slowestDepth >= TAREN_PROFILER_SLOWEST_RECORD_COUNT)
+      {
+        return;
+      }
+
+      // Name the end record after the begin record
+      const SlowestOpenTag& openTag = t_slowestStack[t_slowestDepth];
+      record.m_tagID = openTag.m_tagID;
+      if (openTag.m_tagID == c_copyTagFlag)
+      {
+        const SlowestRecord& begin = t_slowestRecords[openTag.m_sequence % TAREN_PROFILER_SLOWEST_RECORD_COUNT];
+        if (begin.m_sequence == openTag.m_sequence)
+        {
+          memcpy(record.m_copyName, begin.m_copyName, TAREN_PROFILER_FORMAT_COUNT);
+        }
+        else
+        {
+          record.m_tagID = c_unknownTagID;
+        }
+        return; // Copied tags are not tracked
+      }
+      if (openTag.m_tagID == c_unknownTagID)
+      {
+        return;
+      }
+
+      // Only copy the records when the scope is slower than the kept scopes
+      SlowestTag* tag = GetSlowestTag(openTag.m_tagID);
+      uint64_t timeNS = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(i_time - openTag.m_time).count();
+      if (tag != nullptr &&
+          timeNS > tag->m_thresholdNS.load(std::memory_order_relaxed))
+      {
+        AddSlowestInstance(*tag, openTag, sequence, timeNS);
+      }
+    }
+  }
+
+  void ResetSlowest()
+  {
+    SlowestTagsLock lock;
+    g_slowestSession++;
+    for (SlowestTag& tag : g_slowestTags)
+    {
+      // Only the slots of the tags used by the last profile have been written
+      if (tag.m_tagID.load(std::memory_order_relaxed) == 0)
+      {
+        continue;
+      }
+      tag.m_tagID.store(0, std::memory_order_relaxed);
+      tag.m_thresholdNS.store(0, std::memory_order_relaxed);
+      for (SlowestInstance& instance : tag.m_instances)
+      {
+        instance.m_timeNS = 0;
+        instance.m_recordCount = 0;
+      }
+    }
+  }
+#endif // TAREN_PROFILER_SLOWEST
+
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+  const uint32_t c_taskContextDepth = 16; // Max nested task resumes on a thread that restore the previous trace context
+  const uint32_t c_taskContextProbeCount = 8; // How many slots of the task context table a task id can be in
+
+  static_assert((TAREN_PROFILER_TASK_CONTEXT_COUNT & (TAREN_PROFILER_TASK_CONTEXT_COUNT - 1)) == 0, "TAREN_PROFILER_TASK_CONTEXT_COUNT must be a power of 2");
+
+  enum TaskContextState : uint32_t
+  {
+    TaskContextFree = 0, // The slot is unused
+    TaskContextWrite,    // A task begin is writing the slot
+    TaskContextUsed,     // The slot has the context of a running task
+  };
+
+  struct TaskContext
+  {
+    std::atomic_uint32_t m_state{ TaskContextFree }; // The TaskContextState
+    std::atomic_uint64_t m_taskID{ 0 };              // The task id
+    std::atomic_uint64_t m_requestID{ 0 };           // The request id of the task's context
+    std::atomic_bool m_sampled{ true };              // If the request of the task's context is sampled
+  };
+
+  struct ResumedTask
+  {
+    uint64_t m_taskID;                       // The resumed task id
+    taren_profiler::TraceContext m_previous; // The thread's context before the resume
+  };
+
+  std::atomic_uint32_t g_requestSampleRate = 1;  // Record one in this many requests
+  std::atomic_uint64_t g_requestCounter = 0;     // Assigns the ids of requests begun without one
+  TaskContext g_taskContexts[TAREN_PROFILER_TASK_CONTEXT_COUNT]; // The trace context of each running task begun in a request
+  std::atomic_uint32_t g_taskContextCount = 0;   // The number of task contexts (so resumes only search when there are any)
+
+  thread_local taren_profiler::TraceContext t_traceContext;         // The thread's trace context
+  thread_local ResumedTask t_resumedTasks[c_taskContextDepth];      // The tasks resumed on the thread
+  thread_local uint32_t t_resumedTaskDepth = 0;                     // The number of resumed tasks (can be larger than the array size)
+
+  bool IsRequestSampled(uint64_t i_requestID, uint32_t i_oneIn)
+  {
+    if (i_oneIn <= 1)
+    {
+      return i_oneIn == 1;
+    }
+    uint64_t hash = i_requestID * 0x9E3779B97F4A7C15ull; // Spread sequential ids
+    return ((hash >> 32) % i_oneIn) == 0;
+  }
+
+  TaskContext* FindTaskContext(uint64_t i_taskID)
+  {
+    // Every probe slot is checked, as the slots before the task's slot can be freed
+    uint32_t startIndex = (uint32_t)((i_taskID * 0x9E3779B97F4A7C15ull) >> 32);
+    for (uint32_t i = 0; i < c_taskContextProbeCount; i++)
+    {
+      TaskContext& context = g_taskContexts[(startIndex + i) & (TAREN_PROFILER_TASK_CONTEXT_COUNT - 1)];
+      if (context.m_state.load(std::memory_order_acquire) == TaskContextUsed &&
+          context.m_taskID.load(std::memory_order_relaxed) == i_taskID)
+      {
+        return &context;
+      }
+    }
+    return nullptr;
+  }
+
+  void AddTaskContext(uint64_t i_taskID)
+  {
+    // Replace the context if the task id is reused without an end
+    TaskContext* context = FindTaskContext(i_taskID);
+    if (context == nullptr)
+    {
+      uint32_t startIndex = (uint32_t)((i_taskID * 0x9E3779B97F4A7C15ull) >> 32);
+      for (uint32_t i = 0; i < c_taskContextProbeCount && context == nullptr; i++)
+      {
+        TaskContext& slot = g_taskContexts[(startIndex + i) & (TAREN_PROFILER_TASK_CONTEXT_COUNT - 1)];
+        uint32_t state = TaskContextFree;
+        if (slot.m_state.compare_exchange_strong(state, TaskContextWrite, std::memory_order_acquire))
+        {
+          context = &slot;
+          g_taskContextCount++;
+        }
+      }
+      if (context == nullptr)
+      {
+        return; // The probe slots are full, the task does not carry the context
+      }
+    }
+    context->m_taskID.store(i_taskID, std::memory_order_relaxed);
+    context->m_requestID.store(t_traceContext.m_requestID, std::memory_order_relaxed);
+    context->m_sampled.store(t_traceContext.m_sampled, std::memory_order_relaxed);
+    context->m_state.store(TaskContextUsed, std::memory_order_release);
+  }
+
+  void UpdateTaskContext(taren_profiler::TagType i_type, uint64_t i_taskID)
+  {
+    // Keep the context of tasks begun in a request while profiling, so it follows the task to the threads that resume it
+    if (i_type == taren_profiler::TagType::TaskBegin)
+    {
+      if (t_traceContext.m_requestID != 0 && g_enabled)
+      {
+        AddTaskContext(i_taskID);
+      }
+      return;
+    }
+    if (i_type == taren_profiler::TagType::TaskResume)
+    {
+      taren_profiler::TraceContext previous = t_traceContext;
+      TaskContext* context = (g_taskContextCount.load(std::memory_order_relaxed) > 0) ? FindTaskContext(i_taskID) : nullptr;
+      if (context != nullptr)
+      {
+        t_traceContext.m_requestID = context->m_requestID.load(std::memory_order_relaxed);
+        t_traceContext.m_sampled = context->m_sampled.load(std::memory_order_relaxed);
+      }
+      if (t_resumedTaskDepth < c_taskContextDepth)
+      {
+        t_resumedTasks[t_resumedTaskDepth] = ResumedTask{ i_taskID, previous };
+      }
+      t_resumedTaskDepth++;
+      return;
+    }
+
+    // Suspend / end, restore the context from before the task was resumed on this thread
+    if (t_resumedTaskDepth > 0 &&
+        (t_resumedTaskDepth > c_taskContextDepth || t_resumedTasks[t_resumedTaskDepth - 1].m_taskID == i_taskID))
+    {
+      t_resumedTaskDepth--;
+      if (t_resumedTaskDepth < c_taskContextDepth)
+      {
+        t_traceContext = t_resumedTasks[t_resumedTaskDepth].m_previous;
+      }
+    }
+    if (i_type == taren_profiler::TagType::TaskEnd &&
+        g_taskContextCount.load(std::memory_order_relaxed) > 0)
+    {
+      TaskContext* context = FindTaskContext(i_taskID);
+      if (context != nullptr)
+      {
+        context->m_state.store(TaskContextFree, std::memory_order_release);
+        g_taskContextCount--;
+      }
+    }
+  }
+
+  void ResetTaskContexts()
+  {
+    // Drop the contexts of tasks that never ended
+    for (TaskContext& context : g_taskContexts)
+    {
+      context.m_state.store(TaskContextFree, std::memory_order_relaxed);
+    }
+    g_taskContextCount = 0;
+  }
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+
+  /// \brief Add a profile record to the active buffer
+  /// \param i_time The time to record, if nullptr the time is read as the last thing before the record is completed
+  /// \return The time of the record (the clock epoch if nothing was recorded)
+  clock::time_point AddRecord(taren_profiler::TagType i_type, uint32_t i_tagID, const char* i_copyStr, int32_t i_value, const taren_profiler::TagArg* i_args = nullptr, uint32_t i_argCount = 0,
+                              uint8_t i_flags = 0, const clock::time_point* i_time = nullptr)
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    // Nothing is recorded for requests that were not sampled
+    if (!t_traceContext.m_sampled)
+    {
+      return clock::time_point();
+    }
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+
+    clock::time_point time;
+#ifdef TAREN_PROFILER_SLOWEST
+    const RecordBuffer* slowestBuffer = nullptr;
+    uint64_t slowestRecordIndex = UINT64_MAX;
+#endif // TAREN_PROFILER_SLOWEST
+    for (;;)
+    {
+      // Get the slot to put the record
+      uint32_t bufferIndex = g_activeBuffer;
+      RecordBuffer& buffer = g_buffers[bufferIndex];
+      uint64_t recordIndex = buffer.m_slotCount.fetch_add(1);
+      if (recordIndex < TAREN_PROFILER_TAG_MAX_COUNT)
+      {
+        ProfileRecord& newData = buffer.m_records[recordIndex];
+        newData.m_type = i_type;
+        newData.m_threadID = std::this_thread::get_id();
+        newData.m_tagID = (i_copyStr != nullptr) ? CopyStr(buffer, i_copyStr) : i_tagID;
+        newData.m_argCount = 0;
+        newData.m_flags = i_flags;
+        newData.m_value = (i_args != nullptr) ? (int32_t)CopyArgs(buffer, i_args, i_argCount, newData.m_argCount) : i_value;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+        newData.m_process = g_processIndex;
+#endif // TAREN_PROFILER_SHARED_MEMORY
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+        ReadPerfCounters(newData.m_counters);
+#endif // TAREN_PROFILER_PERF_COUNTERS
+#ifdef TAREN_PROFILER_RECORD_CPU
+        newData.m_cpu = GetCurrentCpu();
+#endif // TAREN_PROFILER_RECORD_CPU
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+        newData.m_cpuTimeNS = GetThreadCpuTimeNS();
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+        newData.m_requestID = t_traceContext.m_requestID;
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+        time = (i_time != nullptr) ? *i_time : clock::now();  // Assign the time as the last possible thing
+        newData.m_time = time;
+
+        newData.m_generation.m_value.store(buffer.m_generation.load(std::memory_order_relaxed), std::memory_order_release); // Flag the record is complete for QueryStats()
+        buffer.m_recordCount++; // Flag that the record is complete
+#ifdef TAREN_PROFILER_SLOWEST
+        slowestBuffer = &buffer;
+        slowestRecordIndex = recordIndex;
+#endif // TAREN_PROFILER_SLOWEST
+        break;
+      }
+
+      // Only hit if exceeded the record count or end of profiling. 
+      // If a snapshot swapped buffers while getting the slot, try again with the new buffer.
+      if (bufferIndex == g_activeBuffer)
+      {
+        time = (i_time != nullptr) ? *i_time : clock::now();
+        break;
+      }
+    }
+
+#ifdef TAREN_PROFILER_HISTOGRAMS
+    AddHistogramTag(i_type, (i_copyStr == nullptr) ? i_tagID : c_unknownTagID, time);
+#endif // TAREN_PROFILER_HISTOGRAMS
+#ifdef TAREN_PROFILER_SLOWEST
+    AddSlowestTag(i_type, i_tagID, i_copyStr, i_value, slowestBuffer, slowestRecordIndex, time);
+#endif // TAREN_PROFILER_SLOWEST
+    return time;
+  }
+
+#ifdef TAREN_PROFILER_GAUGES
+  struct Gauge
+  {
+    const char* m_name = nullptr;                       // The gauge name
+    uint32_t m_tagID = 0;                               // The tag id of the gauge name
+    taren_profiler::GaugeCallback m_callback = nullptr; // The callback (nullptr if unregistered)
+    void* m_userData = nullptr;                         // The callback user data
+    bool m_calling = false;                             // If the gauge thread is in the callback (set under g_gaugeMutex)
+  };
+
+  std::mutex g_gaugeMutex;                      // Mutex protecting the gauge registration (not held during the callbacks)
+  uint32_t g_gaugeCount = 0;                    // The number of registered gauge slots
+  Gauge g_gauges[TAREN_PROFILER_GAUGE_COUNT];   // The registered gauges, indexed by gauge id
+  std::condition_variable g_gaugeCondition;     // Condition to wake the gauge thread on shutdown
+  std::condition_variable g_gaugeCallCondition; // Condition signaled when a gauge callback returns (for UnregisterGauge())
+  thread_local bool t_gaugeThread = false;      // If this is the gauge thread (which does not wait for its own callback)
+  std::thread g_gaugeThread;                    // The thread polling the gauges
+  std::thread::id g_gaugeThreadID;              // The id of the last gauge thread (to name its track)
+  bool g_gaugeStop = false;                     // If the gauge thread should exit
+
+  void AddGaugeRecord(uint32_t i_tagID, int64_t i_value)
+  {
+    AddRecord(taren_profiler::TagType::Gauge, i_tagID, nullptr, (int32_t)std::min<int64_t>(std::max<int64_t>(i_value, INT32_MIN), INT32_MAX));
+  }
+
+#if !defined(_WIN32)
+  struct ProcessStats
+  {
+    clock::time_point m_time;       // The time the stats were read
+    int64_t m_cpuUS = 0;            // The user and system cpu time in microseconds
+    int64_t m_minorFaults = 0;      // The page faults serviced without I/O
+    int64_t m_majorFaults = 0;      // The page faults that needed I/O
+    int64_t m_voluntarySwitches = 0;   // The context switches from blocking
+    int64_t m_involuntarySwitches = 0; // The context switches from preemption
+  };
+
+  ProcessStats ReadProcessStats()
+  {
+    ProcessStats stats;
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    stats.m_time = clock::now();
+    stats.m_cpuUS = ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    stats.m_minorFaults = usage.ru_minflt;
+    stats.m_majorFaults = usage.ru_majflt;
+    stats.m_voluntarySwitches = usage.ru_nvcsw;
+    stats.m_involuntarySwitches = usage.ru_nivcsw;
+    return stats;
+  }
+
+  int64_t ReadResidentKB()
+  {
+#ifdef __linux__
+    // The resident page count is the second field of /proc/self/statm (getrusage only has the peak)
+    long long pages = -1;
+    FILE* file = std::fopen("/proc/self/statm", "r");
+    if (file != nullptr)
+    {
+      if (std::fscanf(file, "%*s %lld", &pages) != 1)
+      {
+        pages = -1;
+      }
+      std::fclose(file);
+    }
+    return (pages >= 0) ? pages * (int64_t)sysconf(_SC_PAGESIZE) / 1024 : -1;
+#else
+    return -1;
+#endif // __linux__
+  }
+
+  void AddProcessGauges(ProcessStats& io_lastStats)
+  {
+    static const uint32_t s_rssTagID = taren_profiler::RegisterTag("ProcessRssKB", __FILE__, __LINE__, "gauge");
+    static const uint32_t s_cpuTagID = taren_profiler::RegisterTag("ProcessCpuPercent", __FILE__, __LINE__, "gauge");
+    static const uint32_t s_minorFaultsTagID = taren_profiler::RegisterTag("MinorFaults", __FILE__, __LINE__, "gauge");
+    static const uint32_t s_majorFaultsTagID = taren_profiler::RegisterTag("MajorFaults", __FILE__, __LINE__, "gauge");
+    static const uint32_t s_voluntaryTagID = taren_profiler::RegisterTag("VoluntaryContextSwitches", __FILE__, __LINE__, "gauge");
+    static const uint32_t s_involuntaryTagID = taren_profiler::RegisterTag("InvoluntaryContextSwitches", __FILE__, __LINE__, "gauge");
+
+    // The counters are recorded as the change since the last poll, and the cpu use as a percentage of one core
+    ProcessStats stats = ReadProcessStats();
+    int64_t elapsedUS = std::chrono::duration_cast<std::chrono::microseconds>(stats.m_time - io_lastStats.m_time).count();
+    int64_t residentKB = ReadResidentKB();
+    if (residentKB >= 0)
+    {
+      AddGaugeRecord(s_rssTagID, residentKB);
+    }
+    AddGaugeRecord(s_cpuTagID, (elapsedUS > 0) ? (stats.m_cpuUS - io_lastStats.m_cpuUS) * 100 / elapsedUS : 0);
+    AddGaugeRecord(s_minorFaultsTagID, stats.m_minorFaults - io_lastStats.m_minorFaults);
+    AddGaugeRecord(s_majorFaultsTagID, stats.m_majorFaults - io_lastStats.m_majorFaults);
+    AddGaugeRecord(s_voluntaryTagID, stats.m_voluntarySwitches - io_lastStats.m_voluntarySwitches);
+    AddGaugeRecord(s_involuntaryTagID, stats.m_involuntarySwitches - io_lastStats.m_involuntarySwitches);
+    io_lastStats = stats;
+  }
+#endif // !_WIN32
+
+  void StartGauges()
+  {
+    g_gaugeStop = false;
+    g_gaugeThread = std::thread([]()
+    {
+#if !defined(_WIN32)
+      ProcessStats lastStats = ReadProcessStats();
+#endif // !_WIN32
+      t_gaugeThread = true;
+      std::unique_lock<std::mutex> lock(g_gaugeMutex);
+      while (!g_gaugeCondition.wait_for(lock, std::chrono::milliseconds(TAREN_PROFILER_GAUGE_PERIOD_MS), [] { return g_gaugeStop; }))
+      {
+#if !defined(_WIN32)
+        AddProcessGauges(lastStats);
+#endif // !_WIN32
+        for (uint32_t i = 0; i < g_gaugeCount; i++)
+        {
+          // The callback is called without the lock, so a slow callback does not block registration and it can register / 
+          // unregister gauges. The calling flag keeps UnregisterGauge() waiting until the callback returns.
+          Gauge& gauge = g_gauges[i];
+          taren_profiler::GaugeCallback callback = gauge.m_callback;
+          if (callback == nullptr)
+          {
+            continue;
+          }
+          void* userData = gauge.m_userData;
+          uint32_t tagID = gauge.m_tagID;
+          gauge.m_calling = true;
+          lock.unlock();
+          AddGaugeRecord(tagID, callback(userData));
+          lock.lock();
+          gauge.m_calling = false;
+          g_gaugeCallCondition.notify_all();
+        }
+      }
+    });
+    g_gaugeThreadID = g_gaugeThread.get_id();
+  }
+
+  void StopGauges()
+  {
+    {
+      std::lock_guard<std::mutex> lock(g_gaugeMutex);
+      g_gaugeStop = true;
+    }
+    g_gaugeCondition.notify_all();
+    g_gaugeThread.join();
+  }
+#endif // TAREN_PROFILER_GAUGES
+
+  const char* GetTagName(JsonState* io_state, const RecordBuffer& i_buffer, const ProfileRecord& i_entry)
+  {
+    uint32_t index = i_entry.m_tagID & c_tagIndexMask;
+    if ((i_entry.m_tagID & c_copyTagFlag) != 0)
+    {
+      return &i_buffer.m_copyBuffer[index];
+    }
+    if ((i_entry.m_tagID & c_addressTagFlag) != 0)
+    {
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+      if (i_entry.m_type == taren_profiler::TagType::FunctionBegin)
+      {
+        return (io_state != nullptr) ? GetFunctionName(*io_state, index) : GetSymbolName(index);
+      }
+#else
+      (void)io_state;
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+      return (const char*)g_addressTags[index].m_address.load();
+    }
+    return g_tagDescriptors[(index < g_tagDescriptorCount) ? index : c_unknownTagID].m_name;
+  }
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+  std::unordered_map<std::string, uint32_t> g_processTags; // The tag ids registered for worker process tags, by name / file / line / category
+  std::deque<std::string> g_processTagStrings;             // The strings of the tags registered for worker processes
+
+  uint32_t GetProcessTagID(JsonState& io_state, const ProfileRecord& i_entry)
+  {
+    // Copied tags are in the shared copy buffer, and the built in descriptors are the same in each process
+    uint32_t tagID = i_entry.m_tagID;
+    MappedFileHeader* header = g_mappedHeader;
+    if ((tagID & c_copyTagFlag) != 0 ||
+        tagID <= c_outOfDescriptorsTagID ||
+        header == nullptr)
+    {
+      return tagID;
+    }
+
+    uint64_t key = ((uint64_t)i_entry.m_process << 32) | tagID;
+    auto found = io_state.m_processTagIDs.find(key);
+    if (found != io_state.m_processTagIDs.end())
+    {
+      return found->second;
+    }
+
+    // Read the tag from the table of the worker process (address tags only have a name)
+    uint32_t index = tagID & c_tagIndexMask;
+    MappedDescriptor descriptor = {};
+    if ((tagID & c_addressTagFlag) != 0)
+    {
+      descriptor.m_name = (index < header->m_addressTagCount) ? GetMappedAddressNames(*header, i_entry.m_process)[index] : 0;
+    }
+    else if (index < header->m_descriptorCount)
+    {
+      descriptor = GetMappedDescriptors(*header, i_entry.m_process)[index];
+    }
+    const char* name = GetMappedString(*header, descriptor.m_name);
+    const char* file = GetMappedString(*header, descriptor.m_file);
+    const char* category = GetMappedString(*header, descriptor.m_category);
+
+    // Use a matching tag of this process (eg. registered before a fork), otherwise register each unique tag once, 
+    // so the same call site in each process has one aggregate
+    std::string tagKey = std::string(name) + '\n' + file + '\n' + std::to_string(descriptor.m_line) + '\n' + category;
+    auto registered = g_processTags.find(tagKey);
+    uint32_t descriptorCount = std::min<uint32_t>(g_tagDescriptorCount, TAREN_PROFILER_TAG_DESCRIPTOR_COUNT);
+    for (uint32_t i = c_outOfDescriptorsTagID + 1; i < descriptorCount && registered == g_processTags.end(); i++)
+    {
+      const TagDescriptor& local = g_tagDescriptors[i];
+      if (local.m_line == descriptor.m_line &&
+          strcmp(local.m_name, name) == 0 &&
+          strcmp(local.m_file, file) == 0 &&
+          strcmp(local.m_category, category) == 0)
+      {
+        registered = g_processTags.emplace(tagKey, i).first;
+      }
+    }
+    if (registered == g_processTags.end())
+    {
+      g_processTagStrings.emplace_back(name);
+      const char* registeredName = g_processTagStrings.back().c_str();
+      g_processTagStrings.emplace_back(file);
+      const char* registeredFile = g_processTagStrings.back().c_str();
+      g_processTagStrings.emplace_back(category);
+      const char* registeredCategory = g_processTagStrings.back().c_str();
+      registered = g_processTags.emplace(tagKey, taren_profiler::RegisterTag(registeredName, registeredFile, descriptor.m_line, registeredCategory)).first;
+    }
+    io_state.m_processTagIDs[key] = registered->second;
+    return registered->second;
+  }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+  void ResetBuffer(RecordBuffer& io_buffer)
+  {
+    io_buffer.m_generation++;
+    io_buffer.m_recordCount = 0;
+    io_buffer.m_copyBufferSize = 0;
+    io_buffer.m_argCount = 0;
+    io_buffer.m_droppedCount = 0;
+    io_buffer.m_slotCount = 0; // Reset last as this opens the buffer to new records
+  }
+
+  uint32_t CloseBuffer(RecordBuffer& io_buffer)
+  {
+    // Flag that records should no longer be written by setting the slot count to TAREN_PROFILER_TAG_MAX_COUNT
+    // (the slots claimed past the end are the records that were dropped)
+    uint64_t slotCount = io_buffer.m_slotCount.exchange(TAREN_PROFILER_TAG_MAX_COUNT);
+    if (slotCount > TAREN_PROFILER_TAG_MAX_COUNT)
+    {
+      io_buffer.m_droppedCount = slotCount - TAREN_PROFILER_TAG_MAX_COUNT;
+      slotCount = TAREN_PROFILER_TAG_MAX_COUNT;
+    }
+
+    // Wait for all threads to finish writing tags
+    uint32_t recordCount = io_buffer.m_recordCount;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    // A worker process can exit while writing a record, so stop waiting after a second (the writer skips incomplete records)
+    clock::time_point waitStart = clock::now();
+#endif // TAREN_PROFILER_SHARED_MEMORY
+    while (recordCount != slotCount)
+    {
+      std::this_thread::yield();
+      recordCount = io_buffer.m_recordCount;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+      if (clock::now() - waitStart > std::chrono::seconds(1))
+      {
+        return (uint32_t)slotCount;
+      }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+    }
+    return recordCount;
+  }
+
+  uint32_t SwapBuffers(uint32_t& o_retiredIndex)
+  {
+    // Swap recording to the other buffer, then wait for any tags still being written to the retired buffer
+    o_retiredIndex = g_activeBuffer;
+    ResetBuffer(g_buffers[o_retiredIndex ^ 1]);
+    g_activeBuffer = o_retiredIndex ^ 1;
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    if (g_mappedHeader != nullptr)
+    {
+      g_mappedHeader.load()->m_activeBuffer = o_retiredIndex ^ 1;
+    }
+#endif // TAREN_PROFILER_MAPPED_FILE
+    return CloseBuffer(g_buffers[o_retiredIndex]);
+  }
+
+#ifdef TAREN_PROFILER_STREAMING
+  // The stream is a sequence of messages, each a StreamMessageHeader followed by the message data (native byte order). 
+  // Update Tools/ProfileStreamReceiver.cpp if the protocol changes.
+  const uint32_t c_streamVersion = 3;           // The stream protocol version
+  const uint32_t c_streamChunkRecords = 4096;   // The max number of records in a records message
+
+  enum class StreamMessage : uint32_t
+  {
+    Hello = 1,   // StreamHello, sent once on connection
+    Tag,         // StreamTag then the name, file and category chars, sent before the first record that uses the tag
+    CopyStrings, // The copy buffer of the following records messages (copied tag ids are offsets into it)
+    Records,     // An array of StreamRecord
+    Dropped,     // The number of records dropped as the buffer was full (uint64_t), sent before the records of each batch
+  };
+
+  struct StreamMessageHeader
+  {
+    uint32_t m_type; // The StreamMessage type
+    uint32_t m_size; // The size of the message data that follows
+  };
+
+  struct StreamHello
+  {
+    char m_magic[8];            // "TARENST"
+    uint32_t m_version;         // c_streamVersion
+    int32_t m_processID;        // The process id
+    int64_t m_startTime;        // The profile start time in clock ticks
+    int64_t m_clockNum;         // The clock tick period numerator (seconds)
+    int64_t m_clockDen;         // The clock tick period denominator (seconds)
+    int64_t m_monotonicStartNS; // The start time on the system wide monotonic clock
+  };
+
+  struct StreamTag
+  {
+    uint32_t m_tagID;        // The tag id (flagged with c_addressTagFlag for address tags)
+    uint32_t m_line;         // The line of the call site
+    uint32_t m_nameSize;     // The number of name chars
+    uint32_t m_fileSize;     // The number of file chars
+    uint32_t m_categorySize; // The number of category chars
+  };
+
+  struct StreamRecord
+  {
+    int64_t m_time;     // The time of the record in clock ticks
+    uint64_t m_thread;  // The hash of the thread id
+    uint32_t m_tagID;   // The tag id (or copy buffer offset / address tag index if flagged)
+    int32_t m_value;    // The tag value
+    uint8_t m_type;     // The taren_profiler::TagType
+    uint8_t m_flags;    // The record flags (c_overBudgetFlag)
+    uint8_t m_pad[6];   // Padding to keep records 8 byte aligned
+  };
+  static_assert(sizeof(StreamRecord) == 32, "Unexpected stream record size");
+
+  struct StreamState
+  {
+    int m_socket = -1;                    // The connected socket
+    uint32_t m_sentDescriptorCount = 0;   // The number of tag descriptors sent to the receiver
+    std::vector<uint8_t> m_sentAddresses; // If each address tag has been sent to the receiver
+    std::vector<StreamRecord> m_records;  // The records waiting to be sent
+    std::vector<char> m_message;          // The message being sent
+  };
+  StreamState g_streamState; // The stream state (only accessed by the stream thread after BeginStream)
+
+  bool SendStreamMessage(StreamState& io_state, StreamMessage i_type, const void* i_data, size_t i_size)
+  {
+    StreamMessageHeader header = { (uint32_t)i_type, (uint32_t)i_size };
+    io_state.m_message.resize(sizeof(header) + i_size);
+    memcpy(io_state.m_message.data(), &header, sizeof(header));
+    if (i_size > 0)
+    {
+      memcpy(io_state.m_message.data() + sizeof(header), i_data, i_size);
+    }
+
+    // The socket has a send timeout, so a stalled receiver stops the stream instead of blocking End()
+    const char* data = io_state.m_message.data();
+    size_t remaining = io_state.m_message.size();
+    while (remaining > 0)
+    {
+      ssize_t sent = send(io_state.m_socket, data, remaining, MSG_NOSIGNAL);
+      if (sent < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+      data += sent;
+      remaining -= (size_t)sent;
+    }
+    return true;
+  }
+
+  bool SendStreamTag(StreamState& io_state, uint32_t i_tagID, const char* i_name, const char* i_file, uint32_t i_line, const char* i_category)
+  {
+    i_name = (i_name != nullptr) ? i_name : "";
+    i_file = (i_file != nullptr) ? i_file : "";
+    i_category = (i_category != nullptr) ? i_category : "";
+
+    StreamTag tag = { i_tagID, i_line, (uint32_t)strlen(i_name), (uint32_t)strlen(i_file), (uint32_t)strlen(i_category) };
+    std::string data((const char*)&tag, sizeof(tag));
+    data.append(i_name, tag.m_nameSize);
+    data.append(i_file, tag.m_fileSize);
+    data.append(i_category, tag.m_categorySize);
+    return SendStreamMessage(io_state, StreamMessage::Tag, data.data(), data.size());
+  }
+
+  bool SendStreamAddressTag(StreamState& io_state, uint32_t i_addressIndex)
+  {
+    // Strings are sent as is, function addresses are resolved as the receiver cannot read the symbols
+    const AddressTag& addressTag = g_addressTags[i_addressIndex];
+    std::string name;
+    if (addressTag.m_state == c_addressStateString)
+    {
+      name = (const char*)addressTag.m_address.load();
+    }
+    else
+    {
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+      name = ResolveSymbolName((const void*)addressTag.m_address.load());
+#else
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)addressTag.m_address.load());
+      name = buf;
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+    }
+    io_state.m_sentAddresses[i_addressIndex] = 1;
+    return SendStreamTag(io_state, i_addressIndex | c_addressTagFlag, name.c_str(), "", 0, "");
+  }
+
+  bool SendStreamRecords(StreamState& io_state, const RecordBuffer& i_buffer, uint32_t i_recordCount)
+  {
+    // Send the descriptors registered since the last batch (the records can only use tags registered before the swap)
+    uint32_t descriptorCount = std::min<uint32_t>(g_tagDescriptorCount, TAREN_PROFILER_TAG_DESCRIPTOR_COUNT);
+    for (; io_state.m_sentDescriptorCount < descriptorCount; io_state.m_sentDescriptorCount++)
+    {
+      const TagDescriptor& descriptor = g_tagDescriptors[io_state.m_sentDescriptorCount];
+      if (!SendStreamTag(io_state, io_state.m_sentDescriptorCount, descriptor.m_name, descriptor.m_file, descriptor.m_line, descriptor.m_category))
+      {
+        return false;
+      }
+    }
+
+    uint64_t droppedCount = i_buffer.m_droppedCount;
+    if (!SendStreamMessage(io_state, StreamMessage::Dropped, &droppedCount, sizeof(droppedCount)))
+    {
+      return false;
+    }
+
+    uint32_t copyBufferSize = std::min<uint32_t>(i_buffer.m_copyBufferSize, TAREN_PROFILER_TAG_NAME_BUFFER_SIZE);
+    if (!SendStreamMessage(io_state, StreamMessage::CopyStrings, i_buffer.m_copyBuffer, copyBufferSize))
+    {
+      return false;
+    }
+
+    io_state.m_records.clear();
+    for (uint32_t i = 0; i < i_recordCount; i++)
+    {
+      const ProfileRecord& entry = i_buffer.m_records[i];
+      if ((entry.m_tagID & c_copyTagFlag) == 0 &&
+          (entry.m_tagID & c_addressTagFlag) != 0 &&
+          io_state.m_sentAddresses[entry.m_tagID & c_tagIndexMask] == 0 &&
+          !SendStreamAddressTag(io_state, entry.m_tagID & c_tagIndexMask))
+      {
+        return false;
+      }
+
+      StreamRecord record = {};
+      record.m_time = entry.m_time.time_since_epoch().count();
+      record.m_thread = (uint64_t)std::hash<std::thread::id>()(entry.m_threadID);
+      record.m_tagID = entry.m_tagID;
+      record.m_value = (entry.m_argCount > 0) ? 0 : entry.m_value; // The args are not streamed
+      record.m_type = (uint8_t)entry.m_type;
+      record.m_flags = entry.m_flags;
+      io_state.m_records.push_back(record);
+      if (io_state.m_records.size() == c_streamChunkRecords || i + 1 == i_recordCount)
+      {
+        if (!SendStreamMessage(io_state, StreamMessage::Records, io_state.m_records.data(), io_state.m_records.size() * sizeof(StreamRecord)))
+        {
+          return false;
+        }
+        io_state.m_records.clear();
+      }
+    }
+    return true;
+  }
+
+  bool StreamBuffer(StreamState& io_state)
+  {
+    uint32_t retiredIndex = 0;
+    uint32_t recordCount = 0;
+    {
+      std::lock_guard<std::mutex> lock(g_controlMutex);
+      if (!g_enabled)
+      {
+        return false;
+      }
+
+      // Wait for a snapshot started before streaming to finish writing before the buffer is reused
+      if (g_writeThread.joinable())
+      {
+        g_writeThread.join();
+      }
+      recordCount = SwapBuffers(retiredIndex);
+    }
+
+    // The retired buffer is not reset until the next swap, which is on this thread
+    return SendStreamRecords(io_state, g_buffers[retiredIndex], recordCount);
+  }
+#endif // TAREN_PROFILER_STREAMING
+
+#ifdef TAREN_PROFILER_CONTROL
+  void ControlSignalHandler(int i_signal)
+  {
+    g_controlRequests.fetch_or((i_signal == SIGUSR1) ? ControlStart : ControlStop);
+  }
+
+  /// \brief Read and remove the control file if it exists
+  /// \param i_controlFile The control file path (empty for none)
+  /// \param io_durationMS The capture duration, updated if the file has one
+  /// \param io_fileName The capture file name, updated if the file has one
+  /// \return Returns the ControlRequest flags of the file
+  uint32_t ReadControlFile(const std::string& i_controlFile, uint32_t& io_durationMS, std::string& io_fileName)
+  {
+    if (i_controlFile.empty())
+    {
+      return 0;
+    }
+    FILE* file = fopen(i_controlFile.c_str(), "r");
+    if (file == nullptr)
+    {
+      return 0;
+    }
+    char line[1024] = {};
+    if (fgets(line, sizeof(line), file) == nullptr)
+    {
+      line[0] = '\0';
+    }
+    fclose(file);
+    unlink(i_controlFile.c_str());
+
+    // The file is "stop", or empty / "durationMS [fileName]" to start a capture
+    if (strncmp(line, "stop", 4) == 0)
+    {
+      return ControlStop;
+    }
+    unsigned int durationMS = 0;
+    char fileName[1000] = {};
+    int count = sscanf(line, "%u %999s", &durationMS, fileName);
+    if (count >= 1 && durationMS > 0)
+    {
+      io_durationMS = durationMS;
+    }
+    if (count >= 2)
+    {
+      io_fileName = fileName;
+    }
+    return ControlStart;
+  }
+
+  void RunController(const std::string& i_fileName, uint32_t i_durationMS, const std::string& i_controlFile)
+  {
+    bool capturing = false;        // If the controller started the current capture
+    std::string captureFileName;   // The file name of the current capture
+    clock::time_point captureEnd;  // When the current capture is written
+
+    std::unique_lock<std::mutex> lock(g_controllerMutex);
+    for (;;)
+    {
+      bool stop = g_controllerCondition.wait_for(lock, std::chrono::milliseconds(c_controlPollMS), [] { return g_controllerStop; });
+      lock.unlock();
+
+      uint32_t durationMS = i_durationMS;
+      std::string fileName = i_fileName;
+      uint32_t requests = g_controlRequests.exchange(0) | ReadControlFile(i_controlFile, durationMS, fileName);
+
+      // The application may have ended the capture itself
+      capturing = capturing && g_enabled;
+      if (capturing && (stop || (requests & ControlStop) != 0 || clock::now() >= captureEnd))
+      {
+        taren_profiler::EndFileJson(captureFileName.c_str());
+        capturing = false;
+      }
+      else if (!capturing && !stop && (requests & ControlStart) != 0 && taren_profiler::Begin())
+      {
+        capturing = true;
+        captureFileName = fileName;
+        captureEnd = clock::now() + std::chrono::milliseconds(durationMS);
+      }
+
+      if (stop)
+      {
+        return;
+      }
+      lock.lock();
+    }
+  }
+#endif // TAREN_PROFILER_CONTROL
+
+  bool OpenJsonFile(std::ofstream& o_file, const char* i_fileName, bool i_appendDateExtension, bool i_appendMilliseconds)
+  {
+    if (i_appendDateExtension)
+    {
+      // Create a filename with the current date in it with extension
+      auto now = std::chrono::system_clock::now();
+      std::time_t t = std::chrono::system_clock::to_time_t(now);
+      tm timeBuf;
+#ifdef _WIN32
+      localtime_s(&timeBuf, &t);
+#else
+      localtime_r(&t, &timeBuf);
+#endif
+      char extStr[120];
+      size_t extLen = std::strftime(extStr, sizeof(extStr), "_%Y%m%d-%H%M%S", &timeBuf);
+      if (extLen == 0)
+      {
+        return false;
+      }
+
+      // Snapshots can be less than a second apart, so add milliseconds to keep the names unique
+      if (i_appendMilliseconds)
+      {
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+        std::snprintf(extStr + extLen, sizeof(extStr) - extLen, "-%03lld", ms);
+      }
+
+      o_file.open(std::string(i_fileName) + extStr + ".json");
+    }
+    else
+    {
+      o_file.open(i_fileName);
+    }
+
+    return o_file.is_open();
+  }
+
+  void CleanJsonStr(std::string& io_str)
+  {
+    size_t startPos = 0;
+    while ((startPos = io_str.find_first_of("\\\"", startPos)) != std::string::npos)
+    {
+      io_str.insert(startPos, 1, '\\');
+      startPos += 2;
+    }
+  }
+
+  void WriteJsonArgs(std::ostream& o_outStream, const RecordBuffer& i_buffer, const ProfileRecord& i_entry, std::string& io_cleanStr)
+  {
+    for (uint32_t i = 0; i < i_entry.m_argCount; i++)
+    {
+      const taren_profiler::TagArg& arg = i_buffer.m_args[(uint32_t)i_entry.m_value + i];
+      io_cleanStr = arg.m_key;
+      CleanJsonStr(io_cleanStr);
+      o_outStream << ((i == 0) ? "\"" : ",\"") << io_cleanStr << "\":";
+
+      if (arg.m_type == taren_profiler::TagArg::Type::Int)
+      {
+        o_outStream << arg.m_int;
+      }
+      else if (arg.m_type == taren_profiler::TagArg::Type::Double)
+      {
+        // Json has no infinity / NaN
+        char buf[32] = "null";
+        if (std::isfinite(arg.m_double))
+        {
+          std::snprintf(buf, sizeof(buf), "%.17g", arg.m_double);
+        }
+        o_outStream << buf;
+      }
+      else
+      {
+        io_cleanStr = (arg.m_string != nullptr) ? arg.m_string : "";
+        CleanJsonStr(io_cleanStr);
+        o_outStream << "\"" << io_cleanStr << "\"";
+      }
+    }
+  }
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+  void WriteJsonCpuTime(std::ostream& o_outStream, clock::duration i_wallTime, uint64_t i_cpuTimeNS)
+  {
+    // The thread cpu clock has a coarser resolution on some systems, so the cpu time can slightly exceed the wall time
+    uint64_t wallNS = (uint64_t)std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(i_wallTime).count(), 0);
+    uint64_t cpuNS = std::min(i_cpuTimeNS, wallNS);
+    char ratio[16] = "0";
+    if (wallNS > 0)
+    {
+      std::snprintf(ratio, sizeof(ratio), "%.3f", (double)cpuNS / (double)wallNS);
+    }
+    o_outStream << "\"cpu_us\":" << (cpuNS / 1000) << ",\"off_cpu_us\":" << ((wallNS - cpuNS) / 1000) << ",\"cpu_ratio\":" << ratio;
+  }
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+  void WriteJsonEvent(std::ostream& o_outStream, const ProfileRecord& i_entry, const ProfileRecord* i_begin, const RecordBuffer* i_argBuffer, const char* i_tag, int32_t i_threadIndex, bool& io_firstEvent, std::string& io_cleanTag)
+  {
+    // Get the category of registered tags
+    const char* category = "";
+    uint32_t tagID = (i_begin != nullptr) ? i_begin->m_tagID : i_entry.m_tagID;
+    if ((tagID & (c_copyTagFlag | c_addressTagFlag)) == 0 && 
+        tagID < g_tagDescriptorCount)
+    {
+      category = g_tagDescriptors[tagID].m_category;
+    }
+
+    const char* typeTag = "B";
+    if (i_entry.m_type == taren_profiler::TagType::End)
+    {
+      typeTag = "E";
+    }
+    else if (i_entry.m_type == taren_profiler::TagType::Value)
+    {
+      typeTag = "O";
+    }
+    else if (i_entry.m_type == taren_profiler::TagType::Gauge)
+    {
+      typeTag = "C";
+    }
+
+    // Markup invalid json characters
+    if (strchr(i_tag, '"') != nullptr ||
+        strchr(i_tag, '\\') != nullptr)
+    {
+      io_cleanTag = i_tag;
+      CleanJsonStr(io_cleanTag);
+      i_tag = io_cleanTag.c_str();
+    }
+
+    // Get the microsecond count
+    long long msCount = std::chrono::duration_cast<std::chrono::microseconds>(i_entry.m_time - g_startTime).count();
+
+    if (!io_firstEvent)
+    {
+      o_outStream << ",\n";
+    }
+    io_firstEvent = false;
+
+    // Format the string (Note using process ID for threads as that gives a better formatting in the output tool for value tags)
+    o_outStream <<
+      "{\"name\":\"" << i_tag << "\",\"ph\":\"" << typeTag << "\",\"ts\":" << msCount << ",\"pid\":" << i_threadIndex << ",\"cat\":\"" << category << "\",\"tid\":0,";
+
+    if (i_entry.m_type == taren_profiler::TagType::Value)
+    {
+      o_outStream << "\"id\":\"" << i_tag << "\", \"args\":{\"snapshot\":{\"Value\": " << i_entry.m_value << "}}}";
+    }
+    else if (i_entry.m_type == taren_profiler::TagType::Gauge)
+    {
+      o_outStream << "\"args\":{\"value\":" << i_entry.m_value << "}}";
+    }
+    else
+    {
+      o_outStream << "\"args\":{";
+      if (i_argBuffer != nullptr)
+      {
+        WriteJsonArgs(o_outStream, *i_argBuffer, i_entry, io_cleanTag); // (The tag name is already written, so the clean string can be reused)
+      }
+
+      const char* separator = (i_argBuffer != nullptr && i_entry.m_argCount > 0) ? "," : "";
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+      // Tag the begin events of a request, so one request can be filtered
+      if (i_entry.m_type != taren_profiler::TagType::End && i_entry.m_requestID != 0)
+      {
+        o_outStream << separator << "\"request_id\":" << i_entry.m_requestID;
+        separator = ",";
+      }
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+
+      // Mark the end of a budget scope that was over budget (the end value is the budget)
+      if (i_begin != nullptr && (i_entry.m_flags & c_overBudgetFlag) != 0)
+      {
+        o_outStream << "\"over_budget\":true,\"budget_us\":" << i_entry.m_value;
+        separator = ",";
+      }
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+      // Add the counter deltas to the end of a tag (merged with the begin args by the viewer)
+      if (i_begin != nullptr)
+      {
+        const PerfCounterConfig* configs = GetPerfCounterConfig();
+        for (uint32_t i = 0; i < c_perfCounterCount; i++)
+        {
+          o_outStream << separator << "\"" << configs[i].m_name << "\":" << (i_entry.m_counters[i] - i_begin->m_counters[i]);
+          separator = ",";
+        }
+      }
+#endif // TAREN_PROFILER_PERF_COUNTERS
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+      if (i_begin != nullptr)
+      {
+        o_outStream << separator;
+        WriteJsonCpuTime(o_outStream, i_entry.m_time - i_begin->m_time, i_entry.m_cpuTimeNS - i_begin->m_cpuTimeNS);
+      }
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+      (void)separator;
+      o_outStream << "}}";
+    }
+  }
+
+  TagAggregate& GetAggregate(JsonState& io_state, const JsonState::OpenTag& i_openTag)
+  {
+    // Registered and address tags index directly into arrays, only copied tags need a lookup by name
+    uint32_t tagID = i_openTag.m_begin.m_tagID;
+    uint32_t index = tagID & c_tagIndexMask;
+    if ((tagID & c_copyTagFlag) != 0)
+    {
+      return io_state.m_copyAggregates[i_openTag.m_name];
+    }
+
+    std::vector<TagAggregate>& aggregates = ((tagID & c_addressTagFlag) != 0) ? io_state.m_addressAggregates : io_state.m_tagAggregates;
+    if (aggregates.size() <= index)
+    {
+      aggregates.resize(index + 1);
+    }
+    aggregates[index].m_name = i_openTag.m_name;
+    return aggregates[index];
+  }
+
+  void AddAggregate(JsonState& io_state, const JsonState::OpenTag& i_openTag, const ProfileRecord& i_end)
+  {
+    const ProfileRecord& i_begin = i_openTag.m_begin;
+    TagAggregate& aggregate = GetAggregate(io_state, i_openTag);
+    clock::duration time = i_end.m_time - i_begin.m_time;
+
+    aggregate.m_count++;
+    aggregate.m_totalTime += time;
+    aggregate.m_selfTime += time - i_openTag.m_childTime;
+    aggregate.m_maxTime = std::max(aggregate.m_maxTime, time);
+    aggregate.m_overBudget += ((i_end.m_flags & c_overBudgetFlag) != 0) ? 1 : 0;
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+    aggregate.m_migrations += i_openTag.m_migrations;
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+    aggregate.m_cpuTimeNS += std::min<uint64_t>(i_end.m_cpuTimeNS - i_begin.m_cpuTimeNS, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+    for (uint32_t i = 0; i < c_perfCounterCount; i++)
+    {
+      aggregate.m_counters[i] += i_end.m_counters[i] - i_begin.m_counters[i];
+    }
+#endif // TAREN_PROFILER_PERF_COUNTERS
+  }
+
+  bool IsTaskType(taren_profiler::TagType i_type)
+  {
+    return i_type >= taren_profiler::TagType::TaskBegin && i_type <= taren_profiler::TagType::TaskResume;
+  }
+
+  void WriteJsonTaskEvent(std::ostream& o_outStream, JsonState& io_state, const char* i_name, const char* i_phase, clock::time_point i_time, 
+                          uint32_t i_taskID, const JsonState::OpenTask& i_task, bool& io_firstEvent, std::string& io_cleanTag)
+  {
+    // Tasks are written as nestable async events, matched by id and category on a track of their own
+    if (io_state.m_taskIndex < 0)
+    {
+      io_state.m_taskIndex = io_state.m_threadCounter;
+      io_state.m_threadCounter++;
+    }
+
+    const TagDescriptor& descriptor = g_tagDescriptors[i_task.m_tagID];
+    const char* category = (descriptor.m_category[0] != 0) ? descriptor.m_category : "task";
+    io_cleanTag = i_name;
+    CleanJsonStr(io_cleanTag);
+
+    long long msCount = std::chrono::duration_cast<std::chrono::microseconds>(i_time - g_startTime).count();
+    if (!io_firstEvent)
+    {
+      o_outStream << ",\n";
+    }
+    io_firstEvent = false;
+
+    char idString[16];
+    std::snprintf(idString, sizeof(idString), "0x%x", i_taskID);
+    o_outStream <<
+      "{\"name\":\"" << io_cleanTag << "\",\"ph\":\"" << i_phase << "\",\"ts\":" << msCount << ",\"pid\":" << io_state.m_taskIndex << 
+      ",\"cat\":\"" << category << "\",\"tid\":0,\"id\":\"" << idString << "\",";
+  }
+
+  void WriteJsonTask(JsonState& io_state, const ProfileRecord& i_entry, int32_t i_threadIndex, bool& io_firstEvent, std::ostream& o_outStream, std::string& io_cleanTag)
+  {
+    const char* c_suspendedName = "Suspended";
+    uint32_t taskID = (uint32_t)i_entry.m_value;
+    auto taskIter = io_state.m_openTasks.find(taskID);
+
+    if (i_entry.m_type == taren_profiler::TagType::TaskBegin)
+    {
+      if (taskIter != io_state.m_openTasks.end() ||
+          i_entry.m_tagID >= g_tagDescriptorCount)
+      {
+        return; // The id is already in use, or a tag that is not registered
+      }
+
+      JsonState::OpenTask& task = io_state.m_openTasks[taskID];
+      task.m_tagID = i_entry.m_tagID;
+      task.m_begin = i_entry.m_time;
+      WriteJsonTaskEvent(o_outStream, io_state, g_tagDescriptors[task.m_tagID].m_name, "b", i_entry.m_time, taskID, task, io_firstEvent, io_cleanTag);
+      o_outStream << "\"args\":{\"thread\":" << i_threadIndex << "}}";
+      return;
+    }
+
+    // Ignore tasks that began before the capture
+    if (taskIter == io_state.m_openTasks.end())
+    {
+      return;
+    }
+    JsonState::OpenTask& task = taskIter->second;
+    bool suspended = (task.m_suspend != clock::time_point());
+
+    // Close the suspended slice on resume or end
+    if (suspended &&
+        i_entry.m_type != taren_profiler::TagType::TaskSuspend)
+    {
+      task.m_suspendedTime += i_entry.m_time - task.m_suspend;
+      task.m_suspend = clock::time_point();
+      WriteJsonTaskEvent(o_outStream, io_state, c_suspendedName, "e", i_entry.m_time, taskID, task, io_firstEvent, io_cleanTag);
+      o_outStream << "\"args\":{\"resume_thread\":" << i_threadIndex << "}}";
+    }
+
+    if (i_entry.m_type == taren_profiler::TagType::TaskSuspend && 
+        !suspended)
+    {
+      task.m_suspend = i_entry.m_time;
+      WriteJsonTaskEvent(o_outStream, io_state, c_suspendedName, "b", i_entry.m_time, taskID, task, io_firstEvent, io_cleanTag);
+      o_outStream << "\"args\":{\"thread\":" << i_threadIndex << "}}";
+    }
+    else if (i_entry.m_type == taren_profiler::TagType::TaskEnd)
+    {
+      clock::duration taskTime = i_entry.m_time - task.m_begin;
+      JsonState::TaskAggregate& aggregate = io_state.m_taskAggregates[task.m_tagID];
+      aggregate.m_count++;
+      aggregate.m_totalTime += taskTime;
+      aggregate.m_suspendedTime += task.m_suspendedTime;
+      aggregate.m_maxTime = std::max(aggregate.m_maxTime, taskTime);
+
+      WriteJsonTaskEvent(o_outStream, io_state, g_tagDescriptors[task.m_tagID].m_name, "e", i_entry.m_time, taskID, task, io_firstEvent, io_cleanTag);
+      o_outStream << "\"args\":{\"end_thread\":" << i_threadIndex << 
+        ",\"suspended_us\":" << std::chrono::duration_cast<std::chrono::microseconds>(task.m_suspendedTime).count() << "}}";
+      io_state.m_openTasks.erase(taskIter);
+    }
+  }
+
+  void WriteJsonTasks(JsonState& io_state, std::ostream& o_outStream)
+  {
+    if (io_state.m_taskIndex < 0)
+    {
+      return;
+    }
+
+    // Sort by the total time so the longest running tasks are first
+    std::vector<std::pair<uint32_t, JsonState::TaskAggregate>> sorted(io_state.m_taskAggregates.begin(), io_state.m_taskAggregates.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.m_totalTime > b.second.m_totalTime; });
+
+    o_outStream << ",\n\"tasks\":[";
+    std::string cleanTag;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      const JsonState::TaskAggregate& aggregate = sorted[i].second;
+      cleanTag = g_tagDescriptors[sorted[i].first].m_name;
+      CleanJsonStr(cleanTag);
+
+      using us = std::chrono::microseconds;
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"name\":\"" << cleanTag << "\",\"count\":" << aggregate.m_count <<
+        ",\"total_us\":" << std::chrono::duration_cast<us>(aggregate.m_totalTime).count() <<
+        ",\"suspended_us\":" << std::chrono::duration_cast<us>(aggregate.m_suspendedTime).count() <<
+        ",\"max_us\":" << std::chrono::duration_cast<us>(aggregate.m_maxTime).count() << "}";
+    }
+    o_outStream << "\n]";
+    io_state.m_taskAggregates.clear();
+  }
+
+#ifdef TAREN_PROFILER_SAMPLING
+  struct SampleTree
+  {
+    struct Frame
+    {
+      uint32_t m_name;  // The function name index
+      int32_t m_parent; // The parent frame index (-1 for a root frame)
+    };
+
+    std::vector<std::string> m_names;                        // The function names
+    std::unordered_map<std::string, uint32_t> m_nameIndices; // The function name indices by name
+    std::unordered_map<const void*, uint32_t> m_addressNames; // The function name indices by address
+    std::vector<Frame> m_frames;                             // The unique call stack frames
+    std::unordered_map<uint64_t, uint32_t> m_frameIndices;   // The frame indices by parent and name
+    std::vector<uint64_t> m_selfCounts;                      // The samples with each function as the leaf
+    std::vector<uint64_t> m_totalCounts;                     // The samples with each function anywhere in the stack
+  };
+
+  uint32_t GetSampleName(SampleTree& io_tree, const void* i_address)
+  {
+    auto addressIter = io_tree.m_addressNames.find(i_address);
+    if (addressIter != io_tree.m_addressNames.end())
+    {
+      return addressIter->second;
+    }
+
+    std::string name = ResolveSymbolName(i_address);
+    auto nameIter = io_tree.m_nameIndices.find(name);
+    uint32_t nameIndex = (uint32_t)io_tree.m_names.size();
+    if (nameIter != io_tree.m_nameIndices.end())
+    {
+      nameIndex = nameIter->second;
+    }
+    else
+    {
+      io_tree.m_nameIndices[name] = nameIndex;
+      io_tree.m_names.push_back(name);
+      io_tree.m_selfCounts.push_back(0);
+      io_tree.m_totalCounts.push_back(0);
+    }
+    io_tree.m_addressNames[i_address] = nameIndex;
+    return nameIndex;
+  }
+
+  void WriteJsonSamples(JsonState& io_state, SampleTree& io_tree, bool& io_firstEvent, std::string& io_cleanTag, std::ostream& o_outStream)
+  {
+    uint32_t sampleCount = g_sampleWriteCount;
+    std::vector<uint32_t> sampleNames;
+    for (uint32_t i = 0; i < sampleCount; i++)
+    {
+      const StackSample& sample = g_samples[i];
+      if (sample.m_frameCount == 0)
+      {
+        continue;
+      }
+
+      // Resolve the names (return addresses are the instruction after the call, so look up the call instruction)
+      sampleNames.clear();
+      for (uint32_t f = 0; f < sample.m_frameCount; f++)
+      {
+        const char* address = (const char*)sample.m_frames[f];
+        sampleNames.push_back(GetSampleName(io_tree, (f == 0) ? address : address - 1));
+      }
+
+      // Add the stack from the root frame, counting recursive functions once
+      int32_t frameIndex = -1;
+      for (uint32_t f = sample.m_frameCount; f-- > 0;)
+      {
+        uint32_t nameIndex = sampleNames[f];
+        uint64_t frameKey = ((uint64_t)(uint32_t)(frameIndex + 1) << 32) | nameIndex;
+        auto frameIter = io_tree.m_frameIndices.find(frameKey);
+        if (frameIter == io_tree.m_frameIndices.end())
+        {
+          frameIter = io_tree.m_frameIndices.emplace(frameKey, (uint32_t)io_tree.m_frames.size()).first;
+          io_tree.m_frames.push_back(SampleTree::Frame{ nameIndex, frameIndex });
+        }
+        frameIndex = (int32_t)frameIter->second;
+
+        if (std::find(sampleNames.begin() + f + 1, sampleNames.end(), nameIndex) == sampleNames.end())
+        {
+          io_tree.m_totalCounts[nameIndex]++;
+        }
+      }
+      io_tree.m_selfCounts[sampleNames[0]]++;
+
+      JsonState::Tags& stack = io_state.m_threadStack[JsonState::ThreadKey{ sample.m_threadID, 0 }];
+      if (stack.m_index < 0)
+      {
+        stack.m_index = io_state.m_threadCounter;
+        io_state.m_threadCounter++;
+      }
+
+      io_cleanTag = io_tree.m_names[sampleNames[0]];
+      CleanJsonStr(io_cleanTag);
+      long long msCount = std::chrono::duration_cast<std::chrono::microseconds>(sample.m_time - g_startTime).count();
+      o_outStream << (io_firstEvent ? "" : ",\n") <<
+        "{\"name\":\"" << io_cleanTag << "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << msCount << ",\"pid\":" << stack.m_index << 
+        ",\"cat\":\"sample\",\"tid\":0,\"sf\":" << frameIndex << "}";
+      io_firstEvent = false;
+    }
+  }
+
+  void WriteJsonStackFrames(const SampleTree& i_tree, std::ostream& o_outStream)
+  {
+    std::string cleanName;
+    o_outStream << ",\n\"stackFrames\":{";
+    for (size_t i = 0; i < i_tree.m_frames.size(); i++)
+    {
+      const SampleTree::Frame& frame = i_tree.m_frames[i];
+      cleanName = i_tree.m_names[frame.m_name];
+      CleanJsonStr(cleanName);
+      o_outStream << (i == 0 ? "\n" : ",\n") << "\"" << i << "\":{\"name\":\"" << cleanName << "\"";
+      if (frame.m_parent >= 0)
+      {
+        o_outStream << ",\"parent\":\"" << frame.m_parent << "\"";
+      }
+      o_outStream << "}";
+    }
+    o_outStream << "\n}";
+
+    // Sort by the self samples so the hottest functions are first
+    std::vector<uint32_t> sorted;
+    for (uint32_t i = 0; i < (uint32_t)i_tree.m_names.size(); i++)
+    {
+      sorted.push_back(i);
+    }
+    std::sort(sorted.begin(), sorted.end(), [&i_tree](uint32_t a, uint32_t b) { return i_tree.m_selfCounts[a] > i_tree.m_selfCounts[b]; });
+
+    o_outStream << ",\n\"sample_functions\":[";
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      cleanName = i_tree.m_names[sorted[i]];
+      CleanJsonStr(cleanName);
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"name\":\"" << cleanName << "\",\"self\":" << i_tree.m_selfCounts[sorted[i]] << ",\"total\":" << i_tree.m_totalCounts[sorted[i]] << "}";
+    }
+    o_outStream << "\n]";
+  }
+#endif // TAREN_PROFILER_SAMPLING
+
+  void WriteJsonAggregates(JsonState& io_state, std::ostream& o_outStream)
+  {
+    struct SortedAggregate
+    {
+      const char* m_name;               // The tag name
+      const TagDescriptor* m_descriptor; // The descriptor if a registered tag
+      const TagAggregate* m_aggregate;   // The aggregate data
+    };
+
+    // Sort by the total time so the most expensive tags are first
+    std::vector<SortedAggregate> sorted;
+    for (size_t i = 0; i < io_state.m_tagAggregates.size(); i++)
+    {
+      if (io_state.m_tagAggregates[i].m_count > 0)
+      {
+        sorted.push_back(SortedAggregate{ g_tagDescriptors[i].m_name, &g_tagDescriptors[i], &io_state.m_tagAggregates[i] });
+      }
+    }
+    for (const TagAggregate& a : io_state.m_addressAggregates)
+    {
+      if (a.m_count > 0)
+      {
+        sorted.push_back(SortedAggregate{ a.m_name, nullptr, &a });
+      }
+    }
+    for (auto& a : io_state.m_copyAggregates)
+    {
+      sorted.push_back(SortedAggregate{ a.first.c_str(), nullptr, &a.second });
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const SortedAggregate& a, const SortedAggregate& b) { return a.m_aggregate->m_totalTime > b.m_aggregate->m_totalTime; });
+
+    o_outStream << ",\n\"aggregates\":[";
+    std::string cleanTag;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      const TagAggregate& aggregate = *sorted[i].m_aggregate;
+      cleanTag = sorted[i].m_name;
+      CleanJsonStr(cleanTag);
+
+      using us = std::chrono::microseconds;
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"name\":\"" << cleanTag << "\",\"count\":" << aggregate.m_count <<
+        ",\"total_us\":" << std::chrono::duration_cast<us>(aggregate.m_totalTime).count() <<
+        ",\"self_us\":" << std::chrono::duration_cast<us>(aggregate.m_selfTime).count() <<
+        ",\"max_us\":" << std::chrono::duration_cast<us>(aggregate.m_maxTime).count();
+      if (aggregate.m_overBudget > 0)
+      {
+        o_outStream << ",\"over_budget\":" << aggregate.m_overBudget;
+      }
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+      const PerfCounterConfig* configs = GetPerfCounterConfig();
+      for (uint32_t c = 0; c < c_perfCounterCount; c++)
+      {
+        o_outStream << ",\"" << configs[c].m_name << "\":" << aggregate.m_counters[c];
+      }
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+      o_outStream << ",\"migrations\":" << aggregate.m_migrations;
+#endif // TAREN_PROFILER_RECORD_CPU
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+      o_outStream << ",";
+      WriteJsonCpuTime(o_outStream, aggregate.m_totalTime, aggregate.m_cpuTimeNS);
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+      // Add the call site of registered tags
+      const TagDescriptor* descriptor = sorted[i].m_descriptor;
+      if (descriptor != nullptr && descriptor->m_line != 0)
+      {
+        cleanTag = descriptor->m_file;
+        CleanJsonStr(cleanTag);
+        o_outStream << ",\"file\":\"" << cleanTag << "\",\"line\":" << descriptor->m_line;
+      }
+      o_outStream << "}";
+    }
+    o_outStream << "\n]";
+
+    io_state.m_tagAggregates.clear();
+    io_state.m_addressAggregates.clear();
+    io_state.m_copyAggregates.clear();
+  }
+
+  struct QueryThread
+  {
+    std::thread::id m_threadID;  // The thread id (default id if unused)
+    uint32_t m_depth = 0;        // The number of open tags (can be larger than the stack size)
+
+    struct OpenTag
+    {
+      const ProfileRecord* m_begin; // The begin record
+      const RecordBuffer* m_buffer; // The buffer containing the begin record
+    };
+    OpenTag m_stack[TAREN_PROFILER_QUERY_STACK_DEPTH]; // The open tags
+  };
+  QueryThread g_queryThreads[TAREN_PROFILER_QUERY_THREAD_COUNT]; // The thread stacks used by QueryStats() (protected by g_controlMutex)
+
+  uint32_t GetStatsBucket(uint64_t i_timeNS)
+  {
+    if (i_timeNS < 4)
+    {
+      return (uint32_t)i_timeNS;
+    }
+
+    // 4 linear sub buckets per power of 2
+    uint32_t exponent = 0;
+    while ((i_timeNS >> (exponent + 1)) != 0)
+    {
+      exponent++;
+    }
+    uint32_t bucket = (exponent - 1) * 4 + (uint32_t)((i_timeNS >> (exponent - 2)) & 3);
+    return (bucket < taren_profiler::c_statsBucketCount) ? bucket : taren_profiler::c_statsBucketCount - 1;
+  }
+
+  uint64_t GetStatsBucketMax(uint32_t i_bucket)
+  {
+    if (i_bucket < 4)
+    {
+      return i_bucket;
+    }
+    uint32_t exponent = i_bucket / 4 + 1;
+    return ((uint64_t)(4 + (i_bucket & 3) + 1) << (exponent - 2)) - 1;
+  }
+
+  uint64_t GetStatsPercentile(const taren_profiler::TagStats& i_stats, double i_percentile)
+  {
+    uint64_t target = (uint64_t)(i_stats.m_count * i_percentile);
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < taren_profiler::c_statsBucketCount; i++)
+    {
+      count += i_stats.m_histogram[i];
+      if (count > target)
+      {
+        return std::min(GetStatsBucketMax(i), i_stats.m_maxNS);
+      }
+    }
+    return i_stats.m_maxNS;
+  }
+
+  taren_profiler::TagStats* GetStats(taren_profiler::TagStats* io_stats, uint32_t i_maxStats, const RecordBuffer& i_buffer, const ProfileRecord& i_begin)
+  {
+    // Registered and address tags use the id as the key, copied tags use the name hash
+    const char* name = nullptr;
+    uint64_t key = (uint64_t)i_begin.m_tagID + 1;
+    if ((i_begin.m_tagID & c_copyTagFlag) != 0)
+    {
+      name = GetTagName(nullptr, i_buffer, i_begin);
+      key = 2166136261u; // FNV-1a
+      for (const char* c = name; *c != 0; c++)
+      {
+        key = ((key ^ (uint8_t)*c) * 16777619u) & 0xFFFFFFFF;
+      }
+      key |= (uint64_t)1 << 32;
+    }
+
+    // Use the caller's array as an open addressing hash table
+    uint32_t startIndex = (uint32_t)((key * 2654435761u) % i_maxStats);
+    for (uint32_t i = 0; i < i_maxStats; i++)
+    {
+      taren_profiler::TagStats& stats = io_stats[(startIndex + i) % i_maxStats];
+      if (stats.m_key == 0)
+      {
+        stats.m_key = key;
+        stats.m_name = (name != nullptr) ? name : GetTagName(nullptr, i_buffer, i_begin);
+        return &stats;
+      }
+      if (stats.m_key == key &&
+          (name == nullptr || strcmp(stats.m_name, name) == 0))
+      {
+        return &stats;
+      }
+    }
+    return nullptr; // Array is full
+  }
+
+  void AddStats(taren_profiler::TagStats* io_stats, uint32_t i_maxStats, const RecordBuffer& i_buffer, uint32_t i_recordCount, bool i_checkComplete, clock::time_point i_windowStart)
+  {
+    uint32_t generation = i_buffer.m_generation;
+    for (uint32_t i = 0; i < i_recordCount; i++)
+    {
+      // Stop at the first record that is still being written
+      const ProfileRecord& entry = i_buffer.m_records[i];
+      if (i_checkComplete &&
+          entry.m_generation.m_value.load(std::memory_order_acquire) != generation)
+      {
+        break;
+      }
+      if (entry.m_type == taren_profiler::TagType::Value ||
+          entry.m_type == taren_profiler::TagType::Gauge ||
+          IsTaskType(entry.m_type))
+      {
+        continue;
+      }
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+      if (entry.m_process != g_processIndex)
+      {
+        continue; // Tag ids of other processes are only translated when the json is written
+      }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+      // Find the thread stack
+      QueryThread* thread = nullptr;
+      uint32_t startIndex = (uint32_t)(std::hash<std::thread::id>()(entry.m_threadID) % TAREN_PROFILER_QUERY_THREAD_COUNT);
+      for (uint32_t t = 0; t < TAREN_PROFILER_QUERY_THREAD_COUNT; t++)
+      {
+        QueryThread& queryThread = g_queryThreads[(startIndex + t) % TAREN_PROFILER_QUERY_THREAD_COUNT];
+        if (queryThread.m_threadID == entry.m_threadID)
+        {
+          thread = &queryThread;
+          break;
+        }
+        if (queryThread.m_threadID == std::thread::id())
+        {
+          queryThread.m_threadID = entry.m_threadID;
+          queryThread.m_depth = 0;
+          thread = &queryThread;
+          break;
+        }
+      }
+      if (thread == nullptr)
+      {
+        continue;
+      }
+
+      if (entry.m_type != taren_profiler::TagType::End)
+      {
+        if (thread->m_depth < TAREN_PROFILER_QUERY_STACK_DEPTH)
+        {
+          thread->m_stack[thread->m_depth] = QueryThread::OpenTag{ &entry, &i_buffer };
+        }
+        thread->m_depth++;
+      }
+      else if (thread->m_depth > 0)
+      {
+        thread->m_depth--;
+        if (thread->m_depth < TAREN_PROFILER_QUERY_STACK_DEPTH &&
+            entry.m_time >= i_windowStart)
+        {
+          const QueryThread::OpenTag& openTag = thread->m_stack[thread->m_depth];
+          taren_profiler::TagStats* stats = GetStats(io_stats, i_maxStats, *openTag.m_buffer, *openTag.m_begin);
+          if (stats != nullptr)
+          {
+            uint64_t timeNS = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(entry.m_time - openTag.m_begin->m_time).count();
+            stats->m_count++;
+            stats->m_totalNS += timeNS;
+            stats->m_maxNS = std::max(stats->m_maxNS, timeNS);
+            stats->m_histogram[GetStatsBucket(timeNS)]++;
+          }
+        }
+      }
+    }
+  }
+
+  struct MetricsBucket
+  {
+    uint64_t m_maxNS;     // The bucket upper bound in nanoseconds
+    const char* m_label; // The bucket upper bound label in seconds
+  };
+  const MetricsBucket c_metricsBuckets[] =
+  {
+    { 1000, "0.000001" }, { 2500, "0.0000025" }, { 5000, "0.000005" },
+    { 10000, "0.00001" }, { 25000, "0.000025" }, { 50000, "0.00005" },
+    { 100000, "0.0001" }, { 250000, "0.00025" }, { 500000, "0.0005" },
+    { 1000000, "0.001" }, { 2500000, "0.0025" }, { 5000000, "0.005" },
+    { 10000000, "0.01" }, { 25000000, "0.025" }, { 50000000, "0.05" },
+    { 100000000, "0.1" }, { 250000000, "0.25" }, { 500000000, "0.5" },
+    { 1000000000, "1.0" }, { 2500000000, "2.5" }, { 5000000000, "5.0" },
+    { 10000000000, "10.0" },
+  };
+
+  void CleanMetricsLabel(std::string& io_str)
+  {
+    // Escape the label value characters
+    for (size_t i = 0; i < io_str.size(); i++)
+    {
+      switch (io_str[i])
+      {
+      case '\\':
+      case '"':
+        io_str.insert(i, "\\");
+        i++;
+        break;
+      case '\n':
+        io_str.replace(i, 1, "\\n");
+        i++;
+        break;
+      }
+    }
+  }
+
+  void WriteMetricsStats(std::ostream& o_outStream, const taren_profiler::TagStats* i_stats, uint32_t i_count)
+  {
+    const char* callName = "taren_profiler_scope_calls";
+    const char* durationName = "taren_profiler_scope_duration_seconds";
+    std::vector<std::string> labels(i_count);
+    for (uint32_t i = 0; i < i_count; i++)
+    {
+      labels[i] = i_stats[i].m_name;
+      CleanMetricsLabel(labels[i]);
+    }
+
+    o_outStream << "# TYPE " << callName << " counter\n";
+    o_outStream << "# HELP " << callName << " The number of completed scopes of each profiler tag.\n";
+    for (uint32_t i = 0; i < i_count; i++)
+    {
+      o_outStream << callName << "_total{tag=\"" << labels[i] << "\"} " << i_stats[i].m_count << "\n";
+    }
+
+    std::streamsize precision = o_outStream.precision(9);
+    o_outStream << "# TYPE " << durationName << " histogram\n";
+    o_outStream << "# UNIT " << durationName << " seconds\n";
+    o_outStream << "# HELP " << durationName << " The duration of the scopes of each profiler tag.\n";
+    for (uint32_t i = 0; i < i_count; i++)
+    {
+      // Accumulate the internal histogram buckets into the fixed metric buckets
+      const taren_profiler::TagStats& stats = i_stats[i];
+      uint64_t count = 0;
+      uint32_t statsBucket = 0;
+      for (const MetricsBucket& bucket : c_metricsBuckets)
+      {
+        for (; statsBucket < taren_profiler::c_statsBucketCount && GetStatsBucketMax(statsBucket) <= bucket.m_maxNS; statsBucket++)
+        {
+          count += stats.m_histogram[statsBucket];
+        }
+
+        // Split an internal bucket that straddles the bound by the part of its range below the bound (assumes its times are evenly spread)
+        uint64_t splitCount = 0;
+        if (statsBucket < taren_profiler::c_statsBucketCount)
+        {
+          uint64_t minNS = (statsBucket == 0) ? 0 : GetStatsBucketMax(statsBucket - 1) + 1;
+          uint64_t maxNS = GetStatsBucketMax(statsBucket);
+          if (minNS <= bucket.m_maxNS)
+          {
+            splitCount = (uint64_t)((double)stats.m_histogram[statsBucket] * (double)(bucket.m_maxNS - minNS + 1) / (double)(maxNS - minNS + 1));
+          }
+        }
+        o_outStream << durationName << "_bucket{tag=\"" << labels[i] << "\",le=\"" << bucket.m_label << "\"} " << count + splitCount << "\n";
+      }
+      o_outStream << durationName << "_bucket{tag=\"" << labels[i] << "\",le=\"+Inf\"} " << stats.m_count << "\n";
+      o_outStream << durationName << "_count{tag=\"" << labels[i] << "\"} " << stats.m_count << "\n";
+      o_outStream << durationName << "_sum{tag=\"" << labels[i] << "\"} " << (double)stats.m_totalNS / 1e9 << "\n";
+    }
+    o_outStream << "# EOF\n";
+    o_outStream.precision(precision);
+  }
+
+#ifdef TAREN_PROFILER_HISTOGRAMS
+  void WriteJsonHistograms(JsonState& io_state, std::ostream& o_outStream)
+  {
+    // Merge the histograms of all threads by tag (the thread histograms are read while their threads may still be adding)
+    std::unordered_map<uint32_t, size_t> tagHistograms;
+    std::vector<Histogram> merged;
+    {
+      std::lock_guard<std::mutex> lock(g_histogramMutex);
+      for (const Histogram& histogram : g_histograms)
+      {
+        if (histogram.m_state.load(std::memory_order_acquire) != HistogramStateFree)
+        {
+          tagHistograms.emplace(histogram.m_tagID, tagHistograms.size());
+        }
+      }
+      merged = std::vector<Histogram>(tagHistograms.size());
+      for (const Histogram& histogram : g_histograms)
+      {
+        auto mergedIndex = tagHistograms.find(histogram.m_tagID);
+        if (histogram.m_state.load(std::memory_order_acquire) != HistogramStateFree &&
+            mergedIndex != tagHistograms.end())
+        {
+          Histogram& mergedHistogram = merged[mergedIndex->second];
+          mergedHistogram.m_tagID = histogram.m_tagID;
+          mergedHistogram.m_type = histogram.m_type;
+          MergeHistogram(mergedHistogram, histogram);
+        }
+      }
+    }
+
+    struct HistogramResult
+    {
+      const char* m_name;               // The tag name
+      const TagDescriptor* m_descriptor; // The descriptor if a registered tag
+      uint64_t m_count;                 // The number of scopes
+      uint64_t m_values[5];             // The p50/p90/p99/p99.9/max values in nanoseconds
+    };
+    std::vector<HistogramResult> results;
+    const double percentiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+    for (const Histogram& histogram : merged)
+    {
+      HistogramResult result = {};
+      ProfileRecord record;
+      record.m_tagID = histogram.m_tagID;
+      record.m_type = histogram.m_type;
+      result.m_name = GetTagName(&io_state, g_buffers[0], record);
+      if ((histogram.m_tagID & (c_copyTagFlag | c_addressTagFlag)) == 0)
+      {
+        result.m_descriptor = &g_tagDescriptors[histogram.m_tagID];
+      }
+
+      for (const std::atomic_uint32_t& count : histogram.m_counts)
+      {
+        result.m_count += count.load(std::memory_order_relaxed);
+      }
+      uint64_t maxNS = histogram.m_maxNS.load(std::memory_order_relaxed);
+      result.m_values[4] = maxNS;
+
+      // Report the highest value of the bucket each percentile is in
+      uint64_t count = 0;
+      uint32_t p = 0;
+      for (uint32_t i = 0; i < c_histogramBucketCount && p < 4; i++)
+      {
+        count += histogram.m_counts[i].load(std::memory_order_relaxed);
+        while (p < 4 && count > (uint64_t)(result.m_count * percentiles[p]))
+        {
+          result.m_values[p++] = std::min(GetHistogramBucketMax(i), maxNS);
+        }
+      }
+      for (; p < 4; p++)
+      {
+        result.m_values[p] = maxNS;
+      }
+
+      if (result.m_count > 0)
+      {
+        results.push_back(result);
+      }
+    }
+    std::sort(results.begin(), results.end(), [](const HistogramResult& a, const HistogramResult& b) { return a.m_count > b.m_count; });
+
+    o_outStream << ",\n\"histograms\":[";
+    std::string cleanTag;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      const HistogramResult& result = results[i];
+      cleanTag = result.m_name;
+      CleanJsonStr(cleanTag);
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"name\":\"" << cleanTag << "\",\"count\":" << result.m_count <<
+        ",\"p50_ns\":" << result.m_values[0] <<
+        ",\"p90_ns\":" << result.m_values[1] <<
+        ",\"p99_ns\":" << result.m_values[2] <<
+        ",\"p999_ns\":" << result.m_values[3] <<
+        ",\"max_ns\":" << result.m_values[4];
+
+      // Add the call site of registered tags
+      if (result.m_descriptor != nullptr && result.m_descriptor->m_line != 0)
+      {
+        cleanTag = result.m_descriptor->m_file;
+        CleanJsonStr(cleanTag);
+        o_outStream << ",\"file\":\"" << cleanTag << "\",\"line\":" << result.m_descriptor->m_line;
+      }
+      o_outStream << "}";
+    }
+    o_outStream << "\n]";
+  }
+#endif // TAREN_PROFILER_HISTOGRAMS
+
+#ifdef TAREN_PROFILER_SLOWEST
+  const char* GetSlowestTagName(JsonState& io_state, const SlowestRecord& i_record, taren_profiler::TagType i_type)
+  {
+    if (i_record.m_tagID == c_copyTagFlag)
+    {
+      return i_record.m_copyName;
+    }
+    ProfileRecord record;
+    record.m_tagID = i_record.m_tagID;
+    record.m_type = i_type;
+    return GetTagName(&io_state, g_buffers[0], record);
+  }
+
+  void WriteJsonSlowestEvents(JsonState& io_state, const RecordBuffer& i_buffer, uint32_t i_recordCount, bool& io_firstEvent, std::string& io_cleanTag, std::ostream& o_outStream)
+  {
+    // Merge the kept scopes of each thread (scopes on a thread are nested or disjoint, so the union of the records stays balanced)
+    SlowestTagsLock lock;
+    std::unordered_map<std::thread::id, std::vector<const SlowestRecord*>> threadRecords;
+    for (const SlowestTag& tag : g_slowestTags)
+    {
+      for (const SlowestInstance& instance : tag.m_instances)
+      {
+        if (instance.m_recordCount == 0)
+        {
+          continue;
+        }
+        std::vector<const SlowestRecord*>& records = threadRecords[instance.m_threadID];
+        for (uint32_t r = 0; r < instance.m_recordCount; r++)
+        {
+          records.push_back(&instance.m_records[r]);
+        }
+      }
+    }
+
+    struct OpenTag
+    {
+      ProfileRecord m_begin;  // The begin record
+      const char* m_name;     // The tag name
+      bool m_inBuffer;        // If the begin record is from the record buffer
+    };
+    std::vector<OpenTag> openTags;
+    for (auto& t : threadRecords)
+    {
+      std::vector<const SlowestRecord*>& records = t.second;
+      std::sort(records.begin(), records.end(), [](const SlowestRecord* a, const SlowestRecord* b) { return a->m_sequence < b->m_sequence; });
+      records.erase(std::unique(records.begin(), records.end(), [](const SlowestRecord* a, const SlowestRecord* b) { return a->m_sequence == b->m_sequence; }), records.end());
+
+      JsonState::Tags& stack = io_state.m_threadStack[JsonState::ThreadKey{ t.first, 0 }];
+      if (stack.m_index < 0)
+      {
+        stack.m_index = io_state.m_threadCounter;
+        io_state.m_threadCounter++;
+      }
+
+      openTags.clear();
+      for (const SlowestRecord* slowestRecord : records)
+      {
+        // Use the full record (args, counters) if it is still in the record buffer
+        ProfileRecord record;
+        const char* tag = nullptr;
+        uint32_t index = slowestRecord->m_recordIndex;
+        bool inBuffer = (slowestRecord->m_buffer == &i_buffer &&
+                         index < i_recordCount &&
+                         i_buffer.m_records[index].m_time == slowestRecord->m_time &&
+                         i_buffer.m_records[index].m_type == slowestRecord->m_type);
+        if (inBuffer)
+        {
+          record = i_buffer.m_records[index];
+          tag = GetTagName(&io_state, i_buffer, record);
+        }
+        else
+        {
+          record.m_time = slowestRecord->m_time;
+          record.m_type = slowestRecord->m_type;
+          record.m_tagID = (slowestRecord->m_tagID == c_copyTagFlag) ? c_unknownTagID : slowestRecord->m_tagID;
+          record.m_value = (slowestRecord->m_type == taren_profiler::TagType::Value) ? slowestRecord->m_value : 0;
+          record.m_argCount = 0;
+          tag = GetSlowestTagName(io_state, *slowestRecord, slowestRecord->m_type);
+        }
+
+        if (record.m_type == taren_profiler::TagType::Begin ||
+            record.m_type == taren_profiler::TagType::FunctionBegin)
+        {
+          openTags.push_back(OpenTag{ record, tag, inBuffer });
+        }
+        else if (record.m_type == taren_profiler::TagType::End &&
+                 openTags.size() > 0)
+        {
+          OpenTag openTag = openTags.back();
+          openTags.pop_back();
+          WriteJsonEvent(o_outStream, record, (inBuffer && openTag.m_inBuffer) ? &openTag.m_begin : nullptr, inBuffer ? &i_buffer : nullptr, openTag.m_name, stack.m_index, io_firstEvent, io_cleanTag);
+          continue;
+        }
+        WriteJsonEvent(o_outStream, record, nullptr, inBuffer ? &i_buffer : nullptr, tag, stack.m_index, io_firstEvent, io_cleanTag);
+      }
+    }
+  }
+
+  void WriteJsonSlowest(JsonState& io_state, std::ostream& o_outStream)
+  {
+    SlowestTagsLock lock;
+    o_outStream << ",\n\"slowest\":[";
+    bool firstTag = true;
+    std::string cleanTag;
+    std::vector<const SlowestInstance*> instances;
+    for (const SlowestTag& tag : g_slowestTags)
+    {
+      instances.clear();
+      for (const SlowestInstance& instance : tag.m_instances)
+      {
+        if (instance.m_recordCount > 0)
+        {
+          instances.push_back(&instance);
+        }
+      }
+      if (instances.size() == 0)
+      {
+        continue;
+      }
+      std::sort(instances.begin(), instances.end(), [](const SlowestInstance* a, const SlowestInstance* b) { return a->m_timeNS > b->m_timeNS; });
+
+      // The first record of a kept scope is its begin record (its type resolves function names)
+      SlowestRecord record;
+      record.m_tagID = tag.m_tagID.load(std::memory_order_relaxed);
+      cleanTag = GetSlowestTagName(io_state, record, instances[0]->m_records[0].m_type);
+      CleanJsonStr(cleanTag);
+      o_outStream << (firstTag ? "\n" : ",\n") << "{\"name\":\"" << cleanTag << "\",\"instances\":[";
+      firstTag = false;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        const SlowestInstance& instance = *instances[i];
+        o_outStream << (i == 0 ? "" : ",") <<
+          "{\"ts\":" << std::chrono::duration_cast<std::chrono::microseconds>(instance.m_records[0].m_time - g_startTime).count() <<
+          ",\"dur_ns\":" << instance.m_timeNS <<
+          ",\"records\":" << instance.m_recordCount;
+        if (instance.m_truncated)
+        {
+          o_outStream << ",\"truncated\":true";
+        }
+        o_outStream << "}";
+      }
+      o_outStream << "]}";
+    }
+    o_outStream << "\n]";
+  }
+#endif // TAREN_PROFILER_SLOWEST
+
+  void WriteJsonLocks(std::ostream& o_outStream)
+  {
+    uint32_t lockCount = g_lockCount;
+    if (lockCount == 0)
+    {
+      return;
+    }
+
+    // Sort by the total wait time so the most contended locks are first
+    std::vector<LockStats*> sorted;
+    for (uint32_t i = 0; i < lockCount; i++)
+    {
+      if (g_locks[i].m_acquires > 0 || g_locks[i].m_sharedAcquires > 0)
+      {
+        sorted.push_back(&g_locks[i]);
+      }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const LockStats* a, const LockStats* b) { return a->m_waitNS > b->m_waitNS; });
+
+    o_outStream << ",\n\"locks\":[";
+    std::string cleanName;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      // Take the stats, so each write only has the locks since the last write
+      LockStats& lock = *sorted[i];
+      cleanName = lock.m_name;
+      CleanJsonStr(cleanName);
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"name\":\"" << cleanName << "\",\"acquires\":" << lock.m_acquires.exchange(0) <<
+        ",\"shared_acquires\":" << lock.m_sharedAcquires.exchange(0) <<
+        ",\"contended\":" << lock.m_contended.exchange(0) <<
+        ",\"wait_us\":" << lock.m_waitNS.exchange(0) / 1000 <<
+        ",\"max_wait_us\":" << lock.m_maxWaitNS.exchange(0) / 1000 <<
+        ",\"hold_us\":" << lock.m_holdNS.exchange(0) / 1000 <<
+        ",\"max_hold_us\":" << lock.m_maxHoldNS.exchange(0) / 1000 << "}";
+    }
+    o_outStream << "\n]";
+  }
+
+  void ResetLocks()
+  {
+    uint32_t lockCount = g_lockCount;
+    for (uint32_t i = 0; i < lockCount; i++)
+    {
+      LockStats& lock = g_locks[i];
+      lock.m_acquires = 0;
+      lock.m_sharedAcquires = 0;
+      lock.m_contended = 0;
+      lock.m_waitNS = 0;
+      lock.m_maxWaitNS = 0;
+      lock.m_holdNS = 0;
+      lock.m_maxHoldNS = 0;
+    }
+  }
+
+  void WriteJsonIO(std::ostream& o_outStream)
+  {
+    // Sort by the total time so the slowest files are first
+    std::vector<uint32_t> sorted;
+    std::vector<uint64_t> totalNS(TAREN_PROFILER_IO_FD_COUNT);
+    for (uint32_t fd = 0; fd < TAREN_PROFILER_IO_FD_COUNT; fd++)
+    {
+      const IOStats& stats = g_ioStats[fd];
+      uint64_t calls = 0;
+      for (uint32_t t = 0; t < c_ioTypeCount; t++)
+      {
+        calls += stats.m_calls[t];
+        totalNS[fd] += stats.m_ns[t];
+      }
+      if (calls > 0)
+      {
+        sorted.push_back(fd);
+      }
+    }
+    if (sorted.empty())
+    {
+      return;
+    }
+    std::sort(sorted.begin(), sorted.end(), [&totalNS](uint32_t a, uint32_t b) { return totalNS[a] > totalNS[b]; });
+
+    std::lock_guard<std::mutex> lock(g_ioMutex);
+    o_outStream << ",\n\"io\":[";
+    std::string cleanPath;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      // Take the stats, so each write only has the calls since the last write
+      IOStats& stats = g_ioStats[sorted[i]];
+      cleanPath = stats.m_path;
+      CleanJsonStr(cleanPath);
+      uint64_t calls[c_ioTypeCount];
+      uint64_t bytes[c_ioTypeCount];
+      uint64_t ns[c_ioTypeCount];
+      for (uint32_t t = 0; t < c_ioTypeCount; t++)
+      {
+        calls[t] = stats.m_calls[t].exchange(0);
+        bytes[t] = stats.m_bytes[t].exchange(0);
+        ns[t] = stats.m_ns[t].exchange(0);
+      }
+
+      // Throughput is over the time spent in the calls (MB is 10^6 bytes)
+      const uint32_t readIndex = (uint32_t)taren_profiler::IOType::Read;
+      const uint32_t writeIndex = (uint32_t)taren_profiler::IOType::Write;
+      const uint32_t syncIndex = (uint32_t)taren_profiler::IOType::Sync;
+      const uint32_t otherIndex = (uint32_t)taren_profiler::IOType::Other;
+      char readRate[32] = "0";
+      char writeRate[32] = "0";
+      if (ns[readIndex] > 0)
+      {
+        std::snprintf(readRate, sizeof(readRate), "%.1f", (double)bytes[readIndex] * 1000.0 / (double)ns[readIndex]);
+      }
+      if (ns[writeIndex] > 0)
+      {
+        std::snprintf(writeRate, sizeof(writeRate), "%.1f", (double)bytes[writeIndex] * 1000.0 / (double)ns[writeIndex]);
+      }
+      o_outStream << (i == 0 ? "\n" : ",\n") <<
+        "{\"fd\":" << sorted[i] << ",\"path\":\"" << cleanPath << "\"" <<
+        ",\"reads\":" << calls[readIndex] << ",\"read_bytes\":" << bytes[readIndex] << ",\"read_us\":" << ns[readIndex] / 1000 << ",\"read_mb_per_s\":" << readRate <<
+        ",\"writes\":" << calls[writeIndex] << ",\"write_bytes\":" << bytes[writeIndex] << ",\"write_us\":" << ns[writeIndex] / 1000 << ",\"write_mb_per_s\":" << writeRate <<
+        ",\"syncs\":" << calls[syncIndex] << ",\"sync_us\":" << ns[syncIndex] / 1000 <<
+        ",\"other\":" << calls[otherIndex] << ",\"other_us\":" << ns[otherIndex] / 1000 <<
+        ",\"max_us\":" << stats.m_maxNS.exchange(0) / 1000 << ",\"errors\":" << stats.m_errors.exchange(0) << "}";
+    }
+    o_outStream << "\n]";
+  }
+
+  void ResetIO()
+  {
+    for (IOStats& stats : g_ioStats)
+    {
+      for (uint32_t t = 0; t < c_ioTypeCount; t++)
+      {
+        stats.m_calls[t] = 0;
+        stats.m_bytes[t] = 0;
+        stats.m_ns[t] = 0;
+      }
+      stats.m_maxNS = 0;
+      stats.m_errors = 0;
+    }
+  }
+
+  void InitJsonState(JsonState& io_state)
+  {
+    // Init the calling thread as the primary thread
+    if (io_state.m_threadCounter == 0)
+    {
+      io_state.m_threadStack[JsonState::ThreadKey{ std::this_thread::get_id(), 0 }].m_index = 0;
+      io_state.m_threadCounter = 1;
+    }
+  }
+
+  void WriteJson(JsonState& io_state, const RecordBuffer& i_buffer, uint32_t i_recordCount, bool i_endOfProfile, std::ostream& o_outStream)
+  {
+    bool firstEvent = true;
+    std::string cleanTag;
+
+    // The process id and start times on the first line, so the captures of several processes can be merged (see Tools/ProfileMerge.cpp)
+#if defined(_WIN32)
+    int processID = _getpid();
+#else
+    int processID = (int)getpid();
+#endif
+    o_outStream << "{\"otherData\":{\"pid\":" << processID << ",\"monotonic_start_ns\":" << g_startMonotonicNS << ",\"system_start_ns\":" << g_startSystemNS << "},\n";
+    o_outStream << "\"traceEvents\":[\n";
+
+    // With TAREN_PROFILER_SLOWEST, End() only writes the kept slowest scopes instead of the scope and value records (the records still give the aggregates)
+#ifdef TAREN_PROFILER_SLOWEST
+    bool writeRecords = !i_endOfProfile;
+#else
+    bool writeRecords = true;
+#endif // TAREN_PROFILER_SLOWEST
+
+    // Re-open any tags that were started in a previous snapshot, so each file can be viewed on its own
+    for (auto& t : io_state.m_threadStack)
+    {
+      for (const JsonState::OpenTag& openTag : t.second.m_tags)
+      {
+        if (writeRecords || t.first.m_process != 0)
+        {
+          WriteJsonEvent(o_outStream, openTag.m_begin, nullptr, nullptr, openTag.m_name, t.second.m_index, firstEvent, cleanTag);
+        }
+      }
+    }
+    for (const auto& t : io_state.m_openTasks)
+    {
+      WriteJsonTaskEvent(o_outStream, io_state, g_tagDescriptors[t.second.m_tagID].m_name, "b", t.second.m_begin, t.first, t.second, firstEvent, cleanTag);
+      o_outStream << "\"args\":{}}";
+      if (t.second.m_suspend != clock::time_point())
+      {
+        WriteJsonTaskEvent(o_outStream, io_state, "Suspended", "b", t.second.m_suspend, t.first, t.second, firstEvent, cleanTag);
+        o_outStream << "\"args\":{}}";
+      }
+    }
+
+    for (size_t i = 0; i < i_recordCount; i++)
+    {
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+      // Skip records that a worker process did not finish, and use the tag ids of this process for worker records
+      ProfileRecord processEntry = i_buffer.m_records[i];
+      if (processEntry.m_generation.m_value != i_buffer.m_generation)
+      {
+        continue;
+      }
+      if (processEntry.m_process != 0)
+      {
+        processEntry.m_tagID = GetProcessTagID(io_state, processEntry);
+        processEntry.m_argCount = 0; // The arg key / string pointers are only valid in the worker process
+      }
+      const ProfileRecord& entry = processEntry;
+      JsonState::Tags& stack = io_state.m_threadStack[JsonState::ThreadKey{ entry.m_threadID, entry.m_process }];
+#else
+      const ProfileRecord& entry = i_buffer.m_records[i];
+      JsonState::Tags& stack = io_state.m_threadStack[JsonState::ThreadKey{ entry.m_threadID, 0 }];
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+      // Assign a unique index to each thread
+      if (stack.m_index < 0)
+      {
+        stack.m_index = io_state.m_threadCounter;
+        io_state.m_threadCounter++;
+      }
+
+      // Get the name tags
+      const char* tag = GetTagName(&io_state, i_buffer, entry);
+
+      // Gauges and the records of other processes are always written (the kept slowest scopes only cover this process)
+      bool writeEntry = writeRecords || entry.m_type == taren_profiler::TagType::Gauge;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+      writeEntry = writeEntry || entry.m_process != 0;
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+      // Flag when the thread moved to a different core since the last record
+      if (entry.m_cpu != stack.m_lastCpu)
+      {
+        if (stack.m_lastCpu != UINT32_MAX)
+        {
+          if (writeEntry)
+          {
+            if (!firstEvent)
+            {
+              o_outStream << ",\n";
+            }
+            firstEvent = false;
+
+            long long msCount = std::chrono::duration_cast<std::chrono::microseconds>(entry.m_time - g_startTime).count();
+            o_outStream <<
+              "{\"name\":\"CpuMigration\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << msCount << ",\"pid\":" << stack.m_index << ",\"cat\":\"\",\"tid\":0," <<
+              "\"args\":{\"from\":" << stack.m_lastCpu << ",\"to\":" << entry.m_cpu << "}}";
+          }
+
+          if (stack.m_tags.size() > 0)
+          {
+            stack.m_tags.back().m_migrations++;
+          }
+        }
+        stack.m_lastCpu = entry.m_cpu;
+      }
+#endif // TAREN_PROFILER_RECORD_CPU
+
+      if (IsTaskType(entry.m_type))
+      {
+        WriteJsonTask(io_state, entry, stack.m_index, firstEvent, o_outStream, cleanTag);
+        continue;
+      }
+
+      if (entry.m_type == taren_profiler::TagType::Begin ||
+          entry.m_type == taren_profiler::TagType::FunctionBegin)
+      {
+        stack.m_tags.push_back(JsonState::OpenTag{ entry, tag });
+      }
+      else if (entry.m_type == taren_profiler::TagType::End)
+      {
+        if (stack.m_tags.size() > 0)
+        {
+          JsonState::OpenTag openTag = stack.m_tags.back();
+          stack.m_tags.pop_back();
+          tag = openTag.m_name;
+
+          AddAggregate(io_state, openTag, entry);
+          if (stack.m_tags.size() > 0)
+          {
+            stack.m_tags.back().m_childTime += entry.m_time - openTag.m_begin.m_time;
+#ifdef TAREN_PROFILER_RECORD_CPU
+            stack.m_tags.back().m_migrations += openTag.m_migrations;
+#endif // TAREN_PROFILER_RECORD_CPU
+          }
+
+          if (writeEntry)
+          {
+            WriteJsonEvent(o_outStream, entry, &openTag.m_begin, &i_buffer, tag, stack.m_index, firstEvent, cleanTag);
+          }
+          continue;
+        }
+      }
+
+      if (writeEntry)
+      {
+        WriteJsonEvent(o_outStream, entry, nullptr, &i_buffer, tag, stack.m_index, firstEvent, cleanTag);
+      }
+    }
+
+#ifdef TAREN_PROFILER_SLOWEST
+    if (i_endOfProfile)
+    {
+      WriteJsonSlowestEvents(io_state, i_buffer, i_recordCount, firstEvent, cleanTag, o_outStream);
+    }
+#endif // TAREN_PROFILER_SLOWEST
+
+#ifdef TAREN_PROFILER_SAMPLING
+    SampleTree sampleTree;
+    if (i_endOfProfile)
+    {
+      WriteJsonSamples(io_state, sampleTree, firstEvent, cleanTag, o_outStream);
+    }
+#endif // TAREN_PROFILER_SAMPLING
+
+    // Copy the names of copied tags that are still open, as the buffer they point to can be reused by the next snapshot
+    std::deque<std::string> pinnedTags;
+    for (auto& t : io_state.m_threadStack)
+    {
+      for (JsonState::OpenTag& openTag : t.second.m_tags)
+      {
+        if ((openTag.m_begin.m_tagID & c_copyTagFlag) != 0)
+        {
+          pinnedTags.emplace_back(openTag.m_name);
+          openTag.m_name = pinnedTags.back().c_str();
+        }
+      }
+    }
+    io_state.m_pinnedTags.swap(pinnedTags);
+
+    // Write thread "names"
+    if (!firstEvent)
+    {
+      for (auto& t : io_state.m_threadStack)
+      {
+        // Sort thread listing by the time that they appear in the profile (tool sorts by name)
+        char indexSpaceString[64];
+        std::snprintf(indexSpaceString, sizeof(indexSpaceString), "%02d", t.second.m_index);
+
+        // Ensure a clean json string (undefined what thread::id is)
+        std::ostringstream ss;
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+        MappedFileHeader* header = g_mappedHeader;
+        if (t.first.m_process != 0 && header != nullptr)
+        {
+          ss << "pid" << GetMappedProcessIDs(*header)[t.first.m_process] << "_";
+        }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+        ss << t.first.m_threadID;
+#ifdef TAREN_PROFILER_GAUGES
+        if (t.first.m_threadID == g_gaugeThreadID && t.first.m_process == 0)
+        {
+          ss.str("Gauges"); // The counter tracks of the gauge sampler
+        }
+#endif // TAREN_PROFILER_GAUGES
+        std::string threadName = ss.str();
+        CleanJsonStr(threadName);
+
+        o_outStream << // (Note using process ID for threads as that gives a better formatting in the output tool for value tags)
+          ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":0,\"pid\":" << t.second.m_index <<
+          ",\"args\":{\"name\":\"Thread" << indexSpaceString << "_" << threadName << "\"}}";
+      }
+      if (io_state.m_taskIndex >= 0)
+      {
+        o_outStream << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":0,\"pid\":" << io_state.m_taskIndex << ",\"args\":{\"name\":\"Tasks\"}}";
+      }
+    }
+
+    o_outStream << "\n]";
+    WriteJsonAggregates(io_state, o_outStream);
+    WriteJsonTasks(io_state, o_outStream);
+    WriteJsonLocks(o_outStream);
+    WriteJsonIO(o_outStream);
+#ifdef TAREN_PROFILER_HISTOGRAMS
+    if (i_endOfProfile)
+    {
+      WriteJsonHistograms(io_state, o_outStream);
+    }
+#endif // TAREN_PROFILER_HISTOGRAMS
+#ifdef TAREN_PROFILER_SLOWEST
+    if (i_endOfProfile)
+    {
+      WriteJsonSlowest(io_state, o_outStream);
+    }
+#endif // TAREN_PROFILER_SLOWEST
+#ifdef TAREN_PROFILER_SAMPLING
+    if (i_endOfProfile)
+    {
+      WriteJsonStackFrames(sampleTree, o_outStream);
+    }
+#endif // TAREN_PROFILER_SAMPLING
+    (void)i_endOfProfile;
+    o_outStream << "\n}\n";
+  }
+}
+
+namespace taren_profiler
+{
+  uint32_t RegisterTag(const char* i_name, const char* i_file, uint32_t i_line, const char* i_category)
+  {
+    uint32_t tagID = g_tagDescriptorCount.fetch_add(1);
+    if (tagID >= TAREN_PROFILER_TAG_DESCRIPTOR_COUNT)
+    {
+      g_tagDescriptorCount--;
+      return c_outOfDescriptorsTagID;
+    }
+
+    TagDescriptor& descriptor = g_tagDescriptors[tagID];
+    descriptor.m_name = i_name;
+    descriptor.m_file = i_file;
+    descriptor.m_line = i_line;
+    descriptor.m_category = i_category;
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    MapDescriptor(tagID);
+#endif // TAREN_PROFILER_MAPPED_FILE
+    return tagID;
+  }
+
+  EnumTags RegisterEnumTags(const char* const* i_names, uint32_t i_count, const char* i_file, uint32_t i_line, const char* i_category)
+  {
+    // Each enum type is registered once (identified by its string table), as a block of descriptors indexed by the enum value
+    std::lock_guard<std::mutex> lock(g_enumTagMutex);
+    for (const auto& registered : g_enumTags)
+    {
+      if (registered.first == i_names)
+      {
+        return registered.second;
+      }
+    }
+
+    EnumTags tags;
+    uint32_t baseTagID = g_tagDescriptorCount.fetch_add(i_count);
+    if (baseTagID + i_count > TAREN_PROFILER_TAG_DESCRIPTOR_COUNT)
+    {
+      g_tagDescriptorCount -= i_count;
+      return tags;
+    }
+    for (uint32_t i = 0; i < i_count; i++)
+    {
+      TagDescriptor& descriptor = g_tagDescriptors[baseTagID + i];
+      descriptor.m_name = i_names[i];
+      descriptor.m_file = i_file;
+      descriptor.m_line = i_line;
+      descriptor.m_category = i_category;
+#ifdef TAREN_PROFILER_MAPPED_FILE
+      MapDescriptor(baseTagID + i);
+#endif // TAREN_PROFILER_MAPPED_FILE
+    }
+    tags.m_baseTagID = baseTagID;
+    tags.m_count = i_count;
+    g_enumTags.emplace_back(i_names, tags);
+    return tags;
+  }
+
+  uint32_t RegisterLock(const char* i_name)
+  {
+    std::lock_guard<std::mutex> lock(g_lockMutex);
+    uint32_t lockCount = g_lockCount;
+    for (uint32_t i = 0; i < lockCount; i++)
+    {
+      if (g_locks[i].m_name == i_name ||
+          strcmp(g_locks[i].m_name, i_name) == 0)
+      {
+        return i;
+      }
+    }
+    if (lockCount >= TAREN_PROFILER_LOCK_COUNT)
+    {
+      return UINT32_MAX;
+    }
+
+    g_locks[lockCount].m_name = i_name;
+    g_locks[lockCount].m_waitTagID = RegisterTag(i_name, "", 0, "lock");
+    g_lockCount = lockCount + 1;
+    return lockCount;
+  }
+
+  uint32_t GetLockWaitTagID(uint32_t i_lockID)
+  {
+    return (i_lockID < g_lockCount) ? g_locks[i_lockID].m_waitTagID : c_unknownTagID;
+  }
+
+  void ProfileLockAcquire(uint32_t i_lockID, uint64_t i_waitNS, bool i_contended, bool i_shared)
+  {
+    if (!g_enabled || i_lockID >= g_lockCount)
+    {
+      return;
+    }
+
+    LockStats& lock = g_locks[i_lockID];
+    (i_shared ? lock.m_sharedAcquires : lock.m_acquires).fetch_add(1, std::memory_order_relaxed);
+    if (i_contended)
+    {
+      lock.m_contended.fetch_add(1, std::memory_order_relaxed);
+      lock.m_waitNS.fetch_add(i_waitNS, std::memory_order_relaxed);
+      UpdateMax(lock.m_maxWaitNS, i_waitNS);
+    }
+  }
+
+  void ProfileLockRelease(uint32_t i_lockID, uint64_t i_holdNS)
+  {
+    if (!g_enabled || i_lockID >= g_lockCount)
+    {
+      return;
+    }
+
+    LockStats& lock = g_locks[i_lockID];
+    lock.m_holdNS.fetch_add(i_holdNS, std::memory_order_relaxed);
+    UpdateMax(lock.m_maxHoldNS, i_holdNS);
+  }
+
+  void ProfileIO(IOType i_type, int i_fd, int64_t i_result, uint64_t i_latencyNS)
+  {
+    if (!g_enabled || i_fd < 0 || i_fd >= TAREN_PROFILER_IO_FD_COUNT)
+    {
+      return;
+    }
+
+    IOStats& stats = g_ioStats[i_fd];
+    uint32_t typeIndex = (uint32_t)i_type;
+    stats.m_calls[typeIndex].fetch_add(1, std::memory_order_relaxed);
+    stats.m_ns[typeIndex].fetch_add(i_latencyNS, std::memory_order_relaxed);
+    UpdateMax(stats.m_maxNS, i_latencyNS);
+    if (i_result < 0)
+    {
+      stats.m_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (i_type == IOType::Read || i_type == IOType::Write)
+    {
+      stats.m_bytes[typeIndex].fetch_add((uint64_t)i_result, std::memory_order_relaxed);
+    }
+  }
+
+  void SetIOPath(int i_fd, const char* i_path)
+  {
+    if (i_fd < 0 || i_fd >= TAREN_PROFILER_IO_FD_COUNT)
+    {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(g_ioMutex);
+    g_ioStats[i_fd].m_path = (i_path != nullptr) ? i_path : "";
+  }
+
+  void ProfileTagID(TagType i_type, uint32_t i_tagID, int32_t i_value)
+  {
+    if (!g_enabled)
+    {
+      return;
+    }
+    AddRecord(i_type, i_tagID, nullptr, i_value);
+  }
+
+  uint32_t RegisterGauge(const char* i_name, GaugeCallback i_callback, void* i_userData)
+  {
+#ifdef TAREN_PROFILER_GAUGES
+    std::lock_guard<std::mutex> lock(g_gaugeMutex);
+
+    // Reuse an unregistered slot, keeping the tag id if it had the same name
+    uint32_t gaugeID = g_gaugeCount;
+    for (uint32_t i = 0; i < g_gaugeCount; i++)
+    {
+      if (g_gauges[i].m_callback == nullptr &&
+          (gaugeID == g_gaugeCount || g_gauges[i].m_name == i_name))
+      {
+        gaugeID = i;
+      }
+    }
+    if (gaugeID == TAREN_PROFILER_GAUGE_COUNT)
+    {
+      return UINT32_MAX;
+    }
+    g_gaugeCount = std::max(g_gaugeCount, gaugeID + 1);
+
+    Gauge& gauge = g_gauges[gaugeID];
+    if (gauge.m_name != i_name || gauge.m_tagID == 0)
+    {
+      gauge.m_name = i_name;
+      gauge.m_tagID = RegisterTag(i_name, "", 0, "gauge");
+    }
+    gauge.m_callback = i_callback;
+    gauge.m_userData = i_userData;
+    return gaugeID;
+#else
+    (void)i_name;
+    (void)i_callback;
+    (void)i_userData;
+    return UINT32_MAX;
+#endif // TAREN_PROFILER_GAUGES
+  }
+
+  void UnregisterGauge(uint32_t i_gaugeID)
+  {
+#ifdef TAREN_PROFILER_GAUGES
+    std::unique_lock<std::mutex> lock(g_gaugeMutex);
+    if (i_gaugeID < g_gaugeCount)
+    {
+      // Wait for a call in progress (a callback unregistering its own gauge is already in the call)
+      Gauge& gauge = g_gauges[i_gaugeID];
+      gauge.m_callback = nullptr;
+      if (!t_gaugeThread)
+      {
+        g_gaugeCallCondition.wait(lock, [&gauge] { return !gauge.m_calling; });
+      }
+    }
+#else
+    (void)i_gaugeID;
+#endif // TAREN_PROFILER_GAUGES
+  }
+
+  void SetBudgetCallback(BudgetCallback i_callback)
+  {
+    g_budgetCallback = i_callback;
+  }
+
+  uint64_t BeginBudgetScope(uint32_t i_tagID)
+  {
+    if (!g_enabled)
+    {
+      return 0;
+    }
+
+    // Return the time of the begin record, so the budget is checked against the recorded duration
+    clock::time_point time = AddRecord(TagType::Begin, i_tagID, nullptr, 0);
+    if (time == clock::time_point())
+    {
+      return 0;
+    }
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+  }
+
+  void EndBudgetScope(uint32_t i_tagID, uint64_t i_beginNS, uint64_t i_budgetNS)
+  {
+    // The scope began before profiling started
+    if (i_beginNS == 0)
+    {
+      return;
+    }
+
+    clock::time_point endTime = clock::now();
+    uint64_t durationNS = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(endTime.time_since_epoch()).count() - i_beginNS;
+    if (durationNS <= i_budgetNS)
+    {
+      if (g_enabled)
+      {
+        AddRecord(TagType::End, 0, nullptr, 0, nullptr, 0, 0, &endTime);
+      }
+      return;
+    }
+
+    if (g_enabled)
+    {
+      int32_t budgetUS = (int32_t)std::min<uint64_t>(i_budgetNS / 1000, INT32_MAX);
+      AddRecord(TagType::End, 0, nullptr, budgetUS, nullptr, 0, c_overBudgetFlag, &endTime);
+    }
+    BudgetCallback callback = g_budgetCallback;
+    if (callback != nullptr)
+    {
+      callback(g_tagDescriptors[(i_tagID < g_tagDescriptorCount) ? i_tagID : c_unknownTagID].m_name, durationNS, i_budgetNS);
+    }
+  }
+
+  void ProfileTagArgArray(uint32_t i_tagID, const TagArg* i_args, uint32_t i_argCount)
+  {
+    if (!g_enabled)
+    {
+      return;
+    }
+    AddRecord(TagType::Begin, i_tagID, nullptr, 0, i_args, std::min(i_argCount, c_maxTagArgs));
+  }
+
+  void ProfileEndArgArray(const TagArg* i_args, uint32_t i_argCount)
+  {
+    if (!g_enabled)
+    {
+      return;
+    }
+    AddRecord(TagType::End, 0, nullptr, 0, i_args, std::min(i_argCount, c_maxTagArgs));
+  }
+
+  void ProfileTask(TagType i_type, uint32_t i_tagID, uint64_t i_taskID)
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    // The resume is recorded in the task's context, the suspend / end before the thread's context is restored
+    if (i_type == TagType::TaskResume)
+    {
+      UpdateTaskContext(i_type, i_taskID);
+    }
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+    if (g_enabled)
+    {
+      AddRecord(i_type, i_tagID, nullptr, (int32_t)(uint32_t)(i_taskID ^ (i_taskID >> 32)));
+    }
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    if (i_type != TagType::TaskResume)
+    {
+      UpdateTaskContext(i_type, i_taskID);
+    }
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  }
+
+  void SetRequestSampleRate(uint32_t i_oneIn)
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    g_requestSampleRate = i_oneIn;
+#else
+    (void)i_oneIn;
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  }
+
+  TraceContext BeginRequest(uint64_t i_requestID)
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    TraceContext previous = t_traceContext;
+    t_traceContext.m_requestID = (i_requestID != 0) ? i_requestID : ++g_requestCounter;
+    t_traceContext.m_sampled = IsRequestSampled(t_traceContext.m_requestID, g_requestSampleRate.load(std::memory_order_relaxed));
+    return previous;
+#else
+    (void)i_requestID;
+    return TraceContext();
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  }
+
+  TraceContext GetTraceContext()
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    return t_traceContext;
+#else
+    return TraceContext();
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  }
+
+  void SetTraceContext(const TraceContext& i_context)
+  {
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    t_traceContext = i_context;
+#else
+    (void)i_context;
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+  }
+
+  void ProfileTag(TagType i_type, const char* i_str, bool i_copyStr, int32_t i_value)
+  {
+    if (!g_enabled)
+    {
+      return;
+    }
+
+    if (i_str == nullptr)
+    {
+      AddRecord(i_type, c_unknownTagID, nullptr, i_value);
+    }
+    else if (i_copyStr)
+    {
+      AddRecord(i_type, c_unknownTagID, i_str, i_value);
+    }
+    else
+    {
+      // Use the string address as the tag (copy the string if out of address slots)
+      bool inserted = false;
+      uint32_t addressIndex = GetAddressTagIndex(i_str, inserted);
+      if (addressIndex != UINT32_MAX)
+      {
+        if (inserted)
+        {
+          g_addressTags[addressIndex].m_state = c_addressStateString;
+#ifdef TAREN_PROFILER_MAPPED_FILE
+          MapAddressTag(addressIndex);
+#endif // TAREN_PROFILER_MAPPED_FILE
+        }
+        AddRecord(i_type, addressIndex | c_addressTagFlag, nullptr, i_value);
+      }
+      else
+      {
+        AddRecord(i_type, c_unknownTagID, i_str, i_value);
+      }
+    }
+  }
+
+  bool IsProfiling()
+  {
+    return g_enabled;
+  }
+
+  bool BeginLocked()
+  {
+    // Clear all data (may have been some extra in buffers from previous enable)
+    ResetBuffer(g_buffers[0]);
+    ResetBuffer(g_buffers[1]);
+    g_activeBuffer = 0;
+    g_jsonState = JsonState();
+    ResetLocks();
+    ResetIO();
+#ifdef TAREN_PROFILER_HISTOGRAMS
+    ResetHistograms();
+#endif // TAREN_PROFILER_HISTOGRAMS
+#ifdef TAREN_PROFILER_SLOWEST
+    ResetSlowest();
+#endif // TAREN_PROFILER_SLOWEST
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+    ResetTaskContexts();
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+    g_startTime = clock::now();
+    g_startMonotonicNS = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    g_startSystemNS = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+#ifdef TAREN_PROFILER_SAMPLING
+    StartSampling();
+#endif // TAREN_PROFILER_SAMPLING
+#ifdef TAREN_PROFILER_GAUGES
+    StartGauges();
+#endif // TAREN_PROFILER_GAUGES
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    MappedFileHeader* header = g_mappedHeader;
+    if (header != nullptr)
+    {
+      header->m_startTime = g_startTime.time_since_epoch().count();
+      header->m_activeBuffer = 0;
+    }
+#endif // TAREN_PROFILER_MAPPED_FILE
+    g_enabled = true;
+    return true;
+  }
+
+  bool Begin()
+  {
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (g_enabled)
+    {
+      return false;
+    }
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    // A previous mapped file capture is only unmapped here, as a stale tag call may still have been writing to it at End()
+    UnmapFile();
+#endif // TAREN_PROFILER_MAPPED_FILE
+    return BeginLocked();
+  }
+
+  bool BeginMappedFile(const char* i_fileName)
   {
-    size_t startPos = 0;
-    while ((startPos = io_str.find_first_of("\\\"", startPos)) != std::string::npos)
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (g_enabled)
     {
-      io_str.insert(startPos, 1, '\\');
-      startPos += 2;
+      return false;
+    }
+    int file = open(i_fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+    {
+      return false;
+    }
+    bool mapped = MapFile(file);
+    close(file);
+    return mapped && BeginLocked();
+#else
+    (void)i_fileName;
+    return false;
+#endif // TAREN_PROFILER_MAPPED_FILE
+  }
+
+  bool BeginSharedMemory(const char* i_name)
+  {
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (g_enabled)
+    {
+      return false;
+    }
+    int file = shm_open(i_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (file < 0)
+    {
+      return false;
+    }
+    bool mapped = MapFile(file);
+    close(file);
+    if (!mapped)
+    {
+      shm_unlink(i_name);
+      return false;
+    }
+    g_sharedMemory = true;
+    g_sharedName = i_name;
+    InstallForkHandler();
+    return BeginLocked();
+#else
+    (void)i_name;
+    return false;
+#endif // TAREN_PROFILER_SHARED_MEMORY
+  }
+
+  bool AttachSharedMemory(const char* i_name)
+  {
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (g_enabled)
+    {
+      return false;
+    }
+    int file = shm_open(i_name, O_RDWR, 0);
+    if (file < 0)
+    {
+      return false;
+    }
+    struct stat fileStat = {};
+    void* mapping = MAP_FAILED;
+    if (fstat(file, &fileStat) == 0 &&
+        (size_t)fileStat.st_size >= sizeof(MappedFileHeader))
+    {
+      mapping = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+    close(file);
+    if (mapping == MAP_FAILED)
+    {
+      return false;
+    }
+
+    // The owner must be recording, and built with the same record layout and table sizes
+    MappedFileHeader* header = (MappedFileHeader*)mapping;
+    if (memcmp(header->m_magic, "TARENPF", 8) != 0 ||
+        header->m_version != c_mappedFileVersion ||
+        header->m_state != 1 ||
+        header->m_headerSize + header->m_bufferSize * 2 != (uint64_t)fileStat.st_size ||
+        header->m_bufferSize != sizeof(RecordBuffer) ||
+        header->m_recordSize != sizeof(ProfileRecord) ||
+        header->m_descriptorCount != TAREN_PROFILER_TAG_DESCRIPTOR_COUNT ||
+        header->m_addressTagCount != TAREN_PROFILER_ADDRESS_TAG_COUNT ||
+        header->m_processTableCount != c_mappedProcessCount)
+    {
+      munmap(mapping, (size_t)fileStat.st_size);
+      return false;
+    }
+
+    UnmapFile();
+    g_mappedSize = (size_t)fileStat.st_size;
+    g_buffers = (RecordBuffer*)((char*)mapping + header->m_headerSize);
+    g_mappedHeader = header;
+    g_sharedMemory = true;
+    g_sharedName.clear();
+    if (!ClaimProcessSlot(*header))
+    {
+      UnmapFile();
+      return false;
     }
+    InstallForkHandler();
+    g_activeBuffer = 0;
+    g_enabled = true;
+    return true;
+#else
+    (void)i_name;
+    return false;
+#endif // TAREN_PROFILER_SHARED_MEMORY
   }
 
   bool End(std::ostream& o_outStream)
   {
+    EndRotation();
+    EndStream();
+
+    std::lock_guard<std::mutex> lock(g_controlMutex);
     if (!g_enabled)
     {
       return false;
     }
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    // An attached worker process only stops recording, the owner process writes the trace
+    if (g_processIndex != 0)
+    {
+      g_enabled = false;
+      return false;
+    }
+#endif // TAREN_PROFILER_SHARED_MEMORY
     g_enabled = false;
+#ifdef TAREN_PROFILER_SAMPLING
+    StopSampling();
+#endif // TAREN_PROFILER_SAMPLING
+#ifdef TAREN_PROFILER_GAUGES
+    StopGauges();
+#endif // TAREN_PROFILER_GAUGES
 
-    struct Tags
+    // Wait for any snapshot to finish writing
+    if (g_writeThread.joinable())
     {
-      int32_t m_index = -1;            // The index of the thread
-      std::vector<const char*> m_tags; // The tag stack
-    };
+      g_writeThread.join();
+    }
+
+    RecordBuffer& buffer = g_buffers[g_activeBuffer];
+    uint32_t recordCount = CloseBuffer(buffer);
+#ifdef TAREN_PROFILER_MAPPED_FILE
+    MappedFileHeader* header = g_mappedHeader;
+    if (header != nullptr)
+    {
+      header->m_state = 2;
+      msync(header, g_mappedSize, MS_ASYNC);
+    }
+#endif // TAREN_PROFILER_MAPPED_FILE
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    // Workers can no longer attach, the mapping stays valid until the next Begin()
+    if (!g_sharedName.empty())
+    {
+      shm_unlink(g_sharedName.c_str());
+      g_sharedName.clear();
+    }
+#endif // TAREN_PROFILER_SHARED_MEMORY
 
-    // Init this thread as the primary thread
-    std::unordered_map<std::thread::id, Tags> threadStack;
-    threadStack[std::this_thread::get_id()].m_index = 0;
+    InitJsonState(g_jsonState);
+    WriteJson(g_jsonState, buffer, recordCount, true, o_outStream);
+    return true;
+  }
 
-    int32_t threadCounter = 1;
+  bool End(std::string& o_outString)
+  {
+    std::ostringstream ss;
+    bool retval = End(ss);
+    o_outString = ss.str();
+    return retval;
+  }
 
-    std::string cleanTag;
-    o_outStream << "{\"traceEvents\":[\n";
+  bool EndFileJson(const char* i_fileName, bool i_appendDateExtension)
+  {
+    std::ofstream file;
+    if (!OpenJsonFile(file, i_fileName, i_appendDateExtension, false))
+    {
+      return false;
+    }
+    return End(file);
+  }
 
-    // Flag that records should no longer be written by setting the slot count to TAREN_PROFILER_TAG_COUNT
-    uint32_t slotCount = g_slotCount;
-    do
+  bool Snapshot(const char* i_fileName, bool i_appendDateExtension)
+  {
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (!g_enabled)
     {
-      // Check if already at the limit (can exceed the limit for a short duration)
-      if (slotCount >= TAREN_PROFILER_TAG_MAX_COUNT)
-      {
-        slotCount = TAREN_PROFILER_TAG_MAX_COUNT;
-        break;
-      }
+      return false;
+    }
+#ifdef TAREN_PROFILER_STREAMING
+    // The stream thread swaps the buffers
+    if (g_streaming)
+    {
+      return false;
+    }
+#endif // TAREN_PROFILER_STREAMING
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    // Worker processes do not see a buffer swap
+    if (g_sharedMemory)
+    {
+      return false;
+    }
+#endif // TAREN_PROFILER_SHARED_MEMORY
 
-    } while (!g_slotCount.compare_exchange_weak(slotCount, (uint32_t)TAREN_PROFILER_TAG_MAX_COUNT));
+    std::ofstream file;
+    if (!OpenJsonFile(file, i_fileName, i_appendDateExtension, true))
+    {
+      return false;
+    }
 
-    // Wait for all threads to finish writing tags
-    uint32_t recordCount = g_recordCount;
-    while (recordCount != slotCount)
+    // Wait for the previous snapshot to finish writing before the buffer is reused
+    if (g_writeThread.joinable())
     {
-      std::this_thread::yield();
-      recordCount = g_recordCount;
+      g_writeThread.join();
     }
 
-    for (size_t i = 0; i < recordCount; i++)
+    uint32_t retiredIndex = 0;
+    uint32_t recordCount = SwapBuffers(retiredIndex);
+
+    InitJsonState(g_jsonState);
+    g_writeThread = std::thread([retiredIndex, recordCount](std::ofstream outFile)
     {
-      const ProfileRecord& entry = g_records[i];
+      WriteJson(g_jsonState, g_buffers[retiredIndex], recordCount, false, outFile);
+    }, std::move(file));
+    return true;
+  }
 
-      // Assign a unique index to each thread
-      Tags& stack = threadStack[entry.m_threadID];
-      if (stack.m_index < 0)
-      {
-        stack.m_index = threadCounter;
-        threadCounter++;
-      }
+  bool BeginRotation(const char* i_fileName, uint32_t i_periodMS)
+  {
+    std::lock_guard<std::mutex> joinLock(g_rotationJoinMutex);
+    std::lock_guard<std::mutex> lock(g_rotationMutex);
+    if (!g_enabled || g_rotationThread.joinable())
+    {
+      return false;
+    }
 
-      // Get the name tags
-      const char* tag = entry.m_tag;
-      if (tag == nullptr)
-      {
-        tag = "Unknown";
-      }
-      const char* typeTag = "B";
-      if (entry.m_type == TagType::Begin)
+    g_rotationStop = false;
+    g_rotationThread = std::thread([fileName = std::string(i_fileName), i_periodMS]()
+    {
+      std::unique_lock<std::mutex> lock(g_rotationMutex);
+      while (!g_rotationCondition.wait_for(lock, std::chrono::milliseconds(i_periodMS), [] { return g_rotationStop; }))
       {
-        stack.m_tags.push_back(tag);
+        Snapshot(fileName.c_str());
       }
-      else if (entry.m_type == TagType::End)
+    });
+    return true;
+  }
+
+  void EndRotation()
+  {
+    // A concurrent call waits for the thread to be joined
+    std::lock_guard<std::mutex> joinLock(g_rotationJoinMutex);
+    {
+      std::lock_guard<std::mutex> lock(g_rotationMutex);
+      if (!g_rotationThread.joinable())
       {
-        typeTag = "E";
-        if (stack.m_tags.size() > 0)
-        {
-          tag = stack.m_tags.back();
-          stack.m_tags.pop_back();
-        }
+        return;
       }
-      else if (entry.m_type == TagType::Value)
+      g_rotationStop = true;
+    }
+    g_rotationCondition.notify_all();
+    g_rotationThread.join();
+  }
+
+  bool BeginStream(const char* i_socketPath, uint32_t i_periodMS)
+  {
+#ifdef TAREN_PROFILER_STREAMING
+    std::lock_guard<std::mutex> joinLock(g_streamJoinMutex);
+    std::lock_guard<std::mutex> lock(g_streamMutex);
+    if (g_streamThread.joinable() && !g_streaming)
+    {
+      g_streamThread.join(); // The receiver disconnected
+    }
+    if (!g_enabled || g_streamThread.joinable())
+    {
+      return false;
+    }
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+    // Worker processes do not see a buffer swap
+    if (g_sharedMemory)
+    {
+      return false;
+    }
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(i_socketPath) >= sizeof(address.sun_path))
+    {
+      return false;
+    }
+    strcpy(address.sun_path, i_socketPath);
+    int streamSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (streamSocket < 0)
+    {
+      return false;
+    }
+    timeval sendTimeout = { 1, 0 };
+    setsockopt(streamSocket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+    if (connect(streamSocket, (const sockaddr*)&address, sizeof(address)) != 0)
+    {
+      close(streamSocket);
+      return false;
+    }
+
+    g_streamState = StreamState();
+    g_streamState.m_socket = streamSocket;
+    g_streamState.m_sentAddresses.resize(TAREN_PROFILER_ADDRESS_TAG_COUNT);
+
+    StreamHello hello = {};
+    memcpy(hello.m_magic, "TARENST", 8);
+    hello.m_version = c_streamVersion;
+    hello.m_processID = (int32_t)getpid();
+    hello.m_startTime = g_startTime.time_since_epoch().count();
+    hello.m_clockNum = clock::period::num;
+    hello.m_clockDen = clock::period::den;
+    hello.m_monotonicStartNS = g_startMonotonicNS;
+    if (!SendStreamMessage(g_streamState, StreamMessage::Hello, &hello, sizeof(hello)))
+    {
+      close(streamSocket);
+      return false;
+    }
+
+    g_streaming = true;
+    g_streamStop = false;
+    g_streamThread = std::thread([i_periodMS]()
+    {
+      std::unique_lock<std::mutex> lock(g_streamMutex);
+      bool connected = true;
+      while (connected &&
+             !g_streamCondition.wait_for(lock, std::chrono::milliseconds(i_periodMS), [] { return g_streamStop; }))
       {
-        typeTag = "O";
+        connected = StreamBuffer(g_streamState);
       }
 
-      // Markup invalid json characters
-      if (strchr(tag, '"') != nullptr ||
-          strchr(tag, '\\') != nullptr)
+      // Send the records up to the stop
+      if (connected)
       {
-        cleanTag = tag;
-        CleanJsonStr(cleanTag);
-        tag = cleanTag.c_str();
+        StreamBuffer(g_streamState);
       }
+      close(g_streamState.m_socket);
+      g_streamState = StreamState();
+      g_streaming = false;
+    });
+    return true;
+#else
+    (void)i_socketPath;
+    (void)i_periodMS;
+    return false;
+#endif // TAREN_PROFILER_STREAMING
+  }
 
-      // Get the microsecond count
-      long long msCount = std::chrono::duration_cast<std::chrono::microseconds>(entry.m_time - g_startTime).count();
-
-      if (i != 0)
+  void EndStream()
+  {
+#ifdef TAREN_PROFILER_STREAMING
+    // A concurrent call waits for the thread to be joined
+    std::lock_guard<std::mutex> joinLock(g_streamJoinMutex);
+    {
+      std::lock_guard<std::mutex> lock(g_streamMutex);
+      if (!g_streamThread.joinable())
       {
-        o_outStream << ",\n";
+        return;
       }
+      g_streamStop = true;
+    }
+    g_streamCondition.notify_all();
+    g_streamThread.join();
+#endif // TAREN_PROFILER_STREAMING
+  }
+
+  bool BeginControl(const char* i_fileName, uint32_t i_durationMS, const char* i_controlFile, bool i_useSignals)
+  {
+#ifdef TAREN_PROFILER_CONTROL
+    std::lock_guard<std::mutex> joinLock(g_controllerJoinMutex);
+    std::lock_guard<std::mutex> lock(g_controllerMutex);
+    if (g_controllerThread.joinable() || i_fileName == nullptr)
+    {
+      return false;
+    }
 
-      // Format the string (Note using process ID for threads as that gives a better formatting in the output tool for value tags)
-      o_outStream <<
-        "{\"name\":\"" << tag << "\",\"ph\":\"" << typeTag << "\",\"ts\":" << msCount << ",\"pid\":" << stack.m_index << ",\"cat\":\"\",\"tid\":0,";
-        
-      if (entry.m_type == TagType::Value)
+    g_controlRequests = 0;
+    g_controllerSignals = false;
+    if (i_useSignals)
+    {
+      struct sigaction action = {};
+      action.sa_handler = ControlSignalHandler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      if (sigaction(SIGUSR1, &action, &g_previousStartAction) != 0)
       {
-        o_outStream << "\"id\":\"" << tag << "\", \"args\":{\"snapshot\":{\"Value\": " << entry.m_value << "}}}";
+        return false;
       }
-      else
+      if (sigaction(SIGUSR2, &action, &g_previousStopAction) != 0)
       {
-        o_outStream << "\"args\":{}}";
+        sigaction(SIGUSR1, &g_previousStartAction, nullptr);
+        return false;
       }
+      g_controllerSignals = true;
     }
 
-    // Write thread "names"
-    if (recordCount > 0)
+    g_controllerStop = false;
+    g_controllerThread = std::thread(RunController, std::string(i_fileName), i_durationMS, std::string((i_controlFile != nullptr) ? i_controlFile : ""));
+    return true;
+#else
+    (void)i_fileName;
+    (void)i_durationMS;
+    (void)i_controlFile;
+    (void)i_useSignals;
+    return false;
+#endif // TAREN_PROFILER_CONTROL
+  }
+
+  void EndControl()
+  {
+#ifdef TAREN_PROFILER_CONTROL
+    // A concurrent call waits for the thread to be joined
+    std::lock_guard<std::mutex> joinLock(g_controllerJoinMutex);
     {
-      for (auto& t : threadStack)
+      std::lock_guard<std::mutex> lock(g_controllerMutex);
+      if (!g_controllerThread.joinable())
       {
-        // Sort thread listing by the time that they appear in the profile (tool sorts by name)
-        char indexSpaceString[64];
-        std::snprintf(indexSpaceString, sizeof(indexSpaceString), "%02d", t.second.m_index);
+        return;
+      }
+      g_controllerStop = true;
+    }
+    g_controllerCondition.notify_all();
+    g_controllerThread.join();
 
-        // Ensure a clean json string (undefined what thread::id is)
-        std::ostringstream ss;
-        ss << t.first;
-        std::string threadName = ss.str();
-        CleanJsonStr(threadName);
+    if (g_controllerSignals)
+    {
+      sigaction(SIGUSR1, &g_previousStartAction, nullptr);
+      sigaction(SIGUSR2, &g_previousStopAction, nullptr);
+      g_controllerSignals = false;
+    }
+#endif // TAREN_PROFILER_CONTROL
+  }
 
-        o_outStream << // (Note using process ID for threads as that gives a better formatting in the output tool for value tags)
-          ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":0,\"pid\":" << t.second.m_index <<
-          ",\"args\":{\"name\":\"Thread" << indexSpaceString << "_" << threadName << "\"}}";
-      }
+  bool WriteMetrics(std::ostream& o_outStream, uint32_t i_windowMS)
+  {
+    if (!g_enabled)
+    {
+      return false;
     }
 
-    o_outStream << "\n]\n}\n";
+    std::vector<TagStats> stats(TAREN_PROFILER_METRICS_TAG_COUNT);
+    uint32_t count = QueryStats(stats.data(), (uint32_t)stats.size(), i_windowMS);
+    WriteMetricsStats(o_outStream, stats.data(), count);
     return true;
   }
 
-  bool End(std::string& o_outString)
+  bool WriteMetrics(std::string& o_outString, uint32_t i_windowMS)
   {
     std::ostringstream ss;
-    bool retval = End(ss);
+    bool retval = WriteMetrics(ss, i_windowMS);
     o_outString = ss.str();
     return retval;
   }
 
-  bool EndFileJson(const char* i_fileName, bool i_appendDateExtension)
+  bool WriteMetricsFile(const char* i_fileName, uint32_t i_windowMS)
   {
-    std::ofstream file;
-    if (i_appendDateExtension)
+    std::string tempFileName = std::string(i_fileName) + ".tmp";
+    std::ofstream file(tempFileName, std::ios::binary);
+    if (!file.is_open())
     {
-      // Create a filename with the current date in it with extension
-      std::time_t t = std::time(nullptr);
-      tm timeBuf;
-      localtime_s(&timeBuf, &t);
-      char extStr[120];
-      if (std::strftime(extStr, sizeof(extStr), "_%Y%m%d-%H%M%S.json", &timeBuf) == 0)
+      return false;
+    }
+    bool written = WriteMetrics(file, i_windowMS);
+    file.close();
+    if (!written)
+    {
+      std::remove(tempFileName.c_str());
+      return false;
+    }
+
+#ifdef _WIN32
+    std::remove(i_fileName); // Rename does not replace on Windows
+#endif // _WIN32
+    return std::rename(tempFileName.c_str(), i_fileName) == 0;
+  }
+
+  uint32_t QueryStats(TagStats* o_stats, uint32_t i_maxStats, uint32_t i_windowMS)
+  {
+    // Lock so the buffers are not swapped or reset while reading
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    if (!g_enabled || i_maxStats == 0)
+    {
+      return 0;
+    }
+
+    for (uint32_t i = 0; i < i_maxStats; i++)
+    {
+      o_stats[i] = TagStats();
+    }
+    for (QueryThread& thread : g_queryThreads)
+    {
+      thread.m_threadID = std::thread::id();
+      thread.m_depth = 0;
+    }
+
+    clock::time_point windowStart = (i_windowMS > 0) ? clock::now() - std::chrono::milliseconds(i_windowMS) : clock::time_point::min();
+
+    // Read the completed retired buffer from the last snapshot, then the records completed so far in the active buffer
+    uint32_t activeIndex = g_activeBuffer;
+    const RecordBuffer& retiredBuffer = g_buffers[activeIndex ^ 1];
+    const RecordBuffer& activeBuffer = g_buffers[activeIndex];
+    AddStats(o_stats, i_maxStats, retiredBuffer, retiredBuffer.m_recordCount, false, windowStart);
+    AddStats(o_stats, i_maxStats, activeBuffer, (uint32_t)std::min<uint64_t>(activeBuffer.m_slotCount, TAREN_PROFILER_TAG_MAX_COUNT), true, windowStart);
+
+    // Move the used entries to the start and sort by total time
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < i_maxStats; i++)
+    {
+      if (o_stats[i].m_count > 0)
       {
-        return false;
+        if (count != i)
+        {
+          o_stats[count] = o_stats[i];
+        }
+        TagStats& stats = o_stats[count++];
+        stats.m_p50NS = GetStatsPercentile(stats, 0.5);
+        stats.m_p90NS = GetStatsPercentile(stats, 0.9);
+        stats.m_p99NS = GetStatsPercentile(stats, 0.99);
       }
+    }
+    std::sort(o_stats, o_stats + count, [](const TagStats& a, const TagStats& b) { return a.m_totalNS > b.m_totalNS; });
+    return count;
+  }
 
-      file.open(std::string(i_fileName) + extStr);
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+  bool InstrumentExclude(const char* i_namePrefix)
+  {
+    uint32_t index = g_instrumentExcludeCount;
+    if (index >= TAREN_PROFILER_INSTRUMENT_EXCLUDE_COUNT)
+    {
+      return false;
     }
-    else
+    g_instrumentExcludes[index] = i_namePrefix;
+    g_instrumentExcludeCount = index + 1;
+    return true;
+  }
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
+}
+
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+extern "C"
+{
+  __attribute__((no_instrument_function))
+  void __cyg_profile_func_enter(void* i_function, void* /*i_callSite*/)
+  {
+    uint32_t depth = ++t_instrumentDepth;
+    if (depth > TAREN_PROFILER_INSTRUMENT_MAX_DEPTH)
     {
-      file.open(i_fileName);
+      return;
     }
 
-    if (!file.is_open())
+    bool recorded = false;
+    if (g_enabled && !t_instrumentActive)
     {
-      return false;
+      t_instrumentActive = true;
+      bool inserted = false;
+      uint32_t addressIndex = GetAddressTagIndex(i_function, inserted);
+#ifdef TAREN_PROFILER_MAPPED_FILE
+      if (inserted)
+      {
+        MapAddressTag(addressIndex);
+      }
+#endif // TAREN_PROFILER_MAPPED_FILE
+      if (addressIndex != UINT32_MAX &&
+          !IsExcludedFunction(i_function, addressIndex, inserted))
+      {
+        AddRecord(taren_profiler::TagType::FunctionBegin, addressIndex | c_addressTagFlag, nullptr, 0);
+        recorded = true;
+      }
+      t_instrumentActive = false;
     }
-    return End(file);
+    t_instrumentRecorded[depth] = recorded;
   }
 
+  __attribute__((no_instrument_function))
+  void __cyg_profile_func_exit(void* /*i_function*/, void* /*i_callSite*/)
+  {
+    uint32_t depth = t_instrumentDepth--;
+    if (depth <= TAREN_PROFILER_INSTRUMENT_MAX_DEPTH &&
+        t_instrumentRecorded[depth] && 
+        !t_instrumentActive)
+    {
+      t_instrumentActive = true;
+      AddRecord(taren_profiler::TagType::End, c_unknownTagID, nullptr, 0);
+      t_instrumentActive = false;
+    }
+  }
 }
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
 
 #endif // TAREN_PROFILER_IMPLEMENTATION
 
@@ -0,0 +1,204 @@
+///  ProfilerIO.h - Thin POSIX I/O wrappers that report each call and per file descriptor stats to the profiler (see Profiler.h)
+///
+///    eg. int fd = taren_profiler::io::open("data.bin", O_RDONLY);
+///        ssize_t readSize = taren_profiler::io::pread(fd, buffer, sizeof(buffer), offset);
+///        taren_profiler::io::fsync(fd);
+///        taren_profiler::io::close(fd);
+///
+///    Each call is recorded as a scope named after the call (category "io"), with the fd and the requested bytes as begin
+///    args and the result (bytes transferred, or -1 on error) as an end arg. errno is preserved.
+///    The json also contains an "io" array with the count, bytes, time and throughput of the reads, writes and syncs of each
+///    file descriptor, named with the path passed to io::open(). A reused fd number keeps its stats under the latest path.
+///
+///    If TAREN_PROFILE_ENABLE is not defined, the wrappers are just the system calls.
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef TAREN_PROFILE_ENABLE
+
+#include "Profiler.h"
+#include <chrono>
+#include <cerrno>
+
+namespace taren_profiler
+{
+  namespace io
+  {
+    class IOScope
+    {
+    public:
+
+      /// \brief Constructor, sets the begin tag of the call
+      /// \param i_type The type of the call
+      /// \param i_tagID The tag id of the call
+      /// \param i_fd The file descriptor (-1 if not known yet)
+      /// \param i_bytes The requested bytes (-1 if not a read / write)
+      IOScope(IOType i_type, uint32_t i_tagID, int i_fd, int64_t i_bytes) : m_type(i_type), m_fd(i_fd)
+      {
+        if (i_fd < 0)
+        {
+          ProfileTagID(TagType::Begin, i_tagID);
+        }
+        else
+        {
+          TagArg args[2] = { TagArg("fd", i_fd), TagArg("bytes", i_bytes) };
+          ProfileTagArgArray(i_tagID, args, (i_bytes < 0) ? 1 : 2);
+        }
+        m_startTime = clock::now();
+      }
+
+      IOScope(const IOScope&) = delete;
+      IOScope& operator=(const IOScope&) = delete;
+
+      /// \brief Sets the end tag of the call and records the stats
+      /// \param i_result The result of the call
+      /// \param i_fd The file descriptor, if it was not known at the start of the call
+      /// \return Returns i_result
+      template <typename R>
+      R End(R i_result, int i_fd = -1)
+      {
+        int error = errno;
+        uint64_t latencyNS = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_startTime).count();
+        TagArg arg("result", (int64_t)i_result);
+        ProfileEndArgArray(&arg, 1);
+        ProfileIO(m_type, (m_fd < 0) ? i_fd : m_fd, (int64_t)i_result, latencyNS);
+        errno = error;
+        return i_result;
+      }
+
+    private:
+
+      using clock = std::chrono::high_resolution_clock;
+
+      IOType m_type;                 // The type of the call
+      int m_fd;                      // The file descriptor
+      clock::time_point m_startTime; // The start time of the call
+    };
+
+    inline int open(const char* i_path, int i_flags, mode_t i_mode = 0)
+    {
+      int fd = -1;
+      if (!IsProfiling())
+      {
+        fd = ::open(i_path, i_flags, i_mode);
+      }
+      else
+      {
+        static const uint32_t s_tagID = RegisterTag("open", __FILE__, __LINE__, "io");
+        IOScope scope(IOType::Other, s_tagID, -1, -1);
+        fd = ::open(i_path, i_flags, i_mode);
+        scope.End(fd, fd);
+      }
+      if (fd >= 0)
+      {
+        int error = errno;
+        SetIOPath(fd, i_path);
+        errno = error;
+      }
+      return fd;
+    }
+
+    inline int close(int i_fd)
+    {
+      if (!IsProfiling())
+      {
+        return ::close(i_fd);
+      }
+      static const uint32_t s_tagID = RegisterTag("close", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Other, s_tagID, i_fd, -1);
+      return scope.End(::close(i_fd));
+    }
+
+    inline ssize_t read(int i_fd, void* o_buffer, size_t i_count)
+    {
+      if (!IsProfiling())
+      {
+        return ::read(i_fd, o_buffer, i_count);
+      }
+      static const uint32_t s_tagID = RegisterTag("read", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Read, s_tagID, i_fd, (int64_t)i_count);
+      return scope.End(::read(i_fd, o_buffer, i_count));
+    }
+
+    inline ssize_t write(int i_fd, const void* i_buffer, size_t i_count)
+    {
+      if (!IsProfiling())
+      {
+        return ::write(i_fd, i_buffer, i_count);
+      }
+      static const uint32_t s_tagID = RegisterTag("write", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Write, s_tagID, i_fd, (int64_t)i_count);
+      return scope.End(::write(i_fd, i_buffer, i_count));
+    }
+
+    inline ssize_t pread(int i_fd, void* o_buffer, size_t i_count, off_t i_offset)
+    {
+      if (!IsProfiling())
+      {
+        return ::pread(i_fd, o_buffer, i_count, i_offset);
+      }
+      static const uint32_t s_tagID = RegisterTag("pread", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Read, s_tagID, i_fd, (int64_t)i_count);
+      return scope.End(::pread(i_fd, o_buffer, i_count, i_offset));
+    }
+
+    inline ssize_t pwrite(int i_fd, const void* i_buffer, size_t i_count, off_t i_offset)
+    {
+      if (!IsProfiling())
+      {
+        return ::pwrite(i_fd, i_buffer, i_count, i_offset);
+      }
+      static const uint32_t s_tagID = RegisterTag("pwrite", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Write, s_tagID, i_fd, (int64_t)i_count);
+      return scope.End(::pwrite(i_fd, i_buffer, i_count, i_offset));
+    }
+
+    inline int fsync(int i_fd)
+    {
+      if (!IsProfiling())
+      {
+        return ::fsync(i_fd);
+      }
+      static const uint32_t s_tagID = RegisterTag("fsync", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Sync, s_tagID, i_fd, -1);
+      return scope.End(::fsync(i_fd));
+    }
+
+#ifdef __linux__
+    inline int fdatasync(int i_fd)
+    {
+      if (!IsProfiling())
+      {
+        return ::fdatasync(i_fd);
+      }
+      static const uint32_t s_tagID = RegisterTag("fdatasync", __FILE__, __LINE__, "io");
+      IOScope scope(IOType::Sync, s_tagID, i_fd, -1);
+      return scope.End(::fdatasync(i_fd));
+    }
+#endif // __linux__
+  }
+}
+
+#else // !TAREN_PROFILE_ENABLE
+
+namespace taren_profiler
+{
+  namespace io
+  {
+    inline int open(const char* i_path, int i_flags, mode_t i_mode = 0) { return ::open(i_path, i_flags, i_mode); }
+    using ::close;
+    using ::read;
+    using ::write;
+    using ::pread;
+    using ::pwrite;
+    using ::fsync;
+#ifdef __linux__
+    using ::fdatasync;
+#endif // __linux__
+  }
+}
+
+#endif // !TAREN_PROFILE_ENABLE
@@ -0,0 +1,171 @@
+///  ProfilerMutex.h - Drop-in mutex wrappers that report lock contention to the profiler (see Profiler.h)
+///
+///    eg. taren_profiler::ProfiledMutex g_queueMutex("QueueMutex");
+///        std::lock_guard<taren_profiler::ProfiledMutex> lock(g_queueMutex);
+///
+///        taren_profiler::ProfiledSharedMutex g_cacheMutex("CacheMutex");
+///        std::shared_lock<taren_profiler::ProfiledSharedMutex> lock(g_cacheMutex);
+///
+///    When a lock is not immediately available, the time waiting for it is recorded as a scope named after the lock
+///    (category "lock"), so the trace shows which lock is serializing threads.
+///    The json also contains a "locks" array with the acquire count, contended count, total / max wait time and
+///    total / max hold time of each lock name. Hold time is only tracked for exclusive locks. Locks with the same name share stats.
+///
+///    If TAREN_PROFILE_ENABLE is not defined, the wrappers are just the standard mutex types.
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+
+#ifdef TAREN_PROFILE_ENABLE
+
+#include "Profiler.h"
+#include <chrono>
+
+namespace taren_profiler
+{
+  template <typename T>
+  class ProfiledMutexBase
+  {
+  public:
+
+    /// \brief Constructor
+    /// \param i_name The lock name, must be a literal string
+    explicit ProfiledMutexBase(const char* i_name = "Mutex") : m_lockID(RegisterLock(i_name)) {}
+
+    ProfiledMutexBase(const ProfiledMutexBase&) = delete;
+    ProfiledMutexBase& operator=(const ProfiledMutexBase&) = delete;
+
+    void lock()
+    {
+      if (!IsProfiling())
+      {
+        m_mutex.lock();
+        m_acquireTime = clock::time_point();
+        return;
+      }
+
+      // Only record a wait scope if the lock is contended
+      if (m_mutex.try_lock())
+      {
+        m_acquireTime = clock::now();
+        ProfileLockAcquire(m_lockID, 0, false, false);
+        return;
+      }
+
+      clock::time_point startTime = clock::now();
+      ProfileTagID(TagType::Begin, GetLockWaitTagID(m_lockID));
+      m_mutex.lock();
+      ProfileTagID(TagType::End, 0);
+      m_acquireTime = clock::now();
+      ProfileLockAcquire(m_lockID, GetNS(m_acquireTime - startTime), true, false);
+    }
+
+    bool try_lock()
+    {
+      if (!m_mutex.try_lock())
+      {
+        return false;
+      }
+      m_acquireTime = clock::time_point();
+      if (IsProfiling())
+      {
+        m_acquireTime = clock::now();
+        ProfileLockAcquire(m_lockID, 0, false, false);
+      }
+      return true;
+    }
+
+    void unlock()
+    {
+      clock::time_point acquireTime = m_acquireTime;
+      m_mutex.unlock();
+      if (acquireTime != clock::time_point())
+      {
+        ProfileLockRelease(m_lockID, GetNS(clock::now() - acquireTime));
+      }
+    }
+
+  protected:
+
+    using clock = std::chrono::high_resolution_clock;
+
+    static uint64_t GetNS(clock::duration i_duration)
+    {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(i_duration).count();
+    }
+
+    T m_mutex;                       // The wrapped mutex
+    uint32_t m_lockID;               // The registered lock id
+    clock::time_point m_acquireTime; // The time the exclusive lock was acquired (only accessed by the owner)
+  };
+
+  /// \brief Drop-in replacement for std::mutex that reports contention
+  using ProfiledMutex = ProfiledMutexBase<std::mutex>;
+
+  /// \brief Drop-in replacement for std::shared_mutex that reports contention
+  class ProfiledSharedMutex : public ProfiledMutexBase<std::shared_mutex>
+  {
+  public:
+
+    using ProfiledMutexBase<std::shared_mutex>::ProfiledMutexBase;
+
+    void lock_shared()
+    {
+      if (!IsProfiling())
+      {
+        m_mutex.lock_shared();
+        return;
+      }
+
+      if (m_mutex.try_lock_shared())
+      {
+        ProfileLockAcquire(m_lockID, 0, false, true);
+        return;
+      }
+
+      clock::time_point startTime = clock::now();
+      ProfileTagID(TagType::Begin, GetLockWaitTagID(m_lockID));
+      m_mutex.lock_shared();
+      ProfileTagID(TagType::End, 0);
+      ProfileLockAcquire(m_lockID, GetNS(clock::now() - startTime), true, true);
+    }
+
+    bool try_lock_shared()
+    {
+      if (!m_mutex.try_lock_shared())
+      {
+        return false;
+      }
+      if (IsProfiling())
+      {
+        ProfileLockAcquire(m_lockID, 0, false, true);
+      }
+      return true;
+    }
+
+    void unlock_shared()
+    {
+      m_mutex.unlock_shared();
+    }
+  };
+}
+
+#else // !TAREN_PROFILE_ENABLE
+
+namespace taren_profiler
+{
+  class ProfiledMutex : public std::mutex
+  {
+  public:
+    explicit ProfiledMutex(const char* = nullptr) {}
+  };
+
+  class ProfiledSharedMutex : public std::shared_mutex
+  {
+  public:
+    explicit ProfiledSharedMutex(const char* = nullptr) {}
+  };
+}
+
+#endif // !TAREN_PROFILE_ENABLE
@@ -11,6 +11,7 @@
 bool Iterator_UnitTests();
 void Iterator_RunProfile();
 bool EnumMacro_UnitTests();
+bool Profiler_UnitTests();
 
 
 std::atomic_bool g_threadshutdown = false;
@@ -48,6 +49,7 @@ int main()
   EnumMacro_UnitTests();
   Iterator_UnitTests();
   Iterator_RunProfile();
+  Profiler_UnitTests();
 
 /*
   std::vector<std::thread> threads;
@@ -0,0 +1,1129 @@
+
+#include "../Profiler.h"
+#include "../ProfilerMutex.h"
+#ifndef _WIN32
+#include "../ProfilerIO.h"
+#endif
+#include "../EnumMacros.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#ifdef TAREN_PROFILE_ENABLE
+
+static std::string ReadFile(const char* i_fileName)
+{
+  std::ifstream file(i_fileName);
+  std::stringstream ss;
+  ss << file.rdbuf();
+  return ss.str();
+}
+
+static bool Contains(const std::string& i_str, const char* i_find)
+{
+  return i_str.find(i_find) != std::string::npos;
+}
+
+static bool BasicTests()
+{
+  std::string outString;
+  if (PROFILE_END(outString))
+  {
+    std::cout << "End without begin should fail\n";
+    return false;
+  }
+
+  PROFILE_BEGIN();
+  {
+    PROFILE_SCOPE("Outer");
+    PROFILE_SCOPE_COPY(std::string("Copy\"Tag").c_str());
+    PROFILE_TAG_VALUE("Value", 123);
+  }
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "{\"name\":\"Outer\",\"ph\":\"B\"") ||
+      !Contains(outString, "{\"name\":\"Outer\",\"ph\":\"E\"") ||
+      !Contains(outString, "{\"name\":\"Copy\\\"Tag\",\"ph\":\"E\"") ||
+      !Contains(outString, "{\"Value\": 123}") ||
+      !Contains(outString, "\"name\":\"thread_name\"") ||
+      !Contains(outString, "{\"otherData\":{\"pid\":") ||
+      !Contains(outString, ",\"monotonic_start_ns\":"))
+  {
+    std::cout << "Profile basic output failed\n";
+    return false;
+  }
+
+  // Check the aggregates of each scope
+  if (!Contains(outString, "\"aggregates\":[") ||
+      !Contains(outString, "{\"name\":\"Outer\",\"count\":1,") ||
+      !Contains(outString, "{\"name\":\"Copy\\\"Tag\",\"count\":1,"))
+  {
+    std::cout << "Profile aggregate output failed\n";
+    return false;
+  }
+
+#ifdef TAREN_PROFILER_PERF_COUNTERS
+  // Either hardware or software counters are written with the end of each scope
+  if (!Contains(outString, "\"cycles\":") &&
+      !Contains(outString, "\"task_clock_ns\":"))
+  {
+    std::cout << "Profile perf counter output failed\n";
+    return false;
+  }
+#endif // TAREN_PROFILER_PERF_COUNTERS
+
+#ifdef TAREN_PROFILER_RECORD_CPU
+  if (!Contains(outString, "\"migrations\":"))
+  {
+    std::cout << "Profile cpu migration output failed\n";
+    return false;
+  }
+#endif // TAREN_PROFILER_RECORD_CPU
+  return true;
+}
+
+static bool TagIDTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  for (int i = 0; i < 2; i++)
+  {
+    PROFILE_SCOPE_CATEGORY("Category", "TestCategory");
+  }
+  taren_profiler::ProfileTag(taren_profiler::TagType::Begin, "Legacy");
+  PROFILE_TAG_END();
+  PROFILE_END(outString);
+
+  // Each call site registers once, and keeps its category and source location
+  if (!Contains(outString, "{\"name\":\"Category\",\"ph\":\"B\"") ||
+      !Contains(outString, "\"cat\":\"TestCategory\"") ||
+      !Contains(outString, "{\"name\":\"Category\",\"count\":2,") ||
+      !Contains(outString, "Profiler_UnitTests.cpp\",\"line\":") ||
+      !Contains(outString, "{\"name\":\"Legacy\",\"count\":1,"))
+  {
+    std::cout << "Profile tag id output failed\n";
+    return false;
+  }
+  return true;
+}
+
+#define ProfilePhase_EnumValues(EV) \
+  EV(Parse) \
+  EV(Compile) \
+  EV(Link)
+
+SEQUENTIAL_ENUM(ProfilePhase, uint8_t)
+SEQUENTIAL_ENUM_BODY(ProfilePhase)
+
+static bool EnumTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  for (auto phase : ProfilePhase_Values())
+  {
+    PROFILE_SCOPE_ENUM(phase.value());
+  }
+  {
+    PROFILE_SCOPE_ENUM(ProfilePhase::Link);
+  }
+  PROFILE_END(outString);
+
+  // The enum type is registered once, so both call sites share the Link aggregate
+  if (!Contains(outString, "{\"name\":\"Parse\",\"ph\":\"B\"") ||
+      !Contains(outString, "{\"name\":\"Compile\",\"count\":1,") ||
+      !Contains(outString, "{\"name\":\"Link\",\"count\":2,"))
+  {
+    std::cout << "Profile enum tag output failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool ArgsTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  {
+    int64_t bytes = 5000000000;
+    PROFILE_SCOPE_ARGS("Upload", "bytes", bytes, "shard", 3, "ratio", 0.5, "mode", "a\"sync");
+  }
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "{\"name\":\"Upload\",\"ph\":\"B\"") ||
+      !Contains(outString, "\"args\":{\"bytes\":5000000000,\"shard\":3,\"ratio\":0.5,\"mode\":\"a\\\"sync\"}}") ||
+      !Contains(outString, "{\"name\":\"Upload\",\"count\":1,"))
+  {
+    std::cout << "Profile args output failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool SnapshotTests()
+{
+  const char* fileName = "Profiler_UnitTests_Snapshot.json";
+
+  if (PROFILE_SNAPSHOT(fileName, false))
+  {
+    std::cout << "Snapshot without begin should fail\n";
+    return false;
+  }
+
+  std::string outString;
+  PROFILE_BEGIN();
+  PROFILE_TAG_COPY_BEGIN(std::string("OpenTag").c_str());
+  PROFILE_TAG_VALUE("BeforeSnapshot", 1);
+  if (!PROFILE_SNAPSHOT(fileName, false))
+  {
+    std::cout << "Snapshot failed\n";
+    return false;
+  }
+  PROFILE_TAG_VALUE("AfterSnapshot", 2);
+  PROFILE_TAG_END();
+  PROFILE_END(outString);
+
+  std::string snapshotString = ReadFile(fileName);
+  std::remove(fileName);
+
+  // Snapshot has the records before the snapshot call
+  if (!Contains(snapshotString, "{\"name\":\"OpenTag\",\"ph\":\"B\"") ||
+      !Contains(snapshotString, "BeforeSnapshot") ||
+      Contains(snapshotString, "AfterSnapshot"))
+  {
+    std::cout << "Snapshot output failed\n";
+    return false;
+  }
+
+  // End has the re-opened tag and the records after the snapshot (with TAREN_PROFILER_SLOWEST, End only has the kept scopes)
+#ifndef TAREN_PROFILER_SLOWEST
+  if (!Contains(outString, "{\"name\":\"OpenTag\",\"ph\":\"B\"") ||
+      !Contains(outString, "{\"name\":\"OpenTag\",\"ph\":\"E\"") ||
+      !Contains(outString, "AfterSnapshot") ||
+      Contains(outString, "BeforeSnapshot"))
+  {
+    std::cout << "Snapshot end output failed\n";
+    return false;
+  }
+#endif // !TAREN_PROFILER_SLOWEST
+  return true;
+}
+
+static std::atomic_int g_overBudgetCount{ 0 };
+
+static void OnOverBudget(const char* i_name, uint64_t i_durationNS, uint64_t i_budgetNS)
+{
+  if (strcmp(i_name, "SlowRequest") == 0 && i_durationNS > i_budgetNS)
+  {
+    g_overBudgetCount++;
+  }
+}
+
+static bool BudgetTests()
+{
+  std::string outString;
+  taren_profiler::SetBudgetCallback(OnOverBudget);
+  PROFILE_BEGIN();
+  for (int i = 0; i < 2; i++)
+  {
+    PROFILE_SCOPE_BUDGET("SlowRequest", std::chrono::microseconds(100));
+    std::this_thread::sleep_for(std::chrono::milliseconds(i == 0 ? 2 : 0));
+  }
+  {
+    PROFILE_SCOPE_BUDGET("FastRequest", std::chrono::seconds(10));
+  }
+  PROFILE_END(outString);
+  taren_profiler::SetBudgetCallback(nullptr);
+
+  // Only the slow instance is marked, and the aggregate counts it
+  if (g_overBudgetCount != 1 ||
+      !Contains(outString, "\"args\":{\"over_budget\":true,\"budget_us\":100") ||
+      outString.find("over_budget\":true") != outString.rfind("over_budget\":true") ||
+      !Contains(outString, "{\"name\":\"SlowRequest\",\"count\":2,") ||
+      !Contains(outString, "\"over_budget\":1"))
+  {
+    std::cout << "Profile budget output failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool TaskTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  PROFILE_TASK_BEGIN("Task", 0x1234);
+  PROFILE_TASK_SUSPEND(0x1234);
+  std::thread thread([]()
+  {
+    // Resume and end on another thread
+    PROFILE_TASK_RESUME(0x1234);
+    PROFILE_SCOPE("TaskWork");
+    PROFILE_TASK_END(0x1234);
+  });
+  thread.join();
+  PROFILE_TASK_END(0x5678); // Not started in the capture
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "{\"name\":\"Task\",\"ph\":\"b\"") ||
+      !Contains(outString, "{\"name\":\"Suspended\",\"ph\":\"b\"") ||
+      !Contains(outString, "{\"name\":\"Suspended\",\"ph\":\"e\"") ||
+      !Contains(outString, "{\"name\":\"Task\",\"ph\":\"e\"") ||
+      !Contains(outString, "\"id\":\"0x1234\"") ||
+      Contains(outString, "0x5678") ||
+      !Contains(outString, "\"tasks\":[") ||
+      !Contains(outString, "{\"name\":\"Task\",\"count\":1,") ||
+      !Contains(outString, "{\"name\":\"TaskWork\",\"count\":1,"))
+  {
+    std::cout << "Profile task output failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool QueryStatsTests()
+{
+  taren_profiler::TagStats stats[16];
+  if (taren_profiler::QueryStats(stats, 16) != 0)
+  {
+    std::cout << "Query stats without begin should fail\n";
+    return false;
+  }
+
+  std::string outString;
+  PROFILE_BEGIN();
+  for (int i = 0; i < 10; i++)
+  {
+    PROFILE_SCOPE("QueryOuter");
+    for (int j = 0; j < 2; j++)
+    {
+      PROFILE_SCOPE_COPY(std::string("QueryInner").c_str());
+    }
+  }
+  PROFILE_TAG_BEGIN("QueryOpen"); // Open tags are not counted
+
+  uint32_t count = taren_profiler::QueryStats(stats, 16);
+  PROFILE_TAG_END();
+  PROFILE_END(outString);
+
+  if (count != 2 ||
+      strcmp(stats[0].m_name, "QueryOuter") != 0 ||
+      stats[0].m_count != 10 ||
+      strcmp(stats[1].m_name, "QueryInner") != 0 ||
+      stats[1].m_count != 20 ||
+      stats[0].m_totalNS < stats[1].m_totalNS ||
+      stats[0].m_p50NS > stats[0].m_p99NS ||
+      stats[0].m_p99NS > stats[0].m_maxNS)
+  {
+    std::cout << "Query stats failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool MetricsTests()
+{
+  std::string metricsString;
+  if (PROFILE_METRICS(metricsString))
+  {
+    std::cout << "Metrics without begin should fail\n";
+    return false;
+  }
+
+  std::string outString;
+  PROFILE_BEGIN();
+  for (int i = 0; i < 3; i++)
+  {
+    PROFILE_SCOPE_COPY(std::string("Metric\"Tag").c_str());
+  }
+  PROFILE_METRICS(metricsString);
+  PROFILE_END(outString);
+
+  if (!Contains(metricsString, "# TYPE taren_profiler_scope_calls counter\n") ||
+      !Contains(metricsString, "taren_profiler_scope_calls_total{tag=\"Metric\\\"Tag\"} 3\n") ||
+      !Contains(metricsString, "taren_profiler_scope_duration_seconds_bucket{tag=\"Metric\\\"Tag\",le=\"+Inf\"} 3\n") ||
+      !Contains(metricsString, "taren_profiler_scope_duration_seconds_count{tag=\"Metric\\\"Tag\"} 3\n") ||
+      !Contains(metricsString, "# EOF\n"))
+  {
+    std::cout << "Metrics output failed\n";
+    return false;
+  }
+  return true;
+}
+
+static bool MutexTests()
+{
+  taren_profiler::ProfiledMutex mutex("TestMutex");
+  taren_profiler::ProfiledSharedMutex sharedMutex("TestSharedMutex");
+
+  std::string outString;
+  PROFILE_BEGIN();
+  {
+    // Hold the lock while another thread waits for it
+    std::unique_lock<taren_profiler::ProfiledMutex> lock(mutex);
+    std::thread thread([&mutex]()
+    {
+      std::lock_guard<taren_profiler::ProfiledMutex> threadLock(mutex);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    lock.unlock();
+    thread.join();
+  }
+  {
+    std::shared_lock<taren_profiler::ProfiledSharedMutex> lock(sharedMutex);
+  }
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "{\"name\":\"TestMutex\",\"ph\":\"B\"") ||
+      !Contains(outString, "\"cat\":\"lock\"") ||
+      !Contains(outString, "\"locks\":[") ||
+      !Contains(outString, "{\"name\":\"TestMutex\",\"acquires\":2,\"shared_acquires\":0,\"contended\":1,") ||
+      !Contains(outString, "{\"name\":\"TestSharedMutex\",\"acquires\":0,\"shared_acquires\":1,\"contended\":0,"))
+  {
+    std::cout << "Profile mutex output failed\n";
+    return false;
+  }
+  return true;
+}
+
+#ifndef _WIN32
+static bool IOTests()
+{
+  const char* fileName = "Profiler_UnitTests_IO.bin";
+  char buffer[100] = {};
+
+  std::string outString;
+  PROFILE_BEGIN();
+  int fd = taren_profiler::io::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ssize_t writeSize = taren_profiler::io::pwrite(fd, buffer, sizeof(buffer), 0);
+  taren_profiler::io::fsync(fd);
+  ssize_t readSize = taren_profiler::io::pread(fd, buffer, sizeof(buffer), 50);
+  taren_profiler::io::close(fd);
+  PROFILE_END(outString);
+  std::remove(fileName);
+
+  // The short read has the requested and transferred bytes, and the stats are per fd
+  std::string fdString = std::to_string(fd);
+  if (fd < 0 || writeSize != 100 || readSize != 50 ||
+      !Contains(outString, "{\"name\":\"pread\",\"ph\":\"B\",\"ts\":") ||
+      !Contains(outString, ("\"cat\":\"io\",\"tid\":0,\"args\":{\"fd\":" + fdString + ",\"bytes\":100}}").c_str()) ||
+      !Contains(outString, "\"args\":{\"result\":50") ||
+      !Contains(outString, ("{\"fd\":" + fdString + ",\"path\":\"Profiler_UnitTests_IO.bin\",\"reads\":1,\"read_bytes\":50,").c_str()) ||
+      !Contains(outString, "\"writes\":1,\"write_bytes\":100,") ||
+      !Contains(outString, "\"syncs\":1,"))
+  {
+    std::cout << "Profile io output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool IOTests()
+{
+  return true;
+}
+#endif // !_WIN32
+
+#ifdef TAREN_PROFILER_HISTOGRAMS
+static void HistogramScopes()
+{
+  for (int i = 0; i < 100; i++)
+  {
+    PROFILE_SCOPE("Histogram");
+  }
+}
+
+static bool HistogramTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  std::thread thread(HistogramScopes);
+  thread.join();
+  HistogramScopes();
+  PROFILE_END(outString);
+
+  // Histograms of both threads are merged
+  if (!Contains(outString, "\"histograms\":[") ||
+      !Contains(outString, "{\"name\":\"Histogram\",\"count\":200,\"p50_ns\":"))
+  {
+    std::cout << "Profile histogram output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool HistogramTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_HISTOGRAMS
+
+#ifdef TAREN_PROFILER_SLOWEST
+static bool SlowestTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  for (int i = 0; i < 20; i++)
+  {
+    PROFILE_SCOPE("SlowestOuter");
+    PROFILE_TAG_ARGS_BEGIN("SlowestInner", "index", i);
+    if (i == 5)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    PROFILE_TAG_END();
+  }
+  {
+    // More nested records than the thread keeps (the default TAREN_PROFILER_SLOWEST_RECORD_COUNT is 256), so only the scope is kept
+    PROFILE_SCOPE("SlowestLong");
+    for (int i = 0; i < 300; i++)
+    {
+      PROFILE_SCOPE("SlowestNested");
+    }
+  }
+  PROFILE_END(outString);
+
+  // Only the slowest scopes are written, with their nested records, but the aggregates count all scopes
+  size_t outerCount = 0;
+  for (size_t pos = outString.find("{\"name\":\"SlowestOuter\",\"ph\":\"B\""); pos != std::string::npos; pos = outString.find("{\"name\":\"SlowestOuter\",\"ph\":\"B\"", pos + 1))
+  {
+    outerCount++;
+  }
+  if (outerCount != 8 || // (The default TAREN_PROFILER_SLOWEST_COUNT)
+      !Contains(outString, "{\"name\":\"SlowestInner\",\"ph\":\"B\"") ||
+      !Contains(outString, "\"index\":5") ||
+      !Contains(outString, "{\"name\":\"SlowestOuter\",\"count\":20,") ||
+      !Contains(outString, "\"slowest\":[") ||
+      !Contains(outString, "{\"name\":\"SlowestLong\",\"instances\":[{\"ts\":") ||
+      !Contains(outString, "\"truncated\":true"))
+  {
+    std::cout << "Profile slowest output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool SlowestTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_SLOWEST
+
+#ifdef TAREN_PROFILER_THREAD_CPU_TIME
+static bool CpuTimeTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  {
+    PROFILE_SCOPE("CpuSleep");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  PROFILE_END(outString);
+
+  // A sleeping scope is almost all off-cpu time
+  size_t aggregate = outString.find("{\"name\":\"CpuSleep\",\"count\":1");
+  if (!Contains(outString, "{\"name\":\"CpuSleep\",\"ph\":\"E\"") ||
+      !Contains(outString, "\"off_cpu_us\":") ||
+      aggregate == std::string::npos ||
+      outString.find("\"cpu_ratio\":0.0", aggregate) > outString.find('}', aggregate))
+  {
+    std::cout << "Profile cpu time output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool CpuTimeTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_THREAD_CPU_TIME
+
+#if defined(TAREN_PROFILER_RECORD_CPU) && defined(__linux__)
+#include <sched.h>
+
+static bool CpuMigrationTests()
+{
+  // Find two cores the process can run on (a single core machine can not migrate)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  int cpus[2] = { -1, -1 };
+  int cpuCount = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    for (int i = 0; i < CPU_SETSIZE && cpuCount < 2; i++)
+    {
+      if (CPU_ISSET(i, &allowed))
+      {
+        cpus[cpuCount++] = i;
+      }
+    }
+  }
+  if (cpuCount < 2)
+  {
+    return true;
+  }
+
+  // Pin a thread to one core, then move it to the other inside a scope
+  std::string outString;
+  bool pinned = false;
+  PROFILE_BEGIN();
+  std::thread thread([&cpus, &pinned]()
+  {
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(cpus[0], &cpu);
+    pinned = (sched_setaffinity(0, sizeof(cpu), &cpu) == 0);
+    PROFILE_SCOPE("Migrate");
+    CPU_ZERO(&cpu);
+    CPU_SET(cpus[1], &cpu);
+    pinned = pinned && (sched_setaffinity(0, sizeof(cpu), &cpu) == 0);
+    PROFILE_TAG_VALUE("Migrated", 1);
+  });
+  thread.join();
+  PROFILE_END(outString);
+
+  char migration[64];
+  snprintf(migration, sizeof(migration), "\"args\":{\"from\":%d,\"to\":%d}}", cpus[0], cpus[1]);
+  size_t aggregate = outString.find("{\"name\":\"Migrate\",\"count\":1");
+  if (!pinned ||
+      !Contains(outString, "{\"name\":\"CpuMigration\",\"ph\":\"i\"") ||
+      !Contains(outString, migration) ||
+      aggregate == std::string::npos ||
+      outString.find("\"migrations\":1", aggregate) > outString.find('}', aggregate))
+  {
+    std::cout << "Profile cpu migration event failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool CpuMigrationTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_RECORD_CPU && __linux__
+
+#ifdef TAREN_PROFILER_SAMPLING
+static bool SamplingTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  {
+    // Use cpu time, as the sample timer only counts while running
+    PROFILE_SCOPE("Sampled");
+    volatile uint64_t sum = 0;
+    auto endTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+    while (std::chrono::steady_clock::now() < endTime)
+    {
+      sum = sum + 1;
+    }
+  }
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "\"ph\":\"i\",\"s\":\"t\"") ||
+      !Contains(outString, "\"cat\":\"sample\"") ||
+      !Contains(outString, "\"stackFrames\":{") ||
+      !Contains(outString, "\"sample_functions\":["))
+  {
+    std::cout << "Profile sampling output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool SamplingTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_SAMPLING
+
+#ifdef TAREN_PROFILER_GAUGES
+static int32_t GetQueueDepth(void* i_userData)
+{
+  return *(const int32_t*)i_userData;
+}
+
+static uint32_t s_oneShotGaugeID = UINT32_MAX;
+static int32_t GetOneShot(void* i_userData)
+{
+  // Callbacks are called without the gauge lock, so can unregister (their own) gauge
+  (void)i_userData;
+  taren_profiler::UnregisterGauge(s_oneShotGaugeID);
+  return 7;
+}
+
+static bool GaugeTests()
+{
+  std::string outString;
+  int32_t queueDepth = 42;
+  uint32_t gaugeID = taren_profiler::RegisterGauge("QueueDepth", GetQueueDepth, &queueDepth);
+  s_oneShotGaugeID = taren_profiler::RegisterGauge("OneShot", GetOneShot);
+  PROFILE_BEGIN();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  PROFILE_END(outString);
+  taren_profiler::UnregisterGauge(gaugeID);
+
+  // The gauges are counter tracks on the sampler thread
+  if (gaugeID == UINT32_MAX ||
+      !Contains(outString, "{\"name\":\"QueueDepth\",\"ph\":\"C\"") ||
+      !Contains(outString, "\"cat\":\"gauge\",\"tid\":0,\"args\":{\"value\":42}}") ||
+      !Contains(outString, "_Gauges\"}}") ||
+      !Contains(outString, "{\"name\":\"OneShot\",\"ph\":\"C\""))
+  {
+    std::cout << "Profile gauge output failed\n";
+    return false;
+  }
+#ifdef __linux__
+  if (!Contains(outString, "{\"name\":\"ProcessRssKB\",\"ph\":\"C\""))
+  {
+    std::cout << "Profile process gauge output failed\n";
+    return false;
+  }
+#endif // __linux__
+  return true;
+}
+#else
+static bool GaugeTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_GAUGES
+
+#ifdef TAREN_PROFILER_MAPPED_FILE
+static bool MappedFileTests()
+{
+  const char* fileName = "Profiler_UnitTests_Mapped.tpf";
+
+  std::string outString;
+  if (!PROFILE_BEGIN_MAPPEDFILE(fileName))
+  {
+    std::cout << "Begin mapped file failed\n";
+    return false;
+  }
+  {
+    PROFILE_SCOPE("Mapped");
+  }
+  // Read the header and the name tables, their size follows the magic, version and state (the record buffers follow)
+  std::ifstream file(fileName, std::ios::binary);
+  uint64_t headerSize = 0;
+  file.seekg(16);
+  file.read((char*)&headerSize, sizeof(headerSize));
+  std::string fileString((size_t)headerSize, '\0');
+  file.seekg(0);
+  file.read(&fileString[0], fileString.size());
+  file.close();
+  PROFILE_END(outString);
+  std::remove(fileName);
+
+  // The file has the header and the tag names while recording, and End still writes the json
+  if (fileString.compare(0, 8, std::string("TARENPF\0", 8)) != 0 ||
+      !Contains(fileString, "Mapped") ||
+      !Contains(outString, "{\"name\":\"Mapped\",\"ph\":\"B\""))
+  {
+    std::cout << "Profile mapped file output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool MappedFileTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_MAPPED_FILE
+
+#ifdef TAREN_PROFILER_SHARED_MEMORY
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool SharedMemoryTests()
+{
+  std::string outString;
+  if (!PROFILE_BEGIN_SHAREDMEMORY("/Profiler_UnitTests_Shared"))
+  {
+    std::cout << "Begin shared memory failed\n";
+    return false;
+  }
+
+  // A forked child records into the parent's buffers
+  pid_t child = fork();
+  if (child == 0)
+  {
+    {
+      PROFILE_SCOPE("ForkedChild");
+    }
+    _exit(PROFILE_END(outString) ? 1 : 0);
+  }
+  int status = -1;
+  waitpid(child, &status, 0);
+  {
+    PROFILE_SCOPE("SharedParent");
+  }
+  PROFILE_END(outString);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+      !Contains(outString, "{\"name\":\"ForkedChild\",\"ph\":\"B\"") ||
+      !Contains(outString, "{\"name\":\"SharedParent\",\"ph\":\"B\"") ||
+      !Contains(outString, ("_pid" + std::to_string(child) + "_").c_str()))
+  {
+    std::cout << "Profile shared memory output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool SharedMemoryTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_SHARED_MEMORY
+
+#define PROFILE_MERGE_NO_MAIN
+#include "../Tools/ProfileMerge.cpp"
+
+static bool MergeTests()
+{
+  const char* fileNames[3] = { "Profiler_UnitTests_MergeA.json", "Profiler_UnitTests_MergeB.json", "Profiler_UnitTests_MergeBad.json" };
+  const char* mergedFileName = "Profiler_UnitTests_Merged.json";
+  PROFILE_BEGIN();
+  {
+    PROFILE_SCOPE("MergeA");
+  }
+  PROFILE_ENDFILEJSON(fileNames[0], false);
+  PROFILE_BEGIN();
+  {
+    PROFILE_SCOPE("MergeB");
+  }
+  PROFILE_ENDFILEJSON(fileNames[1], false);
+
+  // A capture with a malformed event, which is skipped
+  {
+    std::ofstream file(fileNames[2]);
+    file << "{\"otherData\":{\"pid\":7,\"monotonic_start_ns\":0},\n\"traceEvents\":[\n" <<
+      "{\"name\":\"MergeBad\",\"ph\":\"B\",\"ts\":},\n" <<
+      "{\"name\":\"MergeAfterBad\",\"ph\":\"i\",\"ts\":1,\"pid\":0,\"tid\":0}\n]\n}\n";
+  }
+
+  bool merged = MergeCaptures(mergedFileName, std::vector<std::string>(fileNames, fileNames + 3), false);
+  std::string mergedString = ReadFile(mergedFileName);
+  for (const char* fileName : fileNames)
+  {
+    std::remove(fileName);
+  }
+  std::remove(mergedFileName);
+
+  // Each capture is named as a process, and the events are moved to the thread index as the tid
+  if (!merged ||
+      !Contains(mergedString, "Profiler_UnitTests_MergeA.json (") ||
+      !Contains(mergedString, "Profiler_UnitTests_MergeB.json (") ||
+      !Contains(mergedString, "{\"name\":\"MergeA\",\"ph\":\"B\"") ||
+      !Contains(mergedString, "{\"name\":\"MergeB\",\"ph\":\"E\"") ||
+      !Contains(mergedString, "\"MergeAfterBad\"") ||
+      Contains(mergedString, "\"MergeBad\"") ||
+      !Contains(mergedString, "\"pid\":7"))
+  {
+    std::cout << "Profile merge output failed\n";
+    return false;
+  }
+  return true;
+}
+
+#ifdef TAREN_PROFILER_STREAMING
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool StreamTests()
+{
+  // Listen as the receiver would (the records are buffered by the socket until read)
+  std::string socketPath = "/tmp/Profiler_UnitTests_" + std::to_string(getpid()) + ".sock";
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath.c_str());
+  int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str());
+  if (bind(listenSocket, (const sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listenSocket, 1) != 0)
+  {
+    std::cout << "Stream test socket failed\n";
+    return false;
+  }
+
+  std::string outString;
+  PROFILE_BEGIN();
+  bool streamed = PROFILE_STREAM_BEGIN(socketPath.c_str(), 10);
+  {
+    PROFILE_SCOPE("Streamed");
+    PROFILE_TAG_VALUE_COPY("StreamedCopy", 7);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  bool snapshot = PROFILE_SNAPSHOT("Profiler_UnitTests_Stream");
+  PROFILE_STREAM_END();
+  PROFILE_END(outString);
+
+  std::string received;
+  int streamSocket = accept(listenSocket, nullptr, nullptr);
+  char buf[4096];
+  ssize_t readSize = 0;
+  while (streamSocket >= 0 && (readSize = read(streamSocket, buf, sizeof(buf))) > 0)
+  {
+    received.append(buf, (size_t)readSize);
+  }
+  close(streamSocket);
+  close(listenSocket);
+  unlink(socketPath.c_str());
+
+  // The stream starts with the hello message, then has the tag names, and the records were not left for End()
+  // (with TAREN_PROFILER_SLOWEST, End() still writes the kept slowest scopes)
+#ifdef TAREN_PROFILER_SLOWEST
+  bool leftForEnd = false;
+#else
+  bool leftForEnd = Contains(outString, "{\"name\":\"Streamed\",\"ph\":\"B\"");
+#endif // TAREN_PROFILER_SLOWEST
+  if (!streamed ||
+      snapshot ||
+      received.size() < 16 ||
+      received.compare(8, 8, std::string("TARENST\0", 8)) != 0 ||
+      !Contains(received, "Streamed") ||
+      !Contains(received, "StreamedCopy") ||
+      leftForEnd)
+  {
+    std::cout << "Profile stream output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool StreamTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_STREAMING
+
+#ifdef TAREN_PROFILER_CONTROL
+#include <csignal>
+#include <dirent.h>
+
+// Read and remove the timestamped capture files with a file name prefix
+static std::string ReadCaptureFiles(const char* i_prefix, int& o_fileCount)
+{
+  std::string contents;
+  o_fileCount = 0;
+  DIR* dir = opendir(".");
+  if (dir == nullptr)
+  {
+    return contents;
+  }
+  dirent* entry = nullptr;
+  while ((entry = readdir(dir)) != nullptr)
+  {
+    if (strncmp(entry->d_name, i_prefix, strlen(i_prefix)) == 0)
+    {
+      contents += ReadFile(entry->d_name);
+      std::remove(entry->d_name);
+      o_fileCount++;
+    }
+  }
+  closedir(dir);
+  return contents;
+}
+
+static bool ControlTests()
+{
+  const char* controlFile = "Profiler_UnitTests_Control.txt";
+  if (!PROFILE_CONTROL_BEGIN("Profiler_UnitTests_ControlSignal", 5000, controlFile) ||
+      PROFILE_CONTROL_BEGIN("Profiler_UnitTests_ControlSignal"))
+  {
+    std::cout << "Control begin failed\n";
+    return false;
+  }
+
+  // Start with a signal and stop with a signal
+  std::raise(SIGUSR1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  bool signalStarted = taren_profiler::IsProfiling();
+  {
+    PROFILE_SCOPE("ControlSignalScope");
+  }
+  std::raise(SIGUSR2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  bool signalStopped = !taren_profiler::IsProfiling();
+
+  // Start with the control file, with a duration and file name override
+  {
+    std::ofstream file(controlFile);
+    file << "500 Profiler_UnitTests_ControlFile\n";
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  bool fileStarted = taren_profiler::IsProfiling();
+  {
+    PROFILE_SCOPE("ControlFileScope");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(600));
+  bool fileStopped = !taren_profiler::IsProfiling();
+  PROFILE_CONTROL_END();
+
+  int signalFileCount = 0;
+  int fileFileCount = 0;
+  std::string signalString = ReadCaptureFiles("Profiler_UnitTests_ControlSignal", signalFileCount);
+  std::string fileString = ReadCaptureFiles("Profiler_UnitTests_ControlFile", fileFileCount);
+  if (!signalStarted || !signalStopped || !fileStarted || !fileStopped ||
+      signalFileCount != 1 || fileFileCount != 1 ||
+      !Contains(signalString, "{\"name\":\"ControlSignalScope\",\"ph\":\"B\"") ||
+      !Contains(fileString, "{\"name\":\"ControlFileScope\",\"ph\":\"B\""))
+  {
+    std::cout << "Profile control output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool ControlTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_CONTROL
+
+#ifdef TAREN_PROFILER_TRACE_CONTEXT
+static bool TraceContextTests()
+{
+  std::string outString;
+  PROFILE_BEGIN();
+  {
+    PROFILE_REQUEST(42);
+    PROFILE_SCOPE("SampledRequest");
+    PROFILE_TASK_BEGIN("RequestTask", 7);
+    PROFILE_TASK_SUSPEND(7);
+  }
+
+  // The task carries the request to the thread that resumes it
+  std::thread thread([]()
+  {
+    PROFILE_TASK_RESUME(7);
+    {
+      PROFILE_SCOPE("ResumedWork");
+    }
+    PROFILE_TASK_END(7);
+    PROFILE_SCOPE("AfterTask");
+  });
+  thread.join();
+
+  taren_profiler::SetRequestSampleRate(0);
+  {
+    PROFILE_REQUEST(43);
+    PROFILE_SCOPE("UnsampledRequest");
+  }
+  taren_profiler::SetRequestSampleRate(4);
+  int sampledCount = 0;
+  for (uint64_t i = 1; i <= 1000; i++)
+  {
+    PROFILE_REQUEST(i);
+    sampledCount += taren_profiler::GetTraceContext().m_sampled ? 1 : 0;
+  }
+  taren_profiler::SetRequestSampleRate(1);
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "{\"name\":\"SampledRequest\",\"ph\":\"B\"") ||
+      !Contains(outString, "\"args\":{\"request_id\":42}") ||
+      outString.find("\"request_id\":42", outString.find("{\"name\":\"ResumedWork\",\"ph\":\"B\"")) > outString.find("{\"name\":\"ResumedWork\",\"ph\":\"E\"") ||
+      !Contains(outString, "{\"name\":\"AfterTask\",\"ph\":\"B\",\"ts\":") ||
+      Contains(outString, "UnsampledRequest") ||
+      sampledCount < 150 || sampledCount > 350 ||
+      taren_profiler::GetTraceContext().m_requestID != 0)
+  {
+    std::cout << "Profile trace context output failed\n";
+    return false;
+  }
+
+  // The context does not follow the thread after the task
+  size_t afterTask = outString.find("{\"name\":\"AfterTask\",\"ph\":\"B\"");
+  if (outString.find("request_id", afterTask) < outString.find('}', afterTask))
+  {
+    std::cout << "Profile trace context restore failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool TraceContextTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_TRACE_CONTEXT
+
+#ifdef TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+extern "C" void __cyg_profile_func_enter(void* i_function, void* i_callSite);
+extern "C" void __cyg_profile_func_exit(void* i_function, void* i_callSite);
+
+static bool InstrumentTests()
+{
+  // Call the hooks directly, as this file may not be compiled with -finstrument-functions
+  std::string outString;
+  PROFILE_BEGIN();
+  __cyg_profile_func_enter((void*)&InstrumentTests, nullptr);
+  __cyg_profile_func_exit((void*)&InstrumentTests, nullptr);
+  PROFILE_END(outString);
+
+  if (!Contains(outString, "\"ph\":\"B\"") ||
+      !Contains(outString, "\"ph\":\"E\"") ||
+      !Contains(outString, "\"count\":1,"))
+  {
+    std::cout << "Profile function instrument output failed\n";
+    return false;
+  }
+  return true;
+}
+#else
+static bool InstrumentTests()
+{
+  return true;
+}
+#endif // TAREN_PROFILER_INSTRUMENT_FUNCTIONS
+
+bool Profiler_UnitTests()
+{
+  if (!BasicTests() ||
+      !TagIDTests() ||
+      !EnumTests() ||
+      !ArgsTests() ||
+      !BudgetTests() ||
+      !TaskTests() ||
+      !QueryStatsTests() ||
+      !MetricsTests() ||
+      !MutexTests() ||
+      !IOTests() ||
+      !HistogramTests() ||
+      !SlowestTests() ||
+      !CpuTimeTests() ||
+      !CpuMigrationTests() ||
+      !SnapshotTests() ||
+      !GaugeTests() ||
+      !MappedFileTests() ||
+      !SharedMemoryTests() ||
+      !MergeTests() ||
+      !StreamTests() ||
+      !ControlTests() ||
+      !TraceContextTests() ||
+      !SamplingTests() ||
+      !InstrumentTests())
+  {
+    return false;
+  }
+
+  return true;
+}
+
+#else // !TAREN_PROFILE_ENABLE
+
+bool Profiler_UnitTests()
+{
+  return true;
+}
+
+#endif // !TAREN_PROFILE_ENABLE
@@ -0,0 +1,260 @@
+///  ProfileCompare - Compares two json captures written by Profiler.h and reports the per-tag differences.
+///
+///  Usage:
+///    ProfileCompare [options] baseline.json candidate.json
+///
+///    Tags are matched by call path (eg. "Frame;Update;Physics") or by tag name with --by-tag. For each match the count,
+///    total and self time deltas are reported, sorted by the absolute change in total time.
+///
+///    A match is a regression if its total (or self) time increased by more than --threshold percent and more than --min-us
+///    microseconds. The exit code is 1 if any regression is found, so the tool can be used to gate a release.
+///
+///  Options:
+///    --by-tag          Match by tag name instead of call path
+///    --per-call        Compare the mean time per call instead of the total (for captures of different lengths)
+///    --threshold N     Percentage increase that is a regression (default 10)
+///    --min-us N        Minimum increase in microseconds that is a regression (default 1000)
+///    --top N           Number of rows to print (default 30, 0 for all)
+///
+///  Exit codes:
+///    0 - No regressions, 1 - Regressions found, 2 - Bad arguments or unreadable capture
+///
+///  Build: g++ -std=c++17 -O2 ProfileCompare.cpp -o ProfileCompare
+#include "ProfileJson.h"
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+
+namespace
+{
+  struct TagTimes
+  {
+    double m_count = 0.0;   // The number of times the tag ended
+    double m_totalUS = 0.0; // The total time in microseconds
+    double m_selfUS = 0.0;  // The time not in child tags in microseconds
+  };
+
+  struct Options
+  {
+    bool m_byTag = false;          // Match by tag name instead of call path
+    bool m_perCall = false;        // Compare the mean time per call
+    double m_thresholdPct = 10.0;  // Percentage increase that is a regression
+    double m_minUS = 1000.0;       // Minimum increase that is a regression
+    size_t m_top = 30;             // Number of rows to print
+  };
+
+  bool LoadCapture(const char* i_fileName, const Options& i_options, std::unordered_map<std::string, TagTimes>& o_times)
+  {
+    profile_json::Value root;
+    std::string error;
+    if (!profile_json::ParseFile(i_fileName, root, error))
+    {
+      fprintf(stderr, "%s: %s\n", i_fileName, error.c_str());
+      return false;
+    }
+
+    const profile_json::Value* events = root.Find("traceEvents");
+    if (events == nullptr || events->m_type != profile_json::Type::Array)
+    {
+      fprintf(stderr, "%s: No traceEvents array\n", i_fileName);
+      return false;
+    }
+
+    struct OpenTag
+    {
+      std::string m_key;      // The tag name or call path
+      double m_beginUS;       // The begin time
+      double m_childUS = 0.0; // The time spent in child tags
+    };
+    std::map<std::pair<double, double>, std::vector<OpenTag>> threadStacks; // Keyed by pid / tid
+
+    for (const profile_json::Value& event : events->m_array)
+    {
+      std::string phase = event.GetString("ph");
+      if (phase != "B" && phase != "E")
+      {
+        continue;
+      }
+
+      std::vector<OpenTag>& stack = threadStacks[std::make_pair(event.GetNumber("pid"), event.GetNumber("tid"))];
+      double timeUS = event.GetNumber("ts");
+      if (phase == "B")
+      {
+        std::string name = event.GetString("name");
+        OpenTag openTag;
+        openTag.m_key = (i_options.m_byTag || stack.empty()) ? name : stack.back().m_key + ";" + name;
+        openTag.m_beginUS = timeUS;
+        stack.push_back(openTag);
+      }
+      else if (!stack.empty())
+      {
+        OpenTag openTag = stack.back();
+        stack.pop_back();
+
+        double durationUS = timeUS - openTag.m_beginUS;
+        TagTimes& times = o_times[openTag.m_key];
+        times.m_count += 1.0;
+        times.m_totalUS += durationUS;
+        times.m_selfUS += durationUS - openTag.m_childUS;
+        if (!stack.empty())
+        {
+          stack.back().m_childUS += durationUS;
+        }
+      }
+    }
+    return true;
+  }
+
+  double GetTime(const TagTimes& i_times, double i_timeUS, const Options& i_options)
+  {
+    if (!i_options.m_perCall)
+    {
+      return i_timeUS;
+    }
+    return (i_times.m_count > 0.0) ? i_timeUS / i_times.m_count : 0.0;
+  }
+
+  bool IsRegression(double i_baseUS, double i_candidateUS, const Options& i_options)
+  {
+    double deltaUS = i_candidateUS - i_baseUS;
+    if (deltaUS <= i_options.m_minUS)
+    {
+      return false;
+    }
+    return i_baseUS <= 0.0 || (deltaUS * 100.0 / i_baseUS) > i_options.m_thresholdPct;
+  }
+
+  void PrintUsage()
+  {
+    fprintf(stderr,
+      "Usage: ProfileCompare [options] baseline.json candidate.json\n"
+      "  --by-tag        Match by tag name instead of call path\n"
+      "  --per-call      Compare the mean time per call instead of the total\n"
+      "  --threshold N   Percentage increase that is a regression (default 10)\n"
+      "  --min-us N      Minimum increase in microseconds that is a regression (default 1000)\n"
+      "  --top N         Number of rows to print (default 30, 0 for all)\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool hasValue = (i + 1 < argc);
+    if (arg == "--by-tag")
+    {
+      options.m_byTag = true;
+    }
+    else if (arg == "--per-call")
+    {
+      options.m_perCall = true;
+    }
+    else if (arg == "--threshold" && hasValue)
+    {
+      options.m_thresholdPct = atof(argv[++i]);
+    }
+    else if (arg == "--min-us" && hasValue)
+    {
+      options.m_minUS = atof(argv[++i]);
+    }
+    else if (arg == "--top" && hasValue)
+    {
+      options.m_top = (size_t)atoll(argv[++i]);
+    }
+    else if (arg.size() > 0 && arg[0] == '-')
+    {
+      PrintUsage();
+      return 2;
+    }
+    else
+    {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.size() != 2)
+  {
+    PrintUsage();
+    return 2;
+  }
+
+  std::unordered_map<std::string, TagTimes> baseline;
+  std::unordered_map<std::string, TagTimes> candidate;
+  if (!LoadCapture(files[0], options, baseline) ||
+      !LoadCapture(files[1], options, candidate))
+  {
+    return 2;
+  }
+
+  struct Row
+  {
+    std::string m_key;     // The tag name or call path
+    TagTimes m_baseline;   // The baseline times
+    TagTimes m_candidate;  // The candidate times
+    double m_totalDelta;   // The change in (total or per call) time
+    double m_selfDelta;    // The change in (total or per call) self time
+    bool m_regression;     // If the change is over the thresholds
+  };
+  std::vector<Row> rows;
+  for (const auto& b : baseline)
+  {
+    auto c = candidate.find(b.first);
+    rows.push_back(Row{ b.first, b.second, (c != candidate.end()) ? c->second : TagTimes(), 0.0, 0.0, false });
+  }
+  for (const auto& c : candidate)
+  {
+    if (baseline.find(c.first) == baseline.end())
+    {
+      rows.push_back(Row{ c.first, TagTimes(), c.second, 0.0, 0.0, false });
+    }
+  }
+
+  size_t regressionCount = 0;
+  for (Row& row : rows)
+  {
+    double baseTotal = GetTime(row.m_baseline, row.m_baseline.m_totalUS, options);
+    double candidateTotal = GetTime(row.m_candidate, row.m_candidate.m_totalUS, options);
+    double baseSelf = GetTime(row.m_baseline, row.m_baseline.m_selfUS, options);
+    double candidateSelf = GetTime(row.m_candidate, row.m_candidate.m_selfUS, options);
+    row.m_totalDelta = candidateTotal - baseTotal;
+    row.m_selfDelta = candidateSelf - baseSelf;
+    row.m_regression = IsRegression(baseTotal, candidateTotal, options) || IsRegression(baseSelf, candidateSelf, options);
+    regressionCount += row.m_regression ? 1 : 0;
+  }
+
+  // Sort by impact
+  std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return std::fabs(a.m_totalDelta) > std::fabs(b.m_totalDelta); });
+
+  printf("%-3s %10s %10s %14s %14s %9s %14s %s\n", "", "count", "d_count", options.m_perCall ? "base_us/call" : "base_us", "d_total_us", "d_total%", "d_self_us", options.m_byTag ? "tag" : "path");
+  for (size_t i = 0; i < rows.size() && (options.m_top == 0 || i < options.m_top); i++)
+  {
+    const Row& row = rows[i];
+    double baseTotal = GetTime(row.m_baseline, row.m_baseline.m_totalUS, options);
+    char percent[32];
+    if (baseTotal > 0.0)
+    {
+      snprintf(percent, sizeof(percent), "%+.1f%%", row.m_totalDelta * 100.0 / baseTotal);
+    }
+    else
+    {
+      snprintf(percent, sizeof(percent), "new");
+    }
+    printf("%-3s %10.0f %+10.0f %14.1f %+14.1f %9s %+14.1f %s\n", row.m_regression ? "!!" : "",
+      row.m_candidate.m_count, row.m_candidate.m_count - row.m_baseline.m_count, baseTotal, row.m_totalDelta, percent, row.m_selfDelta, row.m_key.c_str());
+  }
+
+  if (regressionCount > 0)
+  {
+    printf("%zu regression(s) over %.1f%% and %.0fus\n", regressionCount, options.m_thresholdPct, options.m_minUS);
+    return 1;
+  }
+  printf("No regressions over %.1f%% and %.0fus\n", options.m_thresholdPct, options.m_minUS);
+  return 0;
+}
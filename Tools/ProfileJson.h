@@ -0,0 +1,439 @@
+///  Minimal json reader / writer helpers shared by the profiler tools.
+///    Only supports what is needed to read the chrome://tracing json written by Profiler.h
+///
+///    eg. profile_json::Value root;
+///        std::string error;
+///        if (profile_json::ParseFile("capture.json", root, error))
+///        {
+///          const profile_json::Value* events = root.Find("traceEvents");
+///        }
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <ostream>
+#include <utility>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+namespace profile_json
+{
+  enum class Type
+  {
+    Null,
+    Bool,
+    Number,
+    String,
+    Array,
+    Object,
+  };
+
+  struct Value
+  {
+    Type m_type = Type::Null;                              // The type of the value
+    bool m_bool = false;                                   // The value if a bool
+    double m_number = 0.0;                                 // The value if a number
+    std::string m_string;                                  // The value if a string
+    std::vector<Value> m_array;                            // The values if an array
+    std::vector<std::pair<std::string, Value>> m_object;   // The members if an object (in file order)
+
+    /// \brief Find an object member
+    /// \param i_key The member name
+    /// \return Returns the member or nullptr if not found
+    const Value* Find(const char* i_key) const
+    {
+      for (const auto& member : m_object)
+      {
+        if (member.first == i_key)
+        {
+          return &member.second;
+        }
+      }
+      return nullptr;
+    }
+
+    /// \brief Get an object member as a number
+    /// \param i_key The member name
+    /// \param i_default The value to return if the member is not found or not a number
+    double GetNumber(const char* i_key, double i_default = 0.0) const
+    {
+      const Value* value = Find(i_key);
+      return (value != nullptr && value->m_type == Type::Number) ? value->m_number : i_default;
+    }
+
+    /// \brief Get an object member as a string
+    /// \param i_key The member name
+    /// \param i_default The value to return if the member is not found or not a string
+    const char* GetString(const char* i_key, const char* i_default = "") const
+    {
+      const Value* value = Find(i_key);
+      return (value != nullptr && value->m_type == Type::String) ? value->m_string.c_str() : i_default;
+    }
+  };
+
+  class Parser
+  {
+  public:
+
+    Parser(const char* i_text, size_t i_size) : m_text(i_text), m_end(i_text + i_size) {}
+
+    bool Parse(Value& o_value, std::string& o_error)
+    {
+      if (!ParseValue(o_value, 0))
+      {
+        o_error = m_error;
+        return false;
+      }
+      SkipSpace();
+      if (m_text != m_end)
+      {
+        o_error = "Unexpected data after the json value";
+        return false;
+      }
+      return true;
+    }
+
+  private:
+
+    const char* m_text; // The current parse position
+    const char* m_end;  // The end of the text
+    std::string m_error; // The first error found
+
+    bool Fail(const char* i_error)
+    {
+      if (m_error.empty())
+      {
+        m_error = i_error;
+      }
+      return false;
+    }
+
+    void SkipSpace()
+    {
+      while (m_text != m_end && (*m_text == ' ' || *m_text == '\t' || *m_text == '\n' || *m_text == '\r'))
+      {
+        m_text++;
+      }
+    }
+
+    bool Match(const char* i_str)
+    {
+      size_t len = strlen(i_str);
+      if ((size_t)(m_end - m_text) < len || strncmp(m_text, i_str, len) != 0)
+      {
+        return false;
+      }
+      m_text += len;
+      return true;
+    }
+
+    static void AppendUtf8(std::string& io_str, uint32_t i_codePoint)
+    {
+      if (i_codePoint < 0x80)
+      {
+        io_str += (char)i_codePoint;
+      }
+      else if (i_codePoint < 0x800)
+      {
+        io_str += (char)(0xC0 | (i_codePoint >> 6));
+        io_str += (char)(0x80 | (i_codePoint & 0x3F));
+      }
+      else
+      {
+        io_str += (char)(0xE0 | (i_codePoint >> 12));
+        io_str += (char)(0x80 | ((i_codePoint >> 6) & 0x3F));
+        io_str += (char)(0x80 | (i_codePoint & 0x3F));
+      }
+    }
+
+    bool ParseString(std::string& o_str)
+    {
+      m_text++; // Skip the quote
+      while (m_text != m_end && *m_text != '"')
+      {
+        char c = *m_text++;
+        if (c != '\\')
+        {
+          o_str += c;
+          continue;
+        }
+        if (m_text == m_end)
+        {
+          break;
+        }
+
+        c = *m_text++;
+        switch (c)
+        {
+        case 'b': o_str += '\b'; break;
+        case 'f': o_str += '\f'; break;
+        case 'n': o_str += '\n'; break;
+        case 'r': o_str += '\r'; break;
+        case 't': o_str += '\t'; break;
+        case 'u':
+        {
+          if (m_end - m_text < 4)
+          {
+            return Fail("Bad unicode escape");
+          }
+          std::string hex(m_text, 4);
+          m_text += 4;
+          AppendUtf8(o_str, (uint32_t)strtoul(hex.c_str(), nullptr, 16));
+          break;
+        }
+        default: o_str += c; break;
+        }
+      }
+      if (m_text == m_end)
+      {
+        return Fail("Unterminated string");
+      }
+      m_text++; // Skip the quote
+      return true;
+    }
+
+    bool ParseValue(Value& o_value, uint32_t i_depth)
+    {
+      if (i_depth > 256)
+      {
+        return Fail("Json nested too deep");
+      }
+
+      SkipSpace();
+      if (m_text == m_end)
+      {
+        return Fail("Unexpected end of json");
+      }
+
+      switch (*m_text)
+      {
+      case '{':
+      {
+        o_value.m_type = Type::Object;
+        m_text++;
+        SkipSpace();
+        if (m_text != m_end && *m_text == '}')
+        {
+          m_text++;
+          return true;
+        }
+        for (;;)
+        {
+          SkipSpace();
+          if (m_text == m_end || *m_text != '"')
+          {
+            return Fail("Expected an object key");
+          }
+          o_value.m_object.emplace_back();
+          if (!ParseString(o_value.m_object.back().first))
+          {
+            return false;
+          }
+          SkipSpace();
+          if (m_text == m_end || *m_text++ != ':')
+          {
+            return Fail("Expected ':'");
+          }
+          if (!ParseValue(o_value.m_object.back().second, i_depth + 1))
+          {
+            return false;
+          }
+          SkipSpace();
+          if (m_text != m_end && *m_text == ',')
+          {
+            m_text++;
+            continue;
+          }
+          if (m_text != m_end && *m_text == '}')
+          {
+            m_text++;
+            return true;
+          }
+          return Fail("Expected ',' or '}'");
+        }
+      }
+      case '[':
+      {
+        o_value.m_type = Type::Array;
+        m_text++;
+        SkipSpace();
+        if (m_text != m_end && *m_text == ']')
+        {
+          m_text++;
+          return true;
+        }
+        for (;;)
+        {
+          o_value.m_array.emplace_back();
+          if (!ParseValue(o_value.m_array.back(), i_depth + 1))
+          {
+            return false;
+          }
+          SkipSpace();
+          if (m_text != m_end && *m_text == ',')
+          {
+            m_text++;
+            continue;
+          }
+          if (m_text != m_end && *m_text == ']')
+          {
+            m_text++;
+            return true;
+          }
+          return Fail("Expected ',' or ']'");
+        }
+      }
+      case '"':
+        o_value.m_type = Type::String;
+        return ParseString(o_value.m_string);
+      default:
+        break;
+      }
+
+      if (Match("true"))
+      {
+        o_value.m_type = Type::Bool;
+        o_value.m_bool = true;
+        return true;
+      }
+      if (Match("false"))
+      {
+        o_value.m_type = Type::Bool;
+        return true;
+      }
+      if (Match("null"))
+      {
+        o_value.m_type = Type::Null;
+        return true;
+      }
+
+      // Copy the number so strtod does not read past the end of the text
+      const char* start = m_text;
+      while (m_text != m_end && strchr("+-0123456789.eE", *m_text) != nullptr)
+      {
+        m_text++;
+      }
+      if (start == m_text)
+      {
+        return Fail("Unexpected character");
+      }
+      o_value.m_type = Type::Number;
+      o_value.m_number = strtod(std::string(start, m_text).c_str(), nullptr);
+      return true;
+    }
+  };
+
+  /// \brief Parse json text
+  /// \param i_text The json text
+  /// \param o_value The parsed value
+  /// \param o_error The error message if parsing failed
+  /// \return Returns true on success
+  inline bool Parse(const std::string& i_text, Value& o_value, std::string& o_error)
+  {
+    Parser parser(i_text.data(), i_text.size());
+    return parser.Parse(o_value, o_error);
+  }
+
+  /// \brief Parse a json file
+  /// \param i_fileName The file to read
+  /// \param o_value The parsed value
+  /// \param o_error The error message if parsing failed
+  /// \return Returns true on success
+  inline bool ParseFile(const char* i_fileName, Value& o_value, std::string& o_error)
+  {
+    std::ifstream file(i_fileName, std::ios::binary);
+    if (!file.is_open())
+    {
+      o_error = std::string("Unable to open ") + i_fileName;
+      return false;
+    }
+
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return Parse(ss.str(), o_value, o_error);
+  }
+
+  /// \brief Write a string as a quoted json string
+  /// \param o_outStream The stream to write to
+  /// \param i_str The string to write
+  inline void WriteString(std::ostream& o_outStream, const std::string& i_str)
+  {
+    o_outStream << '"';
+    for (char c : i_str)
+    {
+      switch (c)
+      {
+      case '"': o_outStream << "\\\""; break;
+      case '\\': o_outStream << "\\\\"; break;
+      case '\n': o_outStream << "\\n"; break;
+      case '\r': o_outStream << "\\r"; break;
+      case '\t': o_outStream << "\\t"; break;
+      default:
+        if ((unsigned char)c < 0x20)
+        {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", (unsigned int)c);
+          o_outStream << buf;
+        }
+        else
+        {
+          o_outStream << c;
+        }
+        break;
+      }
+    }
+    o_outStream << '"';
+  }
+
+  /// \brief Write a json value
+  /// \param o_outStream The stream to write to
+  /// \param i_value The value to write
+  inline void Write(std::ostream& o_outStream, const Value& i_value)
+  {
+    switch (i_value.m_type)
+    {
+    case Type::Null: o_outStream << "null"; break;
+    case Type::Bool: o_outStream << (i_value.m_bool ? "true" : "false"); break;
+    case Type::Number:
+    {
+      // Write integers without a decimal point (timestamps are large integers)
+      char buf[64];
+      if (i_value.m_number == (double)(int64_t)i_value.m_number)
+      {
+        snprintf(buf, sizeof(buf), "%lld", (long long)i_value.m_number);
+      }
+      else
+      {
+        snprintf(buf, sizeof(buf), "%.17g", i_value.m_number);
+      }
+      o_outStream << buf;
+      break;
+    }
+    case Type::String: WriteString(o_outStream, i_value.m_string); break;
+    case Type::Array:
+      o_outStream << '[';
+      for (size_t i = 0; i < i_value.m_array.size(); i++)
+      {
+        o_outStream << (i == 0 ? "" : ",");
+        Write(o_outStream, i_value.m_array[i]);
+      }
+      o_outStream << ']';
+      break;
+    case Type::Object:
+      o_outStream << '{';
+      for (size_t i = 0; i < i_value.m_object.size(); i++)
+      {
+        o_outStream << (i == 0 ? "" : ",");
+        WriteString(o_outStream, i_value.m_object[i].first);
+        o_outStream << ':';
+        Write(o_outStream, i_value.m_object[i].second);
+      }
+      o_outStream << '}';
+      break;
+    }
+  }
+}
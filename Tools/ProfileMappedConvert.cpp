@@ -0,0 +1,425 @@
+///  ProfileMappedConvert - Converts a capture file written by PROFILE_BEGIN_MAPPEDFILE() to the json written by Profiler.h
+///
+///  Usage:
+///    ProfileMappedConvert capture.tpf out.json
+///    ProfileMappedConvert /dev/shm/name out.json     (a PROFILE_BEGIN_SHAREDMEMORY() arena left by a crashed process)
+///
+///    The file can be converted while the process is still running or after it has crashed. Records that were claimed
+///    but not completely written when the process stopped are skipped, and scopes that are still open are closed at
+///    the last recorded time with an "unclosed" arg.
+///
+///    Tags from instrumented functions are named by their address, as symbols can only be resolved in the process.
+///    Task tags (PROFILE_TASK_BEGIN) are skipped. Threads of attached worker processes are named with the worker pid.
+///    The file layout is described by its header, so the profiler build options do not need to match this tool.
+///
+///  Exit codes:
+///    0 - Success, 2 - Bad arguments or unreadable capture
+///
+///  Build (POSIX only): g++ -std=c++17 -O2 ProfileMappedConvert.cpp -o ProfileMappedConvert
+#include "ProfileJson.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>
+
+namespace
+{
+  const uint32_t c_mappedFileVersion = 2;         // Must match the version in Profiler.h
+  const uint32_t c_copyTagFlag = 0x80000000;      // Tag id flag for an offset into the record buffer's copy buffer
+  const uint32_t c_addressTagFlag = 0x40000000;   // Tag id flag for an index into the address tag table
+  const uint32_t c_tagIndexMask = 0x3FFFFFFF;     // Mask to get the offset / index from a tag id
+
+  enum class TagType : uint8_t
+  {
+    Begin,
+    End,
+    Value,
+    FunctionBegin,
+    TaskBegin,
+    Gauge = 8,
+  };
+
+  // Same layout as MappedFileHeader in Profiler.h (with atomics as plain integers)
+  struct MappedFileHeader
+  {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_state;
+    uint64_t m_headerSize;
+    uint64_t m_bufferSize;
+    uint64_t m_slotCountOffset;
+    uint64_t m_recordCountOffset;
+    uint64_t m_generationOffset;
+    uint64_t m_recordsOffset;
+    uint64_t m_copyBufferOffset;
+    uint32_t m_recordSize;
+    uint32_t m_recordMaxCount;
+    uint32_t m_copyBufferSize;
+    uint32_t m_timeOffset;
+    uint32_t m_threadIDOffset;
+    uint32_t m_threadIDSize;
+    uint32_t m_tagIDOffset;
+    uint32_t m_valueOffset;
+    uint32_t m_typeOffset;
+    uint32_t m_recordGenerationOffset;
+    uint32_t m_processOffset;
+    int64_t m_startTime;
+    int64_t m_clockNum;
+    int64_t m_clockDen;
+    uint32_t m_descriptorCount;
+    uint32_t m_addressTagCount;
+    uint32_t m_processTableCount;
+    uint64_t m_processTableStride;
+    uint64_t m_processesOffset;
+    uint64_t m_descriptorsOffset;
+    uint64_t m_addressNamesOffset;
+    uint64_t m_nameTableOffset;
+    uint32_t m_nameTableSize;
+    uint32_t m_nameTableUsed;
+    uint32_t m_activeBuffer;
+    uint32_t m_processCount;
+  };
+
+  struct MappedDescriptor
+  {
+    uint32_t m_name;
+    uint32_t m_file;
+    uint32_t m_category;
+    uint32_t m_line;
+  };
+
+  struct Record
+  {
+    int64_t m_time;     // The time in clock ticks
+    uint64_t m_thread;  // The thread id bytes
+    uint32_t m_tagID;   // The tag id
+    int32_t m_value;    // The tag value
+    TagType m_type;     // The tag type
+    uint32_t m_process; // The process slot that wrote the record
+  };
+
+  class Capture
+  {
+  public:
+
+    ~Capture()
+    {
+      if (m_data != nullptr)
+      {
+        munmap((void*)m_data, m_size);
+      }
+    }
+
+    bool Open(const char* i_fileName)
+    {
+      int file = open(i_fileName, O_RDONLY);
+      if (file < 0)
+      {
+        fprintf(stderr, "Unable to open %s\n", i_fileName);
+        return false;
+      }
+      struct stat fileStat;
+      if (fstat(file, &fileStat) == 0 && fileStat.st_size >= (off_t)sizeof(MappedFileHeader))
+      {
+        m_size = (size_t)fileStat.st_size;
+        void* mapping = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+        m_data = (mapping != MAP_FAILED) ? (const char*)mapping : nullptr;
+      }
+      close(file);
+      if (m_data == nullptr)
+      {
+        fprintf(stderr, "Unable to map %s\n", i_fileName);
+        return false;
+      }
+
+      memcpy(&m_header, m_data, sizeof(m_header));
+      if (memcmp(m_header.m_magic, "TARENPF", 8) != 0 ||
+          m_header.m_version != c_mappedFileVersion)
+      {
+        fprintf(stderr, "%s is not a version %u profiler capture\n", i_fileName, c_mappedFileVersion);
+        return false;
+      }
+      if (m_header.m_headerSize + m_header.m_bufferSize * 2 > m_size ||
+          m_header.m_nameTableOffset + m_header.m_nameTableSize > m_header.m_headerSize ||
+          m_header.m_descriptorsOffset + m_header.m_processTableStride * m_header.m_processTableCount > m_header.m_nameTableOffset ||
+          m_header.m_threadIDSize > sizeof(uint64_t) ||
+          m_header.m_activeBuffer > 1)
+      {
+        fprintf(stderr, "%s is truncated or corrupt\n", i_fileName);
+        return false;
+      }
+      return true;
+    }
+
+    const MappedFileHeader& GetHeader() const
+    {
+      return m_header;
+    }
+
+    /// \brief Read the complete records of a buffer
+    /// \param i_bufferIndex The record buffer to read
+    /// \param i_closed If the buffer was closed by a snapshot (the slot count no longer counts the claimed records)
+    /// \param o_records The records that were completely written
+    /// \return Returns the number of records that were claimed but not complete
+    uint64_t ReadBuffer(uint32_t i_bufferIndex, bool i_closed, std::vector<Record>& o_records) const
+    {
+      const char* buffer = GetBuffer(i_bufferIndex);
+      uint64_t slotCount = std::min<uint64_t>(Read<uint64_t>(buffer + m_header.m_slotCountOffset), m_header.m_recordMaxCount);
+      uint32_t generation = Read<uint32_t>(buffer + m_header.m_generationOffset);
+
+      size_t startCount = o_records.size();
+      for (uint64_t i = 0; i < slotCount; i++)
+      {
+        const char* data = buffer + m_header.m_recordsOffset + i * m_header.m_recordSize;
+
+        // The generation is the last write, so a record of the current generation is complete
+        if (Read<uint32_t>(data + m_header.m_recordGenerationOffset) != generation)
+        {
+          continue;
+        }
+
+        Record record;
+        record.m_time = Read<int64_t>(data + m_header.m_timeOffset);
+        record.m_thread = 0;
+        memcpy(&record.m_thread, data + m_header.m_threadIDOffset, m_header.m_threadIDSize);
+        record.m_tagID = Read<uint32_t>(data + m_header.m_tagIDOffset);
+        record.m_value = Read<int32_t>(data + m_header.m_valueOffset);
+        record.m_type = (TagType)Read<uint8_t>(data + m_header.m_typeOffset);
+        record.m_process = (m_header.m_processOffset != UINT32_MAX) ? Read<uint16_t>(data + m_header.m_processOffset) : 0;
+        if (record.m_process >= m_header.m_processTableCount)
+        {
+          continue;
+        }
+        o_records.push_back(record);
+      }
+
+      uint64_t claimedCount = i_closed ? Read<uint32_t>(buffer + m_header.m_recordCountOffset) : slotCount;
+      uint64_t completeCount = o_records.size() - startCount;
+      return (claimedCount > completeCount) ? claimedCount - completeCount : 0;
+    }
+
+    /// \brief Get the name and category of a begin / value tag (from the tag tables of the process that wrote the record)
+    void GetTagName(uint32_t i_bufferIndex, const Record& i_record, std::string& o_name, std::string& o_category) const
+    {
+      uint32_t i_tagID = i_record.m_tagID;
+      uint64_t tableOffset = m_header.m_processTableStride * i_record.m_process;
+      o_category.clear();
+      uint32_t index = i_tagID & c_tagIndexMask;
+      if ((i_tagID & c_copyTagFlag) != 0)
+      {
+        const char* copyBuffer = GetBuffer(i_bufferIndex) + m_header.m_copyBufferOffset;
+        o_name = (index < m_header.m_copyBufferSize) ? std::string(copyBuffer + index, strnlen(copyBuffer + index, m_header.m_copyBufferSize - index)) : "";
+      }
+      else if ((i_tagID & c_addressTagFlag) != 0)
+      {
+        o_name = (index < m_header.m_addressTagCount) ? GetName(Read<uint32_t>(m_data + m_header.m_addressNamesOffset + tableOffset + index * sizeof(uint32_t))) : "";
+      }
+      else if (index < m_header.m_descriptorCount)
+      {
+        MappedDescriptor descriptor = Read<MappedDescriptor>(m_data + m_header.m_descriptorsOffset + tableOffset + index * sizeof(MappedDescriptor));
+        o_name = GetName(descriptor.m_name);
+        o_category = GetName(descriptor.m_category);
+      }
+
+      if (o_name.empty())
+      {
+        o_name = "Unknown";
+      }
+    }
+
+    /// \brief Get the process id of a process slot
+    int32_t GetProcessID(uint32_t i_process) const
+    {
+      return (i_process < m_header.m_processTableCount) ? Read<int32_t>(m_data + m_header.m_processesOffset + i_process * sizeof(int32_t)) : 0;
+    }
+
+    /// \brief Get the microseconds from the profile start
+    long long GetMicroseconds(int64_t i_time) const
+    {
+      return (long long)((double)(i_time - m_header.m_startTime) * (double)m_header.m_clockNum * 1000000.0 / (double)m_header.m_clockDen);
+    }
+
+  private:
+
+    const char* m_data = nullptr; // The mapped file
+    size_t m_size = 0;            // The mapped file size
+    MappedFileHeader m_header;    // A copy of the file header
+
+    template <typename T>
+    static T Read(const char* i_data)
+    {
+      T value;
+      memcpy(&value, i_data, sizeof(T));
+      return value;
+    }
+
+    const char* GetBuffer(uint32_t i_bufferIndex) const
+    {
+      return m_data + m_header.m_headerSize + m_header.m_bufferSize * i_bufferIndex;
+    }
+
+    std::string GetName(uint32_t i_offset) const
+    {
+      if (i_offset == 0 || i_offset >= m_header.m_nameTableSize)
+      {
+        return "";
+      }
+      const char* name = m_data + m_header.m_nameTableOffset + i_offset;
+      return std::string(name, strnlen(name, m_header.m_nameTableSize - i_offset));
+    }
+  };
+
+  struct OpenTag
+  {
+    std::string m_name;     // The tag name
+    std::string m_category; // The tag category
+  };
+
+  struct ThreadState
+  {
+    int32_t m_index = 0;            // The thread index in the output
+    std::vector<OpenTag> m_tags;    // The open tags
+  };
+
+  void WriteEvent(std::ostream& o_outStream, const char* i_phase, const OpenTag& i_tag, long long i_timeUS, int32_t i_threadIndex, bool& io_firstEvent)
+  {
+    o_outStream << (io_firstEvent ? "" : ",\n") << "{\"name\":";
+    profile_json::WriteString(o_outStream, i_tag.m_name);
+    o_outStream << ",\"ph\":\"" << i_phase << "\",\"ts\":" << i_timeUS << ",\"pid\":" << i_threadIndex << ",\"cat\":";
+    profile_json::WriteString(o_outStream, i_tag.m_category);
+    o_outStream << ",\"tid\":0,";
+    io_firstEvent = false;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: ProfileMappedConvert capture.tpf out.json\n");
+    return 2;
+  }
+
+  Capture capture;
+  if (!capture.Open(argv[1]))
+  {
+    return 2;
+  }
+  const MappedFileHeader& header = capture.GetHeader();
+
+  std::ofstream outFile(argv[2], std::ios::binary);
+  if (!outFile.is_open())
+  {
+    fprintf(stderr, "Unable to write %s\n", argv[2]);
+    return 2;
+  }
+
+  std::map<std::pair<uint32_t, uint64_t>, ThreadState> threads; // Keyed by process slot / thread id
+  bool firstEvent = true;
+  long long lastTimeUS = 0;
+  uint64_t recordCount = 0;
+  uint64_t incompleteCount = 0;
+  outFile << "{\"traceEvents\":[\n";
+
+  // The retired buffer has the records before the last snapshot (already written to the snapshot file, but kept for a crash)
+  uint32_t bufferOrder[2] = { header.m_activeBuffer ^ 1, header.m_activeBuffer };
+  for (uint32_t bufferIndex : bufferOrder)
+  {
+    std::vector<Record> records;
+    incompleteCount += capture.ReadBuffer(bufferIndex, bufferIndex != header.m_activeBuffer, records);
+    recordCount += records.size();
+
+    for (const Record& record : records)
+    {
+      ThreadState& thread = threads[std::make_pair(record.m_process, record.m_thread)];
+      if (thread.m_index == 0)
+      {
+        thread.m_index = (int32_t)threads.size();
+      }
+
+      long long timeUS = capture.GetMicroseconds(record.m_time);
+      lastTimeUS = std::max(lastTimeUS, timeUS);
+      if (record.m_type == TagType::Gauge)
+      {
+        OpenTag tag;
+        capture.GetTagName(bufferIndex, record, tag.m_name, tag.m_category);
+        WriteEvent(outFile, "C", tag, timeUS, thread.m_index, firstEvent);
+        outFile << "\"args\":{\"value\":" << record.m_value << "}}";
+        continue;
+      }
+      if (record.m_type >= TagType::TaskBegin)
+      {
+        continue; // Task tracks are not converted
+      }
+      if (record.m_type == TagType::End)
+      {
+        if (thread.m_tags.empty())
+        {
+          continue; // Began before the capture
+        }
+        WriteEvent(outFile, "E", thread.m_tags.back(), timeUS, thread.m_index, firstEvent);
+        outFile << "\"args\":{}}";
+        thread.m_tags.pop_back();
+        continue;
+      }
+
+      OpenTag tag;
+      capture.GetTagName(bufferIndex, record, tag.m_name, tag.m_category);
+      if (record.m_type == TagType::Value)
+      {
+        WriteEvent(outFile, "O", tag, timeUS, thread.m_index, firstEvent);
+        outFile << "\"id\":";
+        profile_json::WriteString(outFile, tag.m_name);
+        outFile << ", \"args\":{\"snapshot\":{\"Value\": " << record.m_value << "}}}";
+        continue;
+      }
+      WriteEvent(outFile, "B", tag, timeUS, thread.m_index, firstEvent);
+      outFile << "\"args\":{}}";
+      thread.m_tags.push_back(tag);
+    }
+  }
+
+  // Close the scopes that were open when the capture stopped
+  uint64_t unclosedCount = 0;
+  for (auto& t : threads)
+  {
+    while (!t.second.m_tags.empty())
+    {
+      WriteEvent(outFile, "E", t.second.m_tags.back(), lastTimeUS, t.second.m_index, firstEvent);
+      outFile << "\"args\":{\"unclosed\":true}}";
+      t.second.m_tags.pop_back();
+      unclosedCount++;
+    }
+  }
+
+  for (const auto& t : threads)
+  {
+    char threadName[64];
+    if (t.first.first != 0)
+    {
+      snprintf(threadName, sizeof(threadName), "Thread%02d_pid%d_%llu", t.second.m_index, (int)capture.GetProcessID(t.first.first), (unsigned long long)t.first.second);
+    }
+    else
+    {
+      snprintf(threadName, sizeof(threadName), "Thread%02d_%llu", t.second.m_index, (unsigned long long)t.first.second);
+    }
+    outFile << (firstEvent ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":0,\"pid\":" << t.second.m_index <<
+      ",\"args\":{\"name\":\"" << threadName << "\"}}";
+    firstEvent = false;
+  }
+  outFile << "\n]\n}\n";
+
+  printf("%s: %llu records, %llu incomplete, %llu unclosed scopes, %s\n", argv[1], (unsigned long long)recordCount,
+    (unsigned long long)incompleteCount, (unsigned long long)unclosedCount, (header.m_state == 2) ? "ended cleanly" : "capture did not end");
+  return outFile.good() ? 0 : 2;
+}
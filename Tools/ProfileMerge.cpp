@@ -0,0 +1,378 @@
+///  ProfileMerge - Merges the json captures of several processes written by Profiler.h into one timeline.
+///
+///  Usage:
+///    ProfileMerge [options] out.json capture1.json capture2.json ...
+///
+///    Each capture starts its timestamps at its own PROFILE_BEGIN(), and numbers its threads from 0 as the trace "pid".
+///    The "otherData" header of each capture has the real process id and the start time on the system wide monotonic
+///    clock, so the merged file shifts each capture onto a common timebase and groups the threads of each process
+///    under its real pid (the thread index becomes the "tid").
+///
+///    The captures are streamed one event line at a time, so multi-GB files can be merged. Only the trace events and
+///    sample stack frames are kept, the per-capture aggregate arrays are dropped. Events that can not be parsed (eg. the
+///    last line of a capture that was cut off) are skipped with a warning.
+///
+///  Options:
+///    --system-clock    Align with the system (wall) clock instead of the monotonic clock, for captures from different machines
+///
+///  Exit codes:
+///    0 - Success, 2 - Bad arguments or unreadable capture
+///
+///  Build: g++ -std=c++17 -O2 ProfileMerge.cpp -o ProfileMerge
+///    Define PROFILE_MERGE_NO_MAIN to include the merge in another program (eg. the unit tests) with MergeCaptures().
+#include "ProfileJson.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+namespace
+{
+  const size_t c_maxValueSize = 1024 * 1024; // Longer array values are skipped as malformed
+
+  struct Capture
+  {
+    std::string m_fileName;    // The capture file name
+    double m_processID = 0.0;  // The real process id
+    double m_startNS = 0.0;    // The capture start time on the alignment clock
+    bool m_hasHeader = false;  // If the capture has the otherData header
+  };
+
+  /// \brief Read lines until a line is found that starts with i_prefix (ignoring leading spaces)
+  /// \param io_file The file to read
+  /// \param i_prefix The line prefix to find
+  /// \param o_skipped The text of the skipped lines
+  /// \return Returns true if the line was found
+  bool SkipToLine(std::ifstream& io_file, const char* i_prefix, std::string& o_skipped)
+  {
+    std::string line;
+    while (std::getline(io_file, line))
+    {
+      size_t start = line.find_first_not_of(" \t\r");
+      if (start != std::string::npos && line.compare(start, strlen(i_prefix), i_prefix) == 0)
+      {
+        return true;
+      }
+      o_skipped += line;
+    }
+    return false;
+  }
+
+  /// \brief Read the next value of an array that is written one value per line (values can span lines if a string has a newline)
+  ///        A value that does not parse by the end of a line ending with '}' (or is over c_maxValueSize) is skipped.
+  /// \param io_file The file to read
+  /// \param o_value The value read
+  /// \param io_skippedCount Incremented for each value that was skipped
+  /// \return Returns false at the end of the array
+  bool ReadArrayValue(std::ifstream& io_file, profile_json::Value& o_value, uint64_t& io_skippedCount)
+  {
+    std::string text;
+    std::string line;
+    while (std::getline(io_file, line))
+    {
+      if (text.empty())
+      {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos)
+        {
+          continue;
+        }
+        if (line[start] == ']' || line[start] == '}')
+        {
+          return false;
+        }
+      }
+      text += line;
+
+      // Remove the separator and try to parse, otherwise the value continues on the next line
+      std::string valueText = text;
+      while (!valueText.empty() && (valueText.back() == ',' || valueText.back() == ' ' || valueText.back() == '\r'))
+      {
+        valueText.pop_back();
+      }
+      o_value = profile_json::Value();
+      std::string error;
+      if (profile_json::Parse(valueText, o_value, error))
+      {
+        return true;
+      }
+
+      // Only a string with a newline continues on the next line, so stop at the end of an object or a long value
+      // (otherwise a malformed value is reparsed with every following line)
+      if ((!valueText.empty() && valueText.back() == '}') || text.size() > c_maxValueSize)
+      {
+        io_skippedCount++;
+        text.clear();
+        continue;
+      }
+      text += '\n';
+    }
+    if (!text.empty())
+    {
+      io_skippedCount++; // Cut off at the end of the file
+    }
+    return false;
+  }
+
+  bool ReadHeader(Capture& io_capture, bool i_systemClock)
+  {
+    std::ifstream file(io_capture.m_fileName, std::ios::binary);
+    std::string header;
+    if (!file.is_open() ||
+        !SkipToLine(file, "\"traceEvents\":[", header))
+    {
+      fprintf(stderr, "%s: Not a profiler capture\n", io_capture.m_fileName.c_str());
+      return false;
+    }
+
+    // The header is the start of the root object (eg. {"otherData":{...},)
+    size_t start = header.find('{');
+    size_t end = header.find_last_of('}');
+    profile_json::Value root;
+    std::string error;
+    if (start != std::string::npos && end != std::string::npos && end > start &&
+        profile_json::Parse(header.substr(start, end - start + 1) + "}", root, error))
+    {
+      const profile_json::Value* otherData = root.Find("otherData");
+      if (otherData != nullptr && otherData->Find("pid") != nullptr)
+      {
+        io_capture.m_processID = otherData->GetNumber("pid");
+        io_capture.m_startNS = otherData->GetNumber(i_systemClock ? "system_start_ns" : "monotonic_start_ns");
+        io_capture.m_hasHeader = true;
+      }
+    }
+    if (!io_capture.m_hasHeader)
+    {
+      fprintf(stderr, "%s: No otherData header (written by an older profiler), the capture is not aligned\n", io_capture.m_fileName.c_str());
+    }
+    return true;
+  }
+
+  void SetNumber(profile_json::Value& io_object, const char* i_key, double i_number)
+  {
+    for (auto& member : io_object.m_object)
+    {
+      if (member.first == i_key)
+      {
+        member.second = profile_json::Value();
+        member.second.m_type = profile_json::Type::Number;
+        member.second.m_number = i_number;
+        return;
+      }
+    }
+    io_object.m_object.emplace_back(i_key, profile_json::Value());
+    io_object.m_object.back().second.m_type = profile_json::Type::Number;
+    io_object.m_object.back().second.m_number = i_number;
+  }
+
+  void SetString(profile_json::Value& io_object, const char* i_key, const std::string& i_string)
+  {
+    for (auto& member : io_object.m_object)
+    {
+      if (member.first == i_key)
+      {
+        member.second = profile_json::Value();
+        member.second.m_type = profile_json::Type::String;
+        member.second.m_string = i_string;
+        return;
+      }
+    }
+    io_object.m_object.emplace_back(i_key, profile_json::Value());
+    io_object.m_object.back().second.m_type = profile_json::Type::String;
+    io_object.m_object.back().second.m_string = i_string;
+  }
+
+  std::string GetIDString(const profile_json::Value& i_value)
+  {
+    if (i_value.m_type == profile_json::Type::String)
+    {
+      return i_value.m_string;
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.0f", i_value.m_number);
+    return buf;
+  }
+
+  /// \brief Merge the captures into one json file
+  /// \param i_outFileName The merged json file to write
+  /// \param i_fileNames The capture json files
+  /// \param i_systemClock If the captures are aligned with the system clock instead of the monotonic clock
+  /// \return Returns true if the captures were read and the merged file was written
+  bool MergeCaptures(const std::string& i_outFileName, const std::vector<std::string>& i_fileNames, bool i_systemClock)
+  {
+    std::vector<Capture> captures;
+    for (size_t i = 0; i < i_fileNames.size(); i++)
+    {
+      Capture capture;
+      capture.m_fileName = i_fileNames[i];
+      capture.m_processID = (double)(i + 1); // Used if there is no header
+      if (!ReadHeader(capture, i_systemClock))
+      {
+        return false;
+      }
+      captures.push_back(capture);
+    }
+
+    // Align to the earliest capture
+    double baseNS = 0.0;
+    bool hasBase = false;
+    for (const Capture& capture : captures)
+    {
+      if (capture.m_hasHeader && (!hasBase || capture.m_startNS < baseNS))
+      {
+        baseNS = capture.m_startNS;
+        hasBase = true;
+      }
+    }
+
+    std::ofstream outFile(i_outFileName, std::ios::binary);
+    if (!outFile.is_open())
+    {
+      fprintf(stderr, "Unable to write %s\n", i_outFileName.c_str());
+      return false;
+    }
+    outFile << "{\"traceEvents\":[\n";
+
+    bool firstEvent = true;
+    std::string stackFrames;
+    uint64_t eventCount = 0;
+    for (size_t c = 0; c < captures.size(); c++)
+    {
+      const Capture& capture = captures[c];
+      double offsetUS = capture.m_hasHeader ? (capture.m_startNS - baseNS) / 1000.0 : 0.0;
+      std::string prefix = std::to_string((long long)capture.m_processID) + ":";
+
+      std::ifstream file(capture.m_fileName, std::ios::binary);
+      std::string skipped;
+      SkipToLine(file, "\"traceEvents\":[", skipped);
+
+      // Name the process after the capture file
+      const char* baseName = strrchr(capture.m_fileName.c_str(), '/');
+      baseName = (baseName != nullptr) ? baseName + 1 : capture.m_fileName.c_str();
+      outFile << (firstEvent ? "" : ",\n") << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << (long long)capture.m_processID << ",\"tid\":0,\"args\":{\"name\":";
+      profile_json::WriteString(outFile, std::string(baseName) + " (" + std::to_string((long long)capture.m_processID) + ")");
+      outFile << "}}";
+      firstEvent = false;
+
+      profile_json::Value event;
+      uint64_t skippedCount = 0;
+      while (ReadArrayValue(file, event, skippedCount))
+      {
+        if (event.m_type != profile_json::Type::Object)
+        {
+          continue;
+        }
+
+        // The capture numbers its threads as the pid
+        SetNumber(event, "tid", event.GetNumber("pid"));
+        SetNumber(event, "pid", capture.m_processID);
+        if (event.Find("ts") != nullptr)
+        {
+          SetNumber(event, "ts", event.GetNumber("ts") + offsetUS);
+        }
+
+        // Keep async task / object ids and stack frames unique to the process
+        const profile_json::Value* id = event.Find("id");
+        if (id != nullptr)
+        {
+          SetString(event, "id", prefix + GetIDString(*id));
+        }
+        const profile_json::Value* stackFrame = event.Find("sf");
+        if (stackFrame != nullptr)
+        {
+          SetString(event, "sf", prefix + GetIDString(*stackFrame));
+        }
+
+        outFile << ",\n";
+        profile_json::Write(outFile, event);
+        eventCount++;
+      }
+      if (skippedCount > 0)
+      {
+        fprintf(stderr, "%s: Skipped %llu events that could not be parsed\n", capture.m_fileName.c_str(), (unsigned long long)skippedCount);
+      }
+
+      // Read the sample stack frames after the trace events (one frame per line)
+      if (SkipToLine(file, "\"stackFrames\":{", skipped))
+      {
+        std::string line;
+        while (std::getline(file, line) && line.compare(0, 1, "}") != 0)
+        {
+          size_t keyEnd = line.find("\":");
+          if (line.size() < 2 || line[0] != '"' || keyEnd == std::string::npos)
+          {
+            continue;
+          }
+
+          profile_json::Value frame;
+          std::string error;
+          std::string frameText = line.substr(keyEnd + 2);
+          while (!frameText.empty() && (frameText.back() == ',' || frameText.back() == '\r'))
+          {
+            frameText.pop_back();
+          }
+          if (!profile_json::Parse(frameText, frame, error))
+          {
+            continue;
+          }
+          const profile_json::Value* parent = frame.Find("parent");
+          if (parent != nullptr)
+          {
+            SetString(frame, "parent", prefix + GetIDString(*parent));
+          }
+
+          std::ostringstream ss;
+          profile_json::WriteString(ss, prefix + line.substr(1, keyEnd - 1));
+          ss << ':';
+          profile_json::Write(ss, frame);
+          stackFrames += (stackFrames.empty() ? "\n" : ",\n") + ss.str();
+        }
+      }
+    }
+
+    outFile << "\n]";
+    if (!stackFrames.empty())
+    {
+      outFile << ",\n\"stackFrames\":{" << stackFrames << "\n}";
+    }
+    outFile << "\n}\n";
+
+    printf("Merged %llu events from %zu captures\n", (unsigned long long)eventCount, captures.size());
+    return outFile.good();
+  }
+}
+
+#ifndef PROFILE_MERGE_NO_MAIN
+int main(int argc, char** argv)
+{
+  bool systemClock = false;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--system-clock")
+    {
+      systemClock = true;
+    }
+    else if (arg.size() > 0 && arg[0] == '-')
+    {
+      files.clear();
+      break;
+    }
+    else
+    {
+      files.push_back(arg);
+    }
+  }
+  if (files.size() < 2)
+  {
+    fprintf(stderr, "Usage: ProfileMerge [--system-clock] out.json capture1.json capture2.json ...\n");
+    return 2;
+  }
+  std::vector<std::string> captureFiles(files.begin() + 1, files.end());
+  return MergeCaptures(files[0], captureFiles, systemClock) ? 0 : 2;
+}
+#endif // !PROFILE_MERGE_NO_MAIN
@@ -0,0 +1,595 @@
+///  ProfileStreamReceiver - Receives the records streamed by PROFILE_STREAM_BEGIN() in Profiler.h, printing a live per-tag summary.
+///
+///  Usage:
+///    ProfileStreamReceiver [options] /tmp/myapp.sock
+///
+///    Listens on the Unix domain socket, then receives the records of the first process that connects until it stops
+///    streaming (PROFILE_STREAM_END() / PROFILE_END()) or exits. Each interval, the scopes that ended in that interval are
+///    printed per tag (count, total and max time, most expensive first), and a summary of the whole stream is printed at the end.
+///
+///    With --json the events are also written to a json file as they arrive, so only the receiver's current scope stacks
+///    are kept in memory. Scopes that are still open when the stream stops are closed with an "unclosed" arg.
+///    Task tags (PROFILE_TASK_BEGIN) are skipped.
+///
+///    Records the profiled process could not store as its record buffer was full between batches are counted, printed with
+///    each summary and written to the json as a "Dropped records" counter (increase TAREN_PROFILER_TAG_MAX_COUNT or shorten
+///    the stream period if records are dropped).
+///
+///  Options:
+///    --json out.json   Also write the trace to a json file
+///    --interval-ms N   Time between summaries (default 1000, 0 for only the final summary)
+///    --top N           Number of tags in each summary (default 10, 0 for all)
+///
+///  Exit codes:
+///    0 - Success, 2 - Bad arguments, socket error or bad stream
+///
+///  Build (POSIX only): g++ -std=c++17 -O2 ProfileStreamReceiver.cpp -o ProfileStreamReceiver
+#include "ProfileJson.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+
+namespace
+{
+  const uint32_t c_streamVersion = 3;             // Must match the version in Profiler.h
+  const uint32_t c_copyTagFlag = 0x80000000;      // Tag id flag for an offset into the record buffer's copy buffer
+  const uint32_t c_tagIndexMask = 0x3FFFFFFF;     // Mask to get the offset / index from a tag id
+  const uint32_t c_maxMessageSize = 64 * 1024 * 1024; // Larger messages are a bad stream
+  const uint8_t c_overBudgetFlag = 0x01;          // Record flag for the end of an over budget scope (must match Profiler.h)
+
+  enum class TagType : uint8_t
+  {
+    Begin,
+    End,
+    Value,
+    FunctionBegin,
+    TaskBegin,
+    Gauge = 8,
+  };
+
+  // Same messages as the stream in Profiler.h
+  enum class StreamMessage : uint32_t
+  {
+    Hello = 1,
+    Tag,
+    CopyStrings,
+    Records,
+    Dropped,
+  };
+
+  struct StreamMessageHeader
+  {
+    uint32_t m_type;
+    uint32_t m_size;
+  };
+
+  struct StreamHello
+  {
+    char m_magic[8];
+    uint32_t m_version;
+    int32_t m_processID;
+    int64_t m_startTime;
+    int64_t m_clockNum;
+    int64_t m_clockDen;
+    int64_t m_monotonicStartNS;
+  };
+
+  struct StreamTag
+  {
+    uint32_t m_tagID;
+    uint32_t m_line;
+    uint32_t m_nameSize;
+    uint32_t m_fileSize;
+    uint32_t m_categorySize;
+  };
+
+  struct StreamRecord
+  {
+    int64_t m_time;
+    uint64_t m_thread;
+    uint32_t m_tagID;
+    int32_t m_value;
+    uint8_t m_type;
+    uint8_t m_flags;
+    uint8_t m_pad[6];
+  };
+
+  struct Options
+  {
+    std::string m_jsonFileName;   // The json file to write (empty for none)
+    uint32_t m_intervalMS = 1000; // Time between summaries
+    size_t m_top = 10;            // Number of tags in each summary
+  };
+
+  struct Tag
+  {
+    std::string m_name;     // The tag name
+    std::string m_category; // The tag category
+  };
+
+  struct OpenTag
+  {
+    Tag m_tag;        // The tag (copied, as copied tag names are replaced by the next batch)
+    double m_beginUS; // The begin time
+  };
+
+  struct ThreadState
+  {
+    int32_t m_index = 0;         // The thread index in the output
+    std::vector<OpenTag> m_tags; // The open tags
+  };
+
+  struct TagTotals
+  {
+    uint64_t m_count = 0;   // The number of scopes that ended
+    double m_totalUS = 0.0; // The total time of the scopes
+    double m_maxUS = 0.0;   // The max time of a scope
+  };
+
+  class Receiver
+  {
+  public:
+
+    explicit Receiver(const Options& i_options) : m_options(i_options) {}
+
+    bool Open()
+    {
+      if (!m_options.m_jsonFileName.empty())
+      {
+        m_jsonFile.open(m_options.m_jsonFileName, std::ios::binary);
+        if (!m_jsonFile.is_open())
+        {
+          fprintf(stderr, "Unable to write %s\n", m_options.m_jsonFileName.c_str());
+          return false;
+        }
+      }
+      m_lastSummary = std::chrono::steady_clock::now();
+      return true;
+    }
+
+    bool ReadMessage(int i_socket, bool& o_ended)
+    {
+      StreamMessageHeader header;
+      o_ended = false;
+      if (!ReadAll(i_socket, &header, sizeof(header), o_ended))
+      {
+        return o_ended; // A disconnect between messages is the end of the stream
+      }
+      if (header.m_size > c_maxMessageSize)
+      {
+        fprintf(stderr, "Bad message size %u\n", header.m_size);
+        return false;
+      }
+      m_message.resize(header.m_size);
+      if (!ReadAll(i_socket, m_message.data(), m_message.size(), o_ended))
+      {
+        fprintf(stderr, "Stream ended in a message\n");
+        return false;
+      }
+
+      if (!m_hasHello && header.m_type != (uint32_t)StreamMessage::Hello)
+      {
+        fprintf(stderr, "Stream does not start with a hello message\n");
+        return false;
+      }
+      switch ((StreamMessage)header.m_type)
+      {
+      case StreamMessage::Hello:
+        return ReadHello();
+      case StreamMessage::Tag:
+        return ReadTag();
+      case StreamMessage::CopyStrings:
+        m_copyStrings.assign(m_message.begin(), m_message.end());
+        m_copyStrings.push_back('\0');
+        return true;
+      case StreamMessage::Records:
+        ReadRecords();
+        return true;
+      case StreamMessage::Dropped:
+        return ReadDropped();
+      }
+      return true; // Skip unknown messages
+    }
+
+    void UpdateSummary()
+    {
+      if (m_options.m_intervalMS == 0)
+      {
+        return;
+      }
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (now - m_lastSummary >= std::chrono::milliseconds(m_options.m_intervalMS))
+      {
+        PrintTotals(m_intervalTotals, "interval", m_intervalDroppedCount);
+        m_intervalTotals.clear();
+        m_intervalDroppedCount = 0;
+        m_lastSummary = now;
+      }
+    }
+
+    bool Close()
+    {
+      PrintTotals(m_totals, "total", m_droppedCount);
+      printf("%llu records from pid %d (%llu dropped)\n", (unsigned long long)m_recordCount, (int)m_hello.m_processID, (unsigned long long)m_droppedCount);
+      if (!m_jsonFile.is_open())
+      {
+        return true;
+      }
+      if (!m_hasHello)
+      {
+        m_jsonFile << "{\"traceEvents\":[\n";
+      }
+
+      // Close the scopes that were open when the stream stopped
+      for (auto& t : m_threads)
+      {
+        while (!t.second.m_tags.empty())
+        {
+          WriteEvent("E", t.second.m_tags.back().m_tag, m_lastUS, t.second.m_index);
+          m_jsonFile << "\"args\":{\"unclosed\":true}}";
+          t.second.m_tags.pop_back();
+        }
+      }
+      for (const auto& t : m_threads)
+      {
+        char threadName[64];
+        snprintf(threadName, sizeof(threadName), "Thread%02d_%llu", t.second.m_index, (unsigned long long)t.first);
+        m_jsonFile << (m_firstEvent ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":0,\"pid\":" << t.second.m_index <<
+          ",\"args\":{\"name\":\"" << threadName << "\"}}";
+        m_firstEvent = false;
+      }
+      m_jsonFile << "\n]\n}\n";
+      m_jsonFile.close();
+      return m_jsonFile.good();
+    }
+
+  private:
+
+    static bool ReadAll(int i_socket, void* o_data, size_t i_size, bool& o_ended)
+    {
+      char* data = (char*)o_data;
+      while (i_size > 0)
+      {
+        ssize_t readSize = recv(i_socket, data, i_size, 0);
+        if (readSize < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (readSize <= 0)
+        {
+          o_ended = (readSize == 0);
+          return false;
+        }
+        data += readSize;
+        i_size -= (size_t)readSize;
+      }
+      return true;
+    }
+
+    bool ReadHello()
+    {
+      if (m_message.size() < sizeof(StreamHello))
+      {
+        fprintf(stderr, "Bad hello message\n");
+        return false;
+      }
+      memcpy(&m_hello, m_message.data(), sizeof(m_hello));
+      if (memcmp(m_hello.m_magic, "TARENST", 8) != 0 ||
+          m_hello.m_version != c_streamVersion ||
+          m_hello.m_clockDen == 0)
+      {
+        fprintf(stderr, "Not a profiler stream (or a different version)\n");
+        return false;
+      }
+      m_hasHello = true;
+      printf("Receiving from pid %d\n", (int)m_hello.m_processID);
+      fflush(stdout);
+      if (m_jsonFile.is_open())
+      {
+        m_jsonFile << "{\"otherData\":{\"pid\":" << m_hello.m_processID << ",\"monotonic_start_ns\":" << m_hello.m_monotonicStartNS << "},\n";
+        m_jsonFile << "\"traceEvents\":[\n";
+      }
+      return true;
+    }
+
+    bool ReadTag()
+    {
+      StreamTag tag;
+      if (m_message.size() < sizeof(tag))
+      {
+        fprintf(stderr, "Bad tag message\n");
+        return false;
+      }
+      memcpy(&tag, m_message.data(), sizeof(tag));
+      if ((uint64_t)sizeof(tag) + tag.m_nameSize + tag.m_fileSize + tag.m_categorySize > m_message.size())
+      {
+        fprintf(stderr, "Bad tag message\n");
+        return false;
+      }
+      const char* chars = m_message.data() + sizeof(tag);
+      Tag& entry = m_tags[tag.m_tagID];
+      entry.m_name.assign(chars, tag.m_nameSize);
+      entry.m_category.assign(chars + tag.m_nameSize + tag.m_fileSize, tag.m_categorySize);
+      return true;
+    }
+
+    const Tag& GetTag(uint32_t i_tagID)
+    {
+      if ((i_tagID & c_copyTagFlag) != 0)
+      {
+        // Copied tags are looked up each time, as the copy buffer is replaced each batch
+        uint32_t offset = i_tagID & c_tagIndexMask;
+        m_copyTag.m_name = (offset < m_copyStrings.size()) ? &m_copyStrings[offset] : "Unknown";
+        return m_copyTag;
+      }
+      auto found = m_tags.find(i_tagID);
+      if (found == m_tags.end())
+      {
+        found = m_tags.emplace(i_tagID, Tag{ "Unknown", "" }).first;
+      }
+      return found->second;
+    }
+
+    bool ReadDropped()
+    {
+      uint64_t droppedCount = 0;
+      if (m_message.size() < sizeof(droppedCount))
+      {
+        fprintf(stderr, "Bad dropped message\n");
+        return false;
+      }
+      memcpy(&droppedCount, m_message.data(), sizeof(droppedCount));
+      if (droppedCount == 0)
+      {
+        return true;
+      }
+      m_droppedCount += droppedCount;
+      m_intervalDroppedCount += droppedCount;
+      if (m_jsonFile.is_open())
+      {
+        // The records were dropped before the records of this batch
+        WriteEvent("C", Tag{ "Dropped records", "Profiler" }, m_lastUS, 0);
+        m_jsonFile << "\"args\":{\"value\":" << m_droppedCount << "}}";
+      }
+      return true;
+    }
+
+    void ReadRecords()
+    {
+      size_t recordCount = m_message.size() / sizeof(StreamRecord);
+      for (size_t i = 0; i < recordCount; i++)
+      {
+        StreamRecord record;
+        memcpy(&record, m_message.data() + i * sizeof(StreamRecord), sizeof(record));
+        m_recordCount++;
+
+        ThreadState& thread = m_threads[record.m_thread];
+        if (thread.m_index == 0)
+        {
+          thread.m_index = (int32_t)m_threads.size();
+        }
+
+        double timeUS = (double)(record.m_time - m_hello.m_startTime) * (double)m_hello.m_clockNum * 1000000.0 / (double)m_hello.m_clockDen;
+        m_lastUS = std::max(m_lastUS, timeUS);
+        TagType type = (TagType)record.m_type;
+        if (type == TagType::Gauge)
+        {
+          if (m_jsonFile.is_open())
+          {
+            WriteEvent("C", GetTag(record.m_tagID), timeUS, thread.m_index);
+            m_jsonFile << "\"args\":{\"value\":" << record.m_value << "}}";
+          }
+          continue;
+        }
+        if (type >= TagType::TaskBegin)
+        {
+          continue; // Task tracks are not received
+        }
+        if (type == TagType::End)
+        {
+          if (thread.m_tags.empty())
+          {
+            continue; // Began before the stream
+          }
+          OpenTag openTag = thread.m_tags.back();
+          thread.m_tags.pop_back();
+          AddScope(openTag.m_tag.m_name, timeUS - openTag.m_beginUS);
+          if (m_jsonFile.is_open())
+          {
+            WriteEvent("E", openTag.m_tag, timeUS, thread.m_index);
+            if ((record.m_flags & c_overBudgetFlag) != 0)
+            {
+              m_jsonFile << "\"args\":{\"over_budget\":true,\"budget_us\":" << record.m_value << "}}"; // A PROFILE_SCOPE_BUDGET() scope
+            }
+            else
+            {
+              m_jsonFile << "\"args\":{}}";
+            }
+          }
+          continue;
+        }
+
+        const Tag& tag = GetTag(record.m_tagID);
+        if (type == TagType::Value)
+        {
+          if (m_jsonFile.is_open())
+          {
+            WriteEvent("O", tag, timeUS, thread.m_index);
+            m_jsonFile << "\"id\":";
+            profile_json::WriteString(m_jsonFile, tag.m_name);
+            m_jsonFile << ", \"args\":{\"snapshot\":{\"Value\": " << record.m_value << "}}}";
+          }
+          continue;
+        }
+
+        thread.m_tags.push_back(OpenTag{ tag, timeUS });
+        if (m_jsonFile.is_open())
+        {
+          WriteEvent("B", tag, timeUS, thread.m_index);
+          m_jsonFile << "\"args\":{}}";
+        }
+      }
+    }
+
+    void AddScope(const std::string& i_name, double i_durationUS)
+    {
+      TagTotals* totals[2] = { &m_intervalTotals[i_name], &m_totals[i_name] };
+      for (TagTotals* t : totals)
+      {
+        t->m_count++;
+        t->m_totalUS += i_durationUS;
+        t->m_maxUS = std::max(t->m_maxUS, i_durationUS);
+      }
+    }
+
+    void WriteEvent(const char* i_phase, const Tag& i_tag, double i_timeUS, int32_t i_threadIndex)
+    {
+      m_jsonFile << (m_firstEvent ? "" : ",\n") << "{\"name\":";
+      profile_json::WriteString(m_jsonFile, i_tag.m_name);
+      m_jsonFile << ",\"ph\":\"" << i_phase << "\",\"ts\":" << (long long)i_timeUS << ",\"pid\":" << i_threadIndex << ",\"cat\":";
+      profile_json::WriteString(m_jsonFile, i_tag.m_category);
+      m_jsonFile << ",\"tid\":0,";
+      m_firstEvent = false;
+    }
+
+    void PrintTotals(const std::unordered_map<std::string, TagTotals>& i_totals, const char* i_label, uint64_t i_droppedCount)
+    {
+      std::vector<std::pair<std::string, TagTotals>> rows(i_totals.begin(), i_totals.end());
+      std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.m_totalUS > b.second.m_totalUS; });
+
+      printf("-- %s at %.3fs, %llu records dropped --\n", i_label, m_lastUS / 1000000.0, (unsigned long long)i_droppedCount);
+      printf("%10s %14s %12s %s\n", "count", "total_us", "max_us", "tag");
+      for (size_t i = 0; i < rows.size() && (m_options.m_top == 0 || i < m_options.m_top); i++)
+      {
+        const TagTotals& t = rows[i].second;
+        printf("%10llu %14.1f %12.1f %s\n", (unsigned long long)t.m_count, t.m_totalUS, t.m_maxUS, rows[i].first.c_str());
+      }
+      fflush(stdout);
+    }
+
+    Options m_options;                   // The command line options
+    std::ofstream m_jsonFile;            // The json file being written
+    bool m_firstEvent = true;            // If no json event has been written
+    bool m_hasHello = false;             // If the hello message was received
+    StreamHello m_hello = {};            // The hello message
+    std::vector<char> m_message;         // The message being read
+    std::vector<char> m_copyStrings;     // The copy buffer of the current batch
+    std::map<uint32_t, Tag> m_tags;      // The tags by tag id
+    Tag m_copyTag;                       // The last looked up copied tag
+    std::map<uint64_t, ThreadState> m_threads; // The threads by hashed thread id
+    std::unordered_map<std::string, TagTotals> m_intervalTotals; // The scopes ended since the last summary
+    std::unordered_map<std::string, TagTotals> m_totals;         // The scopes ended since the stream started
+    std::chrono::steady_clock::time_point m_lastSummary;         // The time of the last summary
+    double m_lastUS = 0.0;               // The latest record time
+    uint64_t m_recordCount = 0;          // The number of records received
+    uint64_t m_droppedCount = 0;         // The number of records the process dropped as its buffer was full
+    uint64_t m_intervalDroppedCount = 0; // The number of records dropped since the last summary
+  };
+
+  void PrintUsage()
+  {
+    fprintf(stderr,
+      "Usage: ProfileStreamReceiver [options] /tmp/myapp.sock\n"
+      "  --json out.json  Also write the trace to a json file\n"
+      "  --interval-ms N  Time between summaries (default 1000, 0 for only the final summary)\n"
+      "  --top N          Number of tags in each summary (default 10, 0 for all)\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool hasValue = (i + 1 < argc);
+    if (arg == "--json" && hasValue)
+    {
+      options.m_jsonFileName = argv[++i];
+    }
+    else if (arg == "--interval-ms" && hasValue)
+    {
+      options.m_intervalMS = (uint32_t)atoll(argv[++i]);
+    }
+    else if (arg == "--top" && hasValue)
+    {
+      options.m_top = (size_t)atoll(argv[++i]);
+    }
+    else if (arg.size() > 0 && arg[0] == '-')
+    {
+      PrintUsage();
+      return 2;
+    }
+    else
+    {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.size() != 1)
+  {
+    PrintUsage();
+    return 2;
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(paths[0]) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", paths[0]);
+    return 2;
+  }
+  strcpy(address.sun_path, paths[0]);
+
+  // Replace a socket left by a previous receiver
+  int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(paths[0]);
+  if (listenSocket < 0 ||
+      bind(listenSocket, (const sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listenSocket, 1) != 0)
+  {
+    fprintf(stderr, "Unable to listen on %s: %s\n", paths[0], strerror(errno));
+    return 2;
+  }
+
+  Receiver receiver(options);
+  if (!receiver.Open())
+  {
+    close(listenSocket);
+    unlink(paths[0]);
+    return 2;
+  }
+  printf("Listening on %s\n", paths[0]);
+  fflush(stdout);
+  int streamSocket = accept(listenSocket, nullptr, nullptr);
+  close(listenSocket);
+  unlink(paths[0]);
+  if (streamSocket < 0)
+  {
+    fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+    return 2;
+  }
+
+  bool ended = false;
+  bool valid = true;
+  while (!ended && valid)
+  {
+    valid = receiver.ReadMessage(streamSocket, ended);
+    receiver.UpdateSummary();
+  }
+  close(streamSocket);
+  return (receiver.Close() && valid) ? 0 : 2;
+}